@@ -0,0 +1,537 @@
+#define _GNU_SOURCE // posix_fadvise()
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "lib_tar.h"
+
+/**
+ * Benchmark suite.
+ *
+ *   benchmark gen archive layout entries [file_size]
+ *       writes a synthetic archive, layout being one of
+ *       flat      all the files in one directory,
+ *       deep      a tree with 8 entries per directory,
+ *       symlinks  files, links to them and links to links,
+ *       big       `entries` files of file_size bytes (1 GiB by default), sparse on disk.
+ *   benchmark run archive [budget_seconds] [max_ops]
+ *       times every query of the fd-based and the handle-based APIs.
+ *   benchmark aio archive [reads]
+ *       measures random small-file reads per second through tar_aio at queue depths 1 to 128.
+ *   benchmark digest archive [max_threads]
+ *       measures tar_digest_all() throughput for each algorithm with 1 to max_threads threads.
+ *
+ * Results are printed as one JSON object per line so that runs can be compared against a baseline.
+ * Read system calls and bytes come from /proc/self/io (syscr and rchar), which covers read(), pread() and
+ * preadv() but not lseek().
+ */
+
+#define READ_SIZE 4096
+#define SAMPLE_MAX 100000
+#define PATH_LEN 101
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Generator
+ */
+
+static int gen_template(const char *path, uint64_t size, int sparse) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (sparse) {
+        int ret = ftruncate(fd, size);
+        close(fd);
+        return ret;
+    }
+    char buffer[4096];
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = 'a' + i % 26;
+    }
+    for (uint64_t done = 0; done < size;) {
+        size_t chunk = size - done < sizeof(buffer) ? size - done : sizeof(buffer);
+        if (write(fd, buffer, chunk) != chunk) {
+            close(fd);
+            return -1;
+        }
+        done += chunk;
+    }
+    return close(fd);
+}
+
+/* Directory of file i in the deep layout: one level per base 8 digit of i / 8. */
+static size_t deep_dir(char *path, size_t i, int levels, int level_max) {
+    size_t len = snprintf(path, PATH_LEN, "deep");
+    for (int level = levels - 1; level >= level_max; level--) {
+        size_t digit = i;
+        for (int j = 0; j < level; j++) {
+            digit /= 8;
+        }
+        len += snprintf(path + len, PATH_LEN - len, "/d%zu", digit % 8);
+    }
+    return len;
+}
+
+static int gen(const char *archive_path, const char *layout, size_t entries, uint64_t file_size) {
+    int big = strcmp(layout, "big") == 0;
+    if (file_size == 0) {
+        file_size = big ? 1ULL << 30 : 1024;
+    }
+    char template[] = "/tmp/lib_tar_bench_XXXXXX";
+    int template_fd = mkstemp(template);
+    if (template_fd < 0 || gen_template(template, file_size, big) < 0) {
+        perror("template");
+        return -1;
+    }
+    close(template_fd);
+    chmod(template, 0644);
+
+    int fd = open(archive_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *writer = fd >= 0 ? tar_writer_open(fd, 0) : NULL;
+    if (writer == NULL) {
+        perror("archive");
+        unlink(template);
+        return -1;
+    }
+
+    int levels = 1;
+    for (size_t n = 8; n < entries; n *= 8) {
+        levels++;
+    }
+    char path[PATH_LEN], target[PATH_LEN];
+    tar_writer_add_dir(writer, layout, 0755);
+    for (size_t i = 0; i < entries; i++) {
+        if (strcmp(layout, "deep") == 0) {
+            // the directories whose digit changed since the previous file are new
+            for (int level = levels - 1; level >= 1; level--) {
+                size_t digit = i, previous = i - 1;
+                for (int j = 0; j < level; j++) {
+                    digit /= 8;
+                    previous /= 8;
+                }
+                if (i == 0 || digit != previous) {
+                    for (int deeper = level; deeper >= 1; deeper--) {
+                        deep_dir(path, i, levels, deeper);
+                        tar_writer_add_dir(writer, path, 0755);
+                    }
+                    break;
+                }
+            }
+            size_t len = deep_dir(path, i, levels, 1);
+            snprintf(path + len, sizeof(path) - len, "/f%zu", i);
+            tar_writer_add_file(writer, path, template);
+        } else if (strcmp(layout, "symlinks") == 0 && i % 3 != 0) {
+            // a link to the file before it, then a link to that link
+            snprintf(path, sizeof(path), "symlinks/l%zu", i);
+            snprintf(target, sizeof(target), i % 3 == 1 ? "f%zu" : "l%zu", i - 1);
+            tar_writer_add_symlink(writer, path, target);
+        } else {
+            snprintf(path, sizeof(path), "%s/f%zu", layout, i);
+            tar_writer_add_file(writer, path, template);
+        }
+    }
+
+    int ret = tar_writer_close(writer);
+    close(fd);
+    unlink(template);
+    if (ret != 0) {
+        fprintf(stderr, "tar_writer_close returned %d\n", ret);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Queries
+ */
+
+typedef struct {
+    char path[PATH_LEN];
+    char typeflag;
+    uint64_t offset;
+} sample_t;
+
+typedef struct {
+    sample_t *all;
+    size_t no_all;
+    size_t no_entries;
+    sample_t *files, *dirs, *links;
+    size_t no_files, no_dirs, no_links;
+} samples_t;
+
+static int sample_offset_cmp(const void *a, const void *b) {
+    const sample_t *x = a, *y = b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Keeps a uniform sample of at most SAMPLE_MAX entries, in archive order. */
+static void collect_samples(int fd, samples_t *samples) {
+    tar_iter_t iter;
+    tar_iter_entry_t entry;
+    unsigned seed = 1;
+
+    memset(samples, 0, sizeof(*samples));
+    samples->all = malloc(SAMPLE_MAX * sizeof(sample_t));
+    tar_iter_init(&iter, fd);
+    while (tar_iter_next(&iter, &entry) == 1) {
+        size_t slot = samples->no_entries++;
+        if (slot >= SAMPLE_MAX) {
+            slot = ((uint64_t) rand_r(&seed) * RAND_MAX + rand_r(&seed)) % samples->no_entries;
+            if (slot >= SAMPLE_MAX) {
+                continue;
+            }
+        } else {
+            samples->no_all++;
+        }
+        memcpy(samples->all[slot].path, entry.name, PATH_LEN);
+        samples->all[slot].typeflag = entry.typeflag;
+        samples->all[slot].offset = entry.offset;
+    }
+    tar_iter_close(&iter);
+    lseek(fd, 0, SEEK_SET);
+    qsort(samples->all, samples->no_all, sizeof(sample_t), sample_offset_cmp);
+
+    samples->files = malloc(samples->no_all * sizeof(sample_t) + 1);
+    samples->dirs = malloc(samples->no_all * sizeof(sample_t) + 1);
+    samples->links = malloc(samples->no_all * sizeof(sample_t) + 1);
+    for (size_t i = 0; i < samples->no_all; i++) {
+        sample_t *sample = &samples->all[i];
+        if (sample->typeflag == REGTYPE || sample->typeflag == AREGTYPE) {
+            samples->files[samples->no_files++] = *sample;
+        } else if (sample->typeflag == DIRTYPE) {
+            samples->dirs[samples->no_dirs++] = *sample;
+        } else if (sample->typeflag == SYMTYPE) {
+            samples->links[samples->no_links++] = *sample;
+        }
+    }
+}
+
+static void free_samples(samples_t *samples) {
+    free(samples->all);
+    free(samples->files);
+    free(samples->dirs);
+    free(samples->links);
+}
+
+enum { OP_CHECK, OP_EXISTS, OP_IS_DIR, OP_IS_FILE, OP_IS_SYMLINK, OP_LIST, OP_READ_FILE };
+static const char *op_names[] = { "check_archive", "exists", "is_dir", "is_file", "is_symlink", "list", "read_file" };
+
+typedef struct {
+    int fd;
+    const tar_archive_t *archive;   // NULL for the fd-based API
+    char **entries;
+    uint8_t *buffer;
+} query_t;
+
+static void run_op(query_t *query, int op, char *path) {
+    size_t no_entries = 64, len = READ_SIZE;
+
+    if (query->archive == NULL) {
+        lseek(query->fd, 0, SEEK_SET);
+        switch (op) {
+            case OP_CHECK: check_archive(query->fd); break;
+            case OP_EXISTS: exists(query->fd, path); break;
+            case OP_IS_DIR: is_dir(query->fd, path); break;
+            case OP_IS_FILE: is_file(query->fd, path); break;
+            case OP_IS_SYMLINK: is_symlink(query->fd, path); break;
+            case OP_LIST: list(query->fd, path, query->entries, &no_entries); break;
+            case OP_READ_FILE: read_file(query->fd, path, 0, query->buffer, &len); break;
+        }
+        return;
+    }
+    switch (op) {
+        case OP_EXISTS: tar_exists(query->archive, path); break;
+        case OP_IS_DIR: tar_is_dir(query->archive, path); break;
+        case OP_IS_FILE: tar_is_file(query->archive, path); break;
+        case OP_IS_SYMLINK: tar_is_symlink(query->archive, path); break;
+        case OP_LIST: tar_list(query->archive, path, query->entries, &no_entries); break;
+        case OP_READ_FILE: tar_read_file(query->archive, path, 0, query->buffer, &len); break;
+    }
+}
+
+static void read_proc_io(uint64_t *syscr, uint64_t *rchar) {
+    char line[128];
+    FILE *io = fopen("/proc/self/io", "r");
+    *syscr = *rchar = 0;
+    if (io == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), io) != NULL) {
+        unsigned long long value;
+        if (sscanf(line, "syscr: %llu", &value) == 1) {
+            *syscr = value;
+        } else if (sscanf(line, "rchar: %llu", &value) == 1) {
+            *rchar = value;
+        }
+    }
+    fclose(io);
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *archive_path, size_t entries, const char *api, const char *op, const char *order,
+                   const char *cache, double *latencies, size_t ops, double elapsed, uint64_t syscr, uint64_t rchar) {
+    qsort(latencies, ops, sizeof(double), double_cmp);
+    printf("{\"archive\": \"%s\", \"entries\": %zu, \"api\": \"%s\", \"op\": \"%s\", \"order\": \"%s\", "
+           "\"cache\": \"%s\", \"ops\": %zu, \"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+           "\"p99_us\": %.2f, \"max_us\": %.2f, \"read_syscalls_per_op\": %.1f, \"read_bytes_per_op\": %.0f}\n",
+           archive_path, entries, api, op, order, cache, ops, ops / elapsed,
+           latencies[ops / 2] * 1e6, latencies[ops * 9 / 10] * 1e6, latencies[ops * 99 / 100] * 1e6,
+           latencies[ops - 1] * 1e6, (double) syscr / ops, (double) rchar / ops);
+    fflush(stdout);
+}
+
+/* Runs one query until max_ops operations or the time budget is spent, at least once. */
+static void run_case(const char *archive_path, const samples_t *samples, query_t *query, const char *api, int op,
+                     int random_order, int cold, double budget, size_t max_ops, double *latencies) {
+    const sample_t *pool = samples->all;
+    size_t no_pool = samples->no_all;
+    if ((op == OP_IS_DIR || op == OP_LIST) && samples->no_dirs > 0) {
+        pool = samples->dirs;
+        no_pool = samples->no_dirs;
+    } else if ((op == OP_IS_FILE || op == OP_READ_FILE) && samples->no_files > 0) {
+        pool = samples->files;
+        no_pool = samples->no_files;
+    } else if (op == OP_IS_SYMLINK && samples->no_links > 0) {
+        pool = samples->links;
+        no_pool = samples->no_links;
+    }
+
+    unsigned seed = 7;
+    uint64_t syscr_start, rchar_start, syscr_end, rchar_end;
+    double elapsed = 0;
+    size_t ops = 0;
+    read_proc_io(&syscr_start, &rchar_start);
+    while (ops < max_ops && (ops == 0 || elapsed < budget)) {
+        char path[PATH_LEN];
+        memcpy(path, pool[random_order ? rand_r(&seed) % no_pool : ops % no_pool].path, PATH_LEN);
+        if (cold) {
+            posix_fadvise(query->fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        double start = now();
+        run_op(query, op, path);
+        latencies[ops] = now() - start;
+        elapsed += latencies[ops++];
+    }
+    read_proc_io(&syscr_end, &rchar_end);
+
+    report(archive_path, samples->no_entries, api, op_names[op],
+           op == OP_CHECK ? "none" : random_order ? "random" : "sequential", cold ? "cold" : "warm",
+           latencies, ops, elapsed, syscr_end - syscr_start, rchar_end - rchar_start);
+}
+
+static int run(const char *archive_path, double budget, size_t max_ops) {
+    int fd = open(archive_path, O_RDONLY);
+    if (fd < 0) {
+        perror("open(tar_file)");
+        return -1;
+    }
+    samples_t samples;
+    collect_samples(fd, &samples);
+    if (samples.no_all == 0 || max_ops == 0) {
+        fprintf(stderr, "no entry in %s\n", archive_path);
+        return -1;
+    }
+
+    double *latencies = malloc(max_ops * sizeof(double));
+    query_t query = { fd, NULL, malloc(64 * sizeof(char *)), malloc(READ_SIZE) };
+    for (int i = 0; i < 64; i++) {
+        query.entries[i] = malloc(PATH_LEN);
+    }
+
+    // building the index is what the handle-based API pays up front
+    tar_archive_t *archive = NULL;
+    for (int cold = 1; cold >= 0; cold--) {
+        uint64_t syscr_start, rchar_start, syscr_end, rchar_end;
+        if (cold) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        tar_close(archive);
+        read_proc_io(&syscr_start, &rchar_start);
+        double start = now();
+        archive = tar_open(fd);
+        latencies[0] = now() - start;
+        read_proc_io(&syscr_end, &rchar_end);
+        report(archive_path, samples.no_entries, "handle", "tar_open", "none", cold ? "cold" : "warm", latencies, 1,
+               latencies[0], syscr_end - syscr_start, rchar_end - rchar_start);
+    }
+
+    for (int cold = 0; cold < 2; cold++) {
+        run_case(archive_path, &samples, &query, "fd", OP_CHECK, 0, cold, budget, max_ops, latencies);
+    }
+    for (int api = 0; api < 2; api++) {
+        query.archive = api == 0 ? NULL : archive;
+        for (int op = OP_EXISTS; op <= OP_READ_FILE; op++) {
+            for (int random_order = 0; random_order < 2; random_order++) {
+                for (int cold = 0; cold < 2; cold++) {
+                    run_case(archive_path, &samples, &query, api == 0 ? "fd" : "handle", op, random_order, cold,
+                             budget, max_ops, latencies);
+                }
+            }
+        }
+    }
+
+    tar_close(archive);
+    for (int i = 0; i < 64; i++) {
+        free(query.entries[i]);
+    }
+    free(query.entries);
+    free(query.buffer);
+    free(latencies);
+    free_samples(&samples);
+    close(fd);
+    return 0;
+}
+
+/*
+ * Asynchronous reads
+ */
+
+typedef struct {
+    unsigned seed;
+    tar_read_req_t **ready;     // requests that completed, to be submitted again
+    unsigned no_ready;
+} aio_queue_t;
+
+static void aio_done(tar_read_req_t *request, void *data) {
+    aio_queue_t *queue = data;
+    queue->ready[queue->no_ready++] = request;
+}
+
+static double aio_run(const tar_archive_t *archive, int flags, unsigned depth, const samples_t *samples,
+                      size_t no_reads, int *backend) {
+    tar_aio_t *aio = tar_aio_open(archive, depth, flags);
+    if (aio == NULL) {
+        return 0;
+    }
+    *backend = tar_aio_backend(aio);
+
+    tar_read_req_t *requests = malloc(depth * sizeof(tar_read_req_t));
+    uint8_t *buffers = malloc((size_t) depth * READ_SIZE);
+    struct iovec registered = { buffers, (size_t) depth * READ_SIZE };
+    tar_aio_register(aio, &registered, 1);
+
+    // each request is submitted again as soon as it completes, for another random file
+    aio_queue_t queue = { 42, NULL, 0 };
+    queue.ready = malloc(depth * sizeof(tar_read_req_t *));
+    double start = now();
+    for (unsigned i = 0; i < depth; i++) {
+        requests[i].dest = buffers + (size_t) i * READ_SIZE;
+        queue.ready[queue.no_ready++] = &requests[i];
+    }
+    size_t submitted = 0, completed = 0;
+    while (completed < no_reads) {
+        while (queue.no_ready > 0 && submitted < no_reads) {
+            tar_read_req_t *request = queue.ready[--queue.no_ready];
+            request->path = samples->files[rand_r(&queue.seed) % samples->no_files].path;
+            request->offset = 0;
+            request->len = READ_SIZE;
+            tar_aio_submit(aio, request, aio_done, &queue);
+            submitted++;
+        }
+        int done = tar_aio_poll(aio, 1);
+        if (done <= 0) {
+            break;
+        }
+        completed += done;
+    }
+    double elapsed = now() - start;
+
+    tar_aio_close(aio);
+    free(queue.ready);
+    free(requests);
+    free(buffers);
+    return completed / elapsed;
+}
+
+static int aio(const char *archive_path, size_t no_reads) {
+    int fd = open(archive_path, O_RDONLY);
+    if (fd < 0) {
+        perror("open(tar_file)");
+        return -1;
+    }
+    samples_t samples;
+    collect_samples(fd, &samples);
+    tar_archive_t *archive = tar_open(fd);
+    if (samples.no_files == 0 || archive == NULL) {
+        fprintf(stderr, "no file to read in %s\n", archive_path);
+        return -1;
+    }
+
+    for (unsigned depth = 1; depth <= 128; depth *= 2) {
+        for (int threads = 0; threads < 2; threads++) {
+            int backend = 0;
+            double reads = aio_run(archive, threads ? TAR_AIO_THREADS : 0, depth, &samples, no_reads, &backend);
+            if (!threads && backend != TAR_AIO_URING) {
+                continue; // io_uring unavailable, the thread pool is measured next
+            }
+            printf("{\"archive\": \"%s\", \"entries\": %zu, \"api\": \"aio\", \"backend\": \"%s\", \"depth\": %u, "
+                   "\"reads\": %zu, \"read_size\": %d, \"reads_per_sec\": %.0f}\n", archive_path, samples.no_entries,
+                   threads ? "threads" : "io_uring", depth, no_reads, READ_SIZE, reads);
+        }
+    }
+
+    tar_close(archive);
+    free_samples(&samples);
+    close(fd);
+    return 0;
+}
+
+static int digest(const char *archive_path, int max_threads) {
+    int fd = open(archive_path, O_RDONLY);
+    tar_archive_t *archive = fd >= 0 ? tar_open(fd) : NULL;
+    if (archive == NULL) {
+        perror("open(tar_file)");
+        return -1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+
+    const char *algos[] = { [TAR_DIGEST_XXH64] = "xxh64", [TAR_DIGEST_CRC32C] = "crc32c" };
+    for (int algo = 0; algo < 2; algo++) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            double start = now();
+            int files = tar_digest_all(archive, algo, threads);
+            double elapsed = now() - start;
+            printf("{\"archive\": \"%s\", \"api\": \"digest\", \"algo\": \"%s\", \"threads\": %d, "
+                   "\"files\": %d, \"bytes\": %lld, \"gb_per_sec\": %.2f}\n", archive_path, algos[algo], threads,
+                   files, (long long) st.st_size, st.st_size / elapsed / 1e9);
+        }
+    }
+
+    tar_close(archive);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 5 && strcmp(argv[1], "gen") == 0) {
+        return gen(argv[2], argv[3], strtoull(argv[4], NULL, 10), argc > 5 ? strtoull(argv[5], NULL, 10) : 0);
+    }
+    if (argc >= 3 && strcmp(argv[1], "run") == 0) {
+        return run(argv[2], argc > 3 ? strtod(argv[3], NULL) : 1.0, argc > 4 ? strtoul(argv[4], NULL, 10) : 100000);
+    }
+    if (argc >= 3 && strcmp(argv[1], "aio") == 0) {
+        return aio(argv[2], argc > 3 ? strtoul(argv[3], NULL, 10) : 100000);
+    }
+    if (argc >= 3 && strcmp(argv[1], "digest") == 0) {
+        return digest(argv[2], argc > 3 ? atoi(argv[3]) : 8);
+    }
+
+    printf("Usage: %s gen archive flat|deep|symlinks|big entries [file_size]\n", argv[0]);
+    printf("       %s run archive [budget_seconds] [max_ops]\n", argv[0]);
+    printf("       %s aio archive [reads]\n", argv[0]);
+    printf("       %s digest archive [max_threads]\n", argv[0]);
+    return -1;
+}
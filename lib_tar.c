@@ -1,39 +1,746 @@
+#define _GNU_SOURCE // copy_file_range()
 #include "lib_tar.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
 
-int is_null_block(const tar_header_t *header) {
-    const uint8_t *bytes = (const uint8_t *)header;
+#define SYMLINK_MAX_HOPS 32
+#define SCAN_WINDOW_DEFAULT (1 << 20)
+#define PATH_BUF 1024
+
+static size_t path_key_len(const char *path, size_t len) {
+    // "dir/" and "dir" are the same entry
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    return len;
+}
+
+/*
+ * Joins a link target to the directory holding the link, then drops the "." and ".." components.
+ * Returns the length of the resulting path, without leading nor trailing slashes, or -1 if it does not fit.
+ */
+static ssize_t path_normalize(const char *dir, size_t dir_len, const char *target, size_t target_len, char *out) {
+    char joined[PATH_BUF];
+    size_t len = 0, out_len = 0;
+
+    if (target_len > 0 && target[0] == '/') {
+        dir_len = 0; // absolute paths are relative to the root of the archive
+    }
+    if (dir_len + target_len + 2 > sizeof(joined)) {
+        return -1;
+    }
+    memcpy(joined, dir, dir_len);
+    len = dir_len;
+    joined[len++] = '/';
+    memcpy(joined + len, target, target_len);
+    len += target_len;
+
+    for (size_t i = 0; i < len;) {
+        while (i < len && joined[i] == '/') {
+            i++;
+        }
+        size_t end = i;
+        while (end < len && joined[end] != '/') {
+            end++;
+        }
+        size_t part = end - i;
+        if (part == 2 && joined[i] == '.' && joined[i + 1] == '.') {
+            // drop the last component, ".." at the root stays at the root
+            while (out_len > 0 && out[out_len - 1] != '/') {
+                out_len--;
+            }
+            if (out_len > 0) {
+                out_len--;
+            }
+        } else if (part > 0 && !(part == 1 && joined[i] == '.')) {
+            if (out_len > 0) {
+                out[out_len++] = '/';
+            }
+            memcpy(out + out_len, joined + i, part);
+            out_len += part;
+        }
+        i = end;
+    }
+    out[out_len] = '\0';
+    return out_len;
+}
+
+static void copy_entry_name(char *dest, const char *name, size_t len) {
+    // entries are buffers of 100 bytes
+    if (len > 99) {
+        len = 99;
+    }
+    memcpy(dest, name, len);
+    dest[len] = '\0';
+}
+
+
+/*
+ * Block kernels
+ *
+ * Validating an archive boils down to summing the bytes of each header and telling null blocks apart.
+ * Both are done 16 or 32 bytes at a time when the CPU allows it, the kernel being picked once at runtime.
+ */
+
+typedef struct {
+    unsigned int (*sum)(const uint8_t *block);
+    int (*is_zero)(const uint8_t *block);
+} block_kernels_t;
+
+static unsigned int block_sum_scalar(const uint8_t *block) {
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++) {
+        sum += block[i];
+    }
+    return sum;
+}
+
+static int block_is_zero_scalar(const uint8_t *block) {
     for (size_t i = 0; i < sizeof(tar_header_t); i++) {
-        if (bytes[i] != 0) {
+        if (block[i] != 0) {
             return 0; // non-null block
         }
     }
     return 1; // null block
 }
 
-int resolve_symlink(int tar_fd, const char *symlink_path, char *resolved_path) {
-    tar_header_t header;
-    ssize_t num_bytes;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-    while ((num_bytes = read(tar_fd, &header, sizeof(tar_header_t))) == sizeof(tar_header_t)) {
-        if (is_null_block(&header)) {
-            break;
+__attribute__((target("sse2")))
+static unsigned int block_sum_sse2(const uint8_t *block) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (size_t i = 0; i < sizeof(tar_header_t); i += 16) {
+        // sums of absolute differences against zero add up bytes in two 64-bit lanes
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(block + i)), zero));
+    }
+    return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+}
+
+__attribute__((target("sse2")))
+static int block_is_zero_sse2(const uint8_t *block) {
+    __m128i zero = _mm_setzero_si128();
+    // most blocks are headers, give up at the first non-null 64 bytes
+    for (size_t i = 0; i < sizeof(tar_header_t); i += 64) {
+        __m128i acc = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i *)(block + i)), _mm_loadu_si128((const __m128i *)(block + i + 16))),
+                _mm_or_si128(_mm_loadu_si128((const __m128i *)(block + i + 32)), _mm_loadu_si128((const __m128i *)(block + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+            return 0;
         }
+    }
+    return 1;
+}
 
-        if (strncmp(header.name, symlink_path, strlen(symlink_path)) == 0 && header.typeflag == SYMTYPE) {
-            strncpy(resolved_path, header.linkname, sizeof(resolved_path) - 1);
-            resolved_path[sizeof(resolved_path) - 1] = '\0';
-            lseek(tar_fd, -sizeof(tar_header_t), SEEK_CUR);
+__attribute__((target("avx2")))
+static unsigned int block_sum_avx2(const uint8_t *block) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (size_t i = 0; i < sizeof(tar_header_t); i += 32) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(block + i)), zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+}
+
+__attribute__((target("avx2")))
+static int block_is_zero_avx2(const uint8_t *block) {
+    for (size_t i = 0; i < sizeof(tar_header_t); i += 64) {
+        __m256i acc = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(block + i)),
+                                      _mm256_loadu_si256((const __m256i *)(block + i + 32)));
+        if (!_mm256_testz_si256(acc, acc)) {
             return 0;
         }
+    }
+    return 1;
+}
+
+static const block_kernels_t block_kernels[] = {
+    [TAR_SIMD_SCALAR] = { block_sum_scalar, block_is_zero_scalar },
+    [TAR_SIMD_SSE2] = { block_sum_sse2, block_is_zero_sse2 },
+    [TAR_SIMD_AVX2] = { block_sum_avx2, block_is_zero_avx2 },
+};
+
+static int simd_supported(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return TAR_SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return TAR_SIMD_SSE2;
+    }
+    return TAR_SIMD_SCALAR;
+}
+#else
+static const block_kernels_t block_kernels[] = {
+    [TAR_SIMD_SCALAR] = { block_sum_scalar, block_is_zero_scalar },
+};
+
+static int simd_supported(void) {
+    return TAR_SIMD_SCALAR;
+}
+#endif
+
+static const block_kernels_t *kernels = NULL;
+
+static const block_kernels_t *block_kernels_get(void) {
+    // the first caller picks the best kernels, unless tar_simd_level() got there first
+    const block_kernels_t *current = __atomic_load_n(&kernels, __ATOMIC_ACQUIRE);
+    if (current == NULL) {
+        const block_kernels_t *best = &block_kernels[simd_supported()];
+        current = __atomic_compare_exchange_n(&kernels, &current, best, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+                  ? best : current;
+    }
+    return current;
+}
+
+/**
+ * Selects the kernels used to validate headers and detect null blocks.
+ *
+ * @param level One of the TAR_SIMD_* values, or a negative value for the best one supported by the CPU.
+ *              A level the CPU does not support is lowered to the best supported one.
+ *
+ * @return the level now in use.
+ */
+int tar_simd_level(int level) {
+    int supported = simd_supported();
+    if (level < 0 || level > supported) {
+        level = supported;
+    }
+    __atomic_store_n(&kernels, &block_kernels[level], __ATOMIC_RELEASE);
+    return level;
+}
+
+/**
+ * Checks whether a block only contains zero bytes.
+ *
+ * @param header A 512-byte block of the archive.
+ *
+ * @return one if the block is null, zero otherwise.
+ */
+int is_null_block(const tar_header_t *header) {
+    return block_kernels_get()->is_zero((const uint8_t *)header);
+}
+
+/**
+ * Computes the checksum of a header, as stored in its chksum field.
+ *
+ * @param header A header of the archive.
+ *
+ * @return the unsigned sum of all the bytes of the header, the chksum field being counted as spaces.
+ */
+unsigned int tar_header_checksum(const tar_header_t *header) {
+    unsigned int sum = block_kernels_get()->sum((const uint8_t *)header);
+    // the chksum field itself counts as spaces
+    for (size_t i = 0; i < sizeof(header->chksum); i++) {
+        sum += ' ' - (uint8_t)header->chksum[i];
+    }
+    return sum;
+}
+
+/*
+ * Numeric fields are octal digits, usually padded with zeros and ended by a null or a space. They are decoded
+ * 8 digits at a time instead of with strtol(): the digits are found with a mask, moved to the top of a 64-bit word
+ * and combined pairwise in three steps. Values too large for the digits, such as sizes of 8 GiB and more, are
+ * stored by GNU tar in base 256, marked by the high bit of the first byte.
+ */
+
+#define BYTES_OF(x) (0x0101010101010101ull * (x))
+
+/* Loads up to 8 bytes of a field, the first one in the least significant byte. */
+static uint64_t field_load(const char *field, size_t len) {
+    uint64_t word = 0;
+    memcpy(&word, field, len);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/* Decodes the octal digits at the start of a word, and sets `digits` to their number. */
+static uint64_t octal_word(uint64_t word, unsigned *digits) {
+    // bytes other than '0' to '7' are non-zero in `bad`, and have their high bit set in `stop`
+    uint64_t bad = (word & BYTES_OF(0xf8)) ^ BYTES_OF('0');
+    uint64_t stop = (((bad & BYTES_OF(0x7f)) + BYTES_OF(0x7f)) | bad) & BYTES_OF(0x80);
+    unsigned n = stop != 0 ? __builtin_ctzll(stop) / 8 : 8;
+
+    // keep the n digits, then move them to the top so that the last one is the least significant
+    uint64_t shift = 32 - 4 * n;
+    uint64_t d = (word - BYTES_OF('0')) & ((~0ull >> shift) >> shift) & BYTES_OF(0x07);
+    d = (d << shift) << shift;
+
+    d = ((d & 0x0007000700070007ull) << 3) + ((d >> 8) & 0x0007000700070007ull);
+    d = ((d & 0x0000003f0000003full) << 6) + ((d >> 16) & 0x0000003f0000003full);
+    d = ((d & 0x0000000000000fffull) << 12) + ((d >> 32) & 0x0000000000000fffull);
+    *digits = n;
+    return d;
+}
+
+static uint64_t base256_decode(const uint8_t *field, size_t len) {
+    // the second bit of the first byte is the sign, no field of a header can be negative
+    if (field[0] & 0x40) {
+        return 0;
+    }
+    uint64_t value = field[0] & 0x3f;
+    for (size_t i = 1; i < len; i++) {
+        if (value >> 56) {
+            return UINT64_MAX;
+        }
+        value = value << 8 | field[i];
+    }
+    return value;
+}
+
+/* Decodes a numeric field of at most 16 bytes. */
+static uint64_t field_number(const char *field, size_t len) {
+    if ((uint8_t)field[0] & 0x80) {
+        return base256_decode((const uint8_t *)field, len);
+    }
+    // old archives pad with spaces rather than zeros
+    while (len > 0 && *field == ' ') {
+        field++;
+        len--;
+    }
+
+    unsigned digits;
+    uint64_t value = octal_word(field_load(field, len < 8 ? len : 8), &digits);
+    if (digits == 8 && len > 8) {
+        uint64_t low = octal_word(field_load(field + 8, len - 8), &digits);
+        value = (value << (3 * digits)) | low;
+    }
+    return value;
+}
+
+/* Same as TAR_INT() on a field of a header, without reading past the field. */
+#define HEADER_INT(field) field_number((field), sizeof(field))
+
+/* Sizes above this leave no room for the offset of the following header in an off_t. */
+#define HEADER_MAX_SIZE ((uint64_t)INT64_MAX - 1023)
+
+/* Offset of the header following an entry, -1 if the size of the entry is out of range or the offset overflows. */
+static off_t header_next(const tar_header_t *header, off_t offset) {
+    uint64_t size = HEADER_INT(header->size);
+    if (size > HEADER_MAX_SIZE || offset < 0 || (uint64_t)offset > HEADER_MAX_SIZE - size) {
+        return -1;
+    }
+    return offset + sizeof(tar_header_t) + ((size + 511) / 512) * 512;
+}
+
+
+/*
+ * Statistics and tracing
+ *
+ * Counters are kept for the whole process and for each handle opened by tar_open(). They are off by default, a
+ * disabled counter costing one well predicted branch, and are turned on by tar_stats_enable() or by setting TAR_STATS=1
+ * in the environment. TAR_TRACE=1 additionally logs one line per public call to stderr, TAR_TRACE=<path> to a file.
+ * The handle a call works on is remembered per thread for the duration of the call, so that the helpers doing the
+ * system calls do not need to be given it. A call without a handle of its own, such as tar_index_exists() called by
+ * tar_exists(), leaves the one of the enclosing call in place.
+ */
+
+#define STATS_ON 0x1
+#define STATS_TRACE 0x2
+
+static int stats_mode;
+static FILE *trace_file;
+static tar_stats_t global_stats;
+static __thread tar_stats_t *current_stats;
+
+static const char *const stats_function_names[TAR_FN_COUNT] = {
+    "check_archive", "exists", "is_dir", "is_file", "is_symlink", "list", "read_file",
+    "tar_open", "tar_exists", "tar_is_dir", "tar_is_file", "tar_is_symlink", "tar_list", "tar_read_file",
+    "tar_read_file_to_fd", "tar_read_files_batch", "tar_extract", "tar_list_arena", "tar_index_refresh",
+    "tar_digest_all", "tar_query_open", "check_archive_parallel", "tar_index_build", "tar_index_free",
+    "tar_index_exists", "tar_index_is_dir", "tar_index_is_file", "tar_index_is_symlink", "tar_index_list",
+    "tar_index_list_arena", "tar_open_mmap", "tar_close_mmap", "tar_mmap_read_file", "tar_close", "tar_cache_enable",
+    "tar_index_save", "tar_index_load", "tar_index_open", "tar_open_indexed", "tar_iter_init", "tar_iter_next",
+    "tar_iter_read_body", "tar_iter_close", "tar_gz_open", "tar_gz_save", "tar_gz_open_indexed", "tar_gz_close",
+    "tar_gz_read_file", "tar_aio_open", "tar_aio_register", "tar_aio_submit", "tar_aio_poll", "tar_aio_close",
+    "tar_writer_open", "tar_writer_add_file", "tar_writer_add_dir", "tar_writer_add_symlink", "tar_writer_close",
+    "tar_overlay_open", "tar_overlay_close", "tar_overlay_exists", "tar_overlay_is_dir", "tar_overlay_is_file",
+    "tar_overlay_is_symlink", "tar_overlay_read_file", "tar_overlay_list_arena", "tar_digest", "tar_digest_duplicates",
+    "tar_query_next", "tar_query_close",
+};
+
+static int env_flag_set(const char *value) {
+    return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+__attribute__((constructor)) static void stats_from_env(void) {
+    const char *trace = getenv("TAR_TRACE");
+    if (env_flag_set(getenv("TAR_STATS"))) {
+        stats_mode |= STATS_ON;
+    }
+    if (env_flag_set(trace)) {
+        trace_file = strcmp(trace, "1") == 0 ? stderr : fopen(trace, "a");
+        if (trace_file != NULL) {
+            stats_mode |= STATS_ON | STATS_TRACE;
+        }
+    }
+}
+
+#define STATS_ENABLED() __builtin_expect(__atomic_load_n(&stats_mode, __ATOMIC_RELAXED) != 0, 0)
+
+#define STATS_ADD(field, n)                                                                 \
+    do {                                                                                    \
+        if (STATS_ENABLED()) {                                                              \
+            __atomic_fetch_add(&global_stats.field, (n), __ATOMIC_RELAXED);                 \
+            if (current_stats != NULL) {                                                    \
+                __atomic_fetch_add(&current_stats->field, (n), __ATOMIC_RELAXED);           \
+            }                                                                               \
+        }                                                                                   \
+    } while (0)
+
+typedef struct {
+    int mode;           // stats_mode when the call started, zero if nothing is recorded
+    int fn;
+    const char *path;
+    uint64_t start;
+    tar_stats_t *stats;
+    tar_stats_t *saved;
+} stats_span_t;
+
+static uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_span_begin(stats_span_t *span, int fn, tar_stats_t *stats, const char *path) {
+    span->mode = __atomic_load_n(&stats_mode, __ATOMIC_RELAXED);
+    if (__builtin_expect(span->mode == 0, 1)) {
+        return;
+    }
+    span->fn = fn;
+    span->path = path;
+    span->stats = stats;
+    span->saved = current_stats;
+    if (stats != NULL) {
+        current_stats = stats; // otherwise the handle of an enclosing call, if any, keeps counting
+    }
+    span->start = stats_clock();
+}
+
+/* Points a span to the handle it creates, for tar_open(). */
+static void stats_span_attach(stats_span_t *span, tar_stats_t *stats) {
+    if (span->mode != 0) {
+        span->stats = current_stats = stats;
+    }
+}
+
+static void stats_span_end(stats_span_t *span) {
+    if (__builtin_expect(span->mode == 0, 1)) {
+        return;
+    }
+    uint64_t end = stats_clock();
+    current_stats = span->saved;
+    __atomic_fetch_add(&global_stats.calls[span->fn], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&global_stats.nanoseconds[span->fn], end - span->start, __ATOMIC_RELAXED);
+    if (span->stats != NULL) {
+        __atomic_fetch_add(&span->stats->calls[span->fn], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&span->stats->nanoseconds[span->fn], end - span->start, __ATOMIC_RELAXED);
+    }
+    if (span->mode & STATS_TRACE) {
+        fprintf(trace_file, "lib_tar: %s \"%s\" start=%llu ns=%llu tid=%ld\n", stats_function_names[span->fn],
+                span->path != NULL ? span->path : "", (unsigned long long)span->start,
+                (unsigned long long)(end - span->start), (long)syscall(SYS_gettid));
+    }
+}
+
+/* Times the rest of the enclosing block as one call to the public function `fn`. */
+#define STATS_SPAN(fn, stats, path)                                                         \
+    stats_span_t stats_span __attribute__((cleanup(stats_span_end)));                       \
+    stats_span_begin(&stats_span, (fn), (stats), (path))
+
+/* The counters of a handle are updated by calls taking it as const. */
+#define HANDLE_STATS(archive) ((tar_stats_t *)&(archive)->stats)
+
+static ssize_t counted_read(int fd, void *buf, size_t count) {
+    ssize_t num_bytes = read(fd, buf, count);
+    STATS_ADD(read_calls, 1);
+    if (num_bytes > 0) {
+        STATS_ADD(bytes_read, num_bytes);
+    }
+    return num_bytes;
+}
+
+static ssize_t counted_pread(int fd, void *buf, size_t count, off_t offset) {
+    ssize_t num_bytes = pread(fd, buf, count, offset);
+    STATS_ADD(pread_calls, 1);
+    if (num_bytes > 0) {
+        STATS_ADD(bytes_read, num_bytes);
+    }
+    return num_bytes;
+}
+
+static ssize_t counted_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    ssize_t num_bytes = preadv(fd, iov, iovcnt, offset);
+    STATS_ADD(pread_calls, 1);
+    if (num_bytes > 0) {
+        STATS_ADD(bytes_read, num_bytes);
+    }
+    return num_bytes;
+}
+
+static off_t counted_lseek(int fd, off_t offset, int whence) {
+    STATS_ADD(lseek_calls, 1);
+    return lseek(fd, offset, whence);
+}
+
+/**
+ * Turns the counters on or off for the whole process. Tracing, when requested through TAR_TRACE, stops with them.
+ *
+ * @param enable Zero to stop counting, any other value to start.
+ *
+ * @return the previous state, a non-zero value if the counters were on.
+ */
+int tar_stats_enable(int enable) {
+    int mode = enable ? STATS_ON | (trace_file != NULL ? STATS_TRACE : 0) : 0;
+    return __atomic_exchange_n(&stats_mode, mode, __ATOMIC_RELAXED) != 0;
+}
+
+/**
+ * Names a function counted in tar_stats_t.
+ *
+ * @param fn One of the TAR_FN_* values.
+ *
+ * @return the name of the function, or NULL if `fn` is out of range.
+ */
+const char *tar_stats_function_name(int fn) {
+    return fn >= 0 && fn < TAR_FN_COUNT ? stats_function_names[fn] : NULL;
+}
+
+
+/*
+ * Header scanner
+ *
+ * All the functions working on a file descriptor read the archive through a read-ahead window instead of issuing
+ * one read() and one lseek() per header. Headers are handed out as pointers into the window, bodies that end
+ * inside it are skipped without any system call, and larger ones by moving the window.
+ * The window is filled with pread() so that a scan never depends on the file offset; only the fd-based functions
+ * of lib_tar.h move it, once, when they are done.
+ * A header pointer stays valid until the next call to the scanner.
+ */
+
+static size_t scan_window = SCAN_WINDOW_DEFAULT;
+
+/**
+ * Sets the size of the read-ahead window used when scanning an archive.
+ *
+ * @param size The size of the window in bytes, rounded up to a multiple of 512, or zero to restore the default of 1 MiB.
+ */
+void tar_set_scan_window(size_t size) {
+    if (size == 0) {
+        size = SCAN_WINDOW_DEFAULT;
+    }
+    scan_window = ((size + 511) / 512) * 512;
+}
+
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t cap;
+    size_t len;         // bytes held in buf
+    size_t pos;         // next byte to be consumed in buf
+    off_t base;         // archive offset of buf[0]
+    off_t start;        // where the scan started
+    off_t current;      // header returned by the last scanner_next_entry()
+    off_t next;         // header following it, -1 if the size of the current one is out of range
+    int error;
+    int reposition;     // move the file offset to where the scan stopped when closing
+    uint8_t block[sizeof(tar_header_t)];  // fallback window if the allocation fails
+} scanner_t;
+
+static void scanner_init(scanner_t *s, int fd, off_t start) {
+    memset(s, 0, sizeof(scanner_t));
+    s->fd = fd;
+    s->start = start;
+    s->base = s->current = s->next = s->start;
+
+    // no need for a window larger than the archive
+    size_t cap = scan_window;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t remaining = st.st_size > s->start ? st.st_size - s->start : 0;
+        if ((off_t)cap > remaining) {
+            cap = ((remaining + 511) / 512) * 512;
+        }
+    }
+    if (cap > sizeof(s->block)) {
+        s->buf = malloc(cap);
+    }
+    if (s->buf == NULL) {
+        s->buf = s->block;
+        cap = sizeof(s->block);
+    }
+    s->cap = cap;
+}
+
+/* Scans from the file offset, which is left right after what was consumed, as plain read() calls would have. */
+static void scanner_open(scanner_t *s, int fd) {
+    off_t start = counted_lseek(fd, 0, SEEK_CUR);
+    scanner_init(s, fd, start < 0 ? 0 : start);
+    s->reposition = 1;
+}
+
+static void scanner_close(scanner_t *s) {
+    if (s->reposition) {
+        counted_lseek(s->fd, s->base + s->pos, SEEK_SET);
+    }
+    if (s->buf != s->block) {
+        free(s->buf);
+    }
+}
+
+static void scanner_seek(scanner_t *s, off_t offset) {
+    if (offset >= s->base && offset <= s->base + (off_t)s->len) {
+        s->pos = offset - s->base;
+        return;
+    }
+    s->base = offset;
+    s->len = s->pos = 0;
+}
+
+static const tar_header_t *scanner_peek(scanner_t *s) {
+    if (s->error) {
+        return NULL;
+    }
+    if (s->len - s->pos < sizeof(tar_header_t)) {
+        // keep the unconsumed bytes and refill behind them
+        memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+        s->base += s->pos;
+        s->len -= s->pos;
+        s->pos = 0;
+        while (s->len < sizeof(tar_header_t)) {
+            ssize_t num_bytes = counted_pread(s->fd, s->buf + s->len, s->cap - s->len, s->base + s->len);
+            if (num_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (num_bytes < 0) {
+                s->error = 1;
+                return NULL;
+            }
+            if (num_bytes == 0) {
+                return NULL;
+            }
+            s->len += num_bytes;
+        }
+    }
+    return (const tar_header_t *)(s->buf + s->pos);
+}
+
+static const tar_header_t *scanner_next(scanner_t *s) {
+    const tar_header_t *header = scanner_peek(s);
+    if (header != NULL) {
+        s->pos += sizeof(tar_header_t);
+        STATS_ADD(headers, 1);
+    }
+    return header;
+}
+
+static void scanner_rewind(scanner_t *s) {
+    scanner_seek(s, s->start);
+    s->current = s->next = s->start;
+}
+
+/* Returns the next non-null header, the body of the previous one is skipped. */
+static const tar_header_t *scanner_next_entry(scanner_t *s) {
+    scanner_seek(s, s->next);
+    const tar_header_t *header = scanner_next(s);
+    if (header == NULL || is_null_block(header)) {
+        return NULL;
+    }
+    s->current = s->next;
+    s->next = header_next(header, s->current);
+    return s->next < 0 ? NULL : header;
+}
+
+/* Reads len bytes at the given archive offset, from the window when it holds them. */
+static ssize_t scanner_read(scanner_t *s, off_t offset, void *dest, size_t len) {
+    if (offset >= s->base && offset + (off_t)len <= s->base + (off_t)s->len) {
+        memcpy(dest, s->buf + (offset - s->base), len);
+        return len;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t num_bytes = counted_pread(s->fd, (uint8_t *)dest + done, len - done, offset + done);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes < 0) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+        done += num_bytes;
+    }
+    return done;
+}
 
-        size_t file_size = TAR_INT(header.size);
-        lseek(tar_fd, ((file_size + 511) / 512) * 512, SEEK_CUR);
+/*
+ * Looks for the first entry named `path` from the start of the scan and copies its header.
+ * With `loose` set, trailing slashes are ignored on both sides.
+ */
+static int scanner_find(scanner_t *s, const char *path, int loose, tar_header_t *found) {
+    size_t path_len = strlen(path);
+    if (loose) {
+        path_len = path_key_len(path, path_len);
     }
 
+    scanner_rewind(s);
+    const tar_header_t *header;
+    while ((header = scanner_next_entry(s)) != NULL) {
+        if (loose) {
+            size_t name_len = path_key_len(header->name, strnlen(header->name, sizeof(header->name)));
+            if (name_len != path_len || memcmp(header->name, path, path_len) != 0) {
+                continue;
+            }
+        } else if (strncmp(header->name, path, sizeof(header->name)) != 0) {
+            continue;
+        }
+        memcpy(found, header, sizeof(tar_header_t));
+        return 0;
+    }
     return -1;
 }
 
+/* Returns 0 for a valid header, or the error code of check_archive(). */
+static int check_header(const tar_header_t *header) {
+    // valid magic
+    if (strncmp(header->magic, TMAGIC, TMAGLEN) != 0) {
+        return -1;
+    }
+
+    // valid version
+    if (strncmp(header->version, TVERSION, TVERSLEN) != 0) {
+        return -2;
+    }
+
+    // valid checksum value
+    if (tar_header_checksum(header) != HEADER_INT(header->chksum)) {
+        return -3;
+    }
+
+    // a size no archive can hold is no more valid than a bad magic value
+    if (header_next(header, 0) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Checks whether the archive is valid.
  *
@@ -50,330 +757,6294 @@ int resolve_symlink(int tar_fd, const char *symlink_path, char *resolved_path) {
  *         -3 if the archive contains a header with an invalid checksum value
  */
 int check_archive(int tar_fd){
-    tar_header_t header;
+    STATS_SPAN(TAR_FN_CHECK_ARCHIVE, NULL, NULL);
+    scanner_t scanner;
+    const tar_header_t *header;
     int valid_headers = 0;
-    ssize_t num_bytes;
+    int ret = 0;
+
+    scanner_open(&scanner, tar_fd);
+    while ((header = scanner_next(&scanner)) != NULL) {
+        // check if header is null
+        if (is_null_block(header)) {
+            const tar_header_t *next_header = scanner_peek(&scanner);
+            if (next_header == NULL || is_null_block(next_header)) {
+                if (next_header != NULL) {
+                    scanner_next(&scanner);
+                }
+                break;
+            }
+            // a lone null block is a header with an invalid magic value
+            ret = -1;
+            break;
+        }
+
+        ret = check_header(header);
+        if (ret < 0) {
+            break;
+        }
+
+        valid_headers++;
+
+        // ignore file contents
+        off_t next = header_next(header, scanner.base + scanner.pos - sizeof(tar_header_t));
+        if (next < 0) {
+            ret = -1;
+            break;
+        }
+        scanner_seek(&scanner, next);
+    }
+    scanner_close(&scanner);
+
+    return ret < 0 ? ret : valid_headers;
+}
+
+/*
+ * Parallel validation
+ *
+ * A first sequential pass only follows the size fields to find where the headers are. The headers are then
+ * verified in chunks by worker threads with pread(). Each worker stops as soon as it reaches a header past the
+ * first failure found so far, so the result is always the one of the earliest invalid header.
+ */
+
+#define CHECK_CHUNK 1024
+
+typedef struct {
+    int fd;
+    const off_t *offsets;
+    size_t no_offsets;
+    size_t next_chunk;      // first header of the next chunk to hand out
+    size_t first_error;     // earliest invalid header, no_offsets if none
+    int error;
+    pthread_mutex_t lock;
+} check_job_t;
+
+static void check_job_fail(check_job_t *job, size_t i, int error) {
+    pthread_mutex_lock(&job->lock);
+    if (i < job->first_error) {
+        __atomic_store_n(&job->first_error, i, __ATOMIC_RELAXED);
+        job->error = error;
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *check_worker(void *arg) {
+    check_job_t *job = arg;
+    tar_header_t header;
+
+    for (;;) {
+        size_t start = __atomic_fetch_add(&job->next_chunk, CHECK_CHUNK, __ATOMIC_RELAXED);
+        if (start >= __atomic_load_n(&job->first_error, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+        size_t end = start + CHECK_CHUNK < job->no_offsets ? start + CHECK_CHUNK : job->no_offsets;
+
+        for (size_t i = start; i < end; i++) {
+            if (i >= __atomic_load_n(&job->first_error, __ATOMIC_RELAXED)) {
+                break;
+            }
+            int error = -1; // a header that cannot be read back is no valid header
+            if (counted_pread(job->fd, &header, sizeof(tar_header_t), job->offsets[i]) == sizeof(tar_header_t)) {
+                error = check_header(&header);
+            }
+            if (error < 0) {
+                check_job_fail(job, i, error);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Checks whether the archive is valid, verifying headers on several threads.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nthreads The number of threads verifying headers, or zero to use one per online CPU.
+ *
+ * @return the same value as check_archive() would.
+ */
+int check_archive_parallel(int tar_fd, int nthreads) {
+    STATS_SPAN(TAR_FN_CHECK_ARCHIVE_PARALLEL, NULL, NULL);
+    scanner_t scanner;
+    const tar_header_t *header;
+    off_t *offsets = NULL;
+    size_t no_offsets = 0, cap_offsets = 0;
+    int lone_null_block = 0;
+
+    // find the headers from their size fields only
+    scanner_open(&scanner, tar_fd);
+    while ((header = scanner_next(&scanner)) != NULL) {
+        if (is_null_block(header)) {
+            const tar_header_t *next_header = scanner_peek(&scanner);
+            if (next_header != NULL && !is_null_block(next_header)) {
+                lone_null_block = 1;
+            } else if (next_header != NULL) {
+                scanner_next(&scanner);
+            }
+            break;
+        }
+        if (no_offsets == cap_offsets) {
+            cap_offsets = cap_offsets ? cap_offsets * 2 : 4096;
+            off_t *grown = realloc(offsets, cap_offsets * sizeof(off_t));
+            if (grown == NULL) {
+                // fall back to the sequential check
+                free(offsets);
+                scanner_seek(&scanner, scanner.start);
+                scanner_close(&scanner);
+                return check_archive(tar_fd);
+            }
+            offsets = grown;
+        }
+        offsets[no_offsets++] = scanner.base + scanner.pos - sizeof(tar_header_t);
+
+        // the workers find out that the header is invalid
+        off_t next = header_next(header, offsets[no_offsets - 1]);
+        if (next < 0) {
+            break;
+        }
+        scanner_seek(&scanner, next);
+    }
+    scanner_close(&scanner);
+
+    check_job_t job = {
+        .fd = tar_fd,
+        .offsets = offsets,
+        .no_offsets = no_offsets,
+        .first_error = no_offsets,
+        .error = lone_null_block ? -1 : 0,
+    };
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (nthreads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? cpus : 1;
+    }
+    if ((size_t)nthreads > (no_offsets + CHECK_CHUNK - 1) / CHECK_CHUNK) {
+        nthreads = (no_offsets + CHECK_CHUNK - 1) / CHECK_CHUNK;
+    }
+
+    pthread_t *threads = nthreads > 1 ? malloc((nthreads - 1) * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (threads != NULL && started < nthreads - 1
+            && pthread_create(&threads[started], NULL, check_worker, &job) == 0) {
+        started++;
+    }
+    check_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+    free(offsets);
+
+    if (job.first_error < no_offsets || lone_null_block) {
+        return job.error;
+    }
+    return no_offsets;
+}
+
+static int find_typeflag(int tar_fd, const char *path, char *typeflag) {
+    scanner_t scanner;
+    tar_header_t header;
+
+    scanner_open(&scanner, tar_fd);
+    int ret = scanner_find(&scanner, path, 0, &header);
+    scanner_close(&scanner);
+
+    *typeflag = header.typeflag;
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path) {
+    STATS_SPAN(TAR_FN_EXISTS, NULL, path);
+    char typeflag;
+    return find_typeflag(tar_fd, path, &typeflag) == 0 ? 3 : 0;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path){
+    STATS_SPAN(TAR_FN_IS_DIR, NULL, path);
+    char typeflag;
+    return find_typeflag(tar_fd, path, &typeflag) == 0 && typeflag == DIRTYPE ? 3 : 0;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int is_file(int tar_fd, char *path){
+    STATS_SPAN(TAR_FN_IS_FILE, NULL, path);
+    char typeflag;
+    return find_typeflag(tar_fd, path, &typeflag) == 0 && (typeflag == REGTYPE || typeflag == AREGTYPE) ? 3 : 0;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int is_symlink(int tar_fd, char *path){
+    STATS_SPAN(TAR_FN_IS_SYMLINK, NULL, path);
+    char typeflag;
+    return find_typeflag(tar_fd, path, &typeflag) == 0 && typeflag == SYMTYPE ? 3 : 0;
+}
+
+
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does not recurse into the directories listed at the given path.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    STATS_SPAN(TAR_FN_LIST, NULL, path);
+    scanner_t scanner;
+    tar_header_t header;
+    const tar_header_t *entry;
+    char dir[PATH_BUF + 1];
+    size_t entry_count = 0;
+    int found = 0;
+
+    scanner_open(&scanner, tar_fd);
+
+    // resolve symlink
+    strncpy(dir, path, sizeof(dir) - 2);
+    dir[sizeof(dir) - 2] = '\0';
+    for (int hops = 0; scanner_find(&scanner, dir, 1, &header) == 0; hops++) {
+        if (header.typeflag == DIRTYPE) {
+            found = 1;
+            break;
+        }
+        if (header.typeflag != SYMTYPE || hops == SYMLINK_MAX_HOPS) {
+            scanner_close(&scanner);
+            *no_entries = 0;
+            return 0;
+        }
+        STATS_ADD(symlinks, 1);
+        size_t dir_len = strnlen(header.name, sizeof(header.name));
+        while (dir_len > 0 && header.name[dir_len - 1] != '/') {
+            dir_len--;
+        }
+        if (path_normalize(header.name, dir_len, header.linkname, strnlen(header.linkname, sizeof(header.linkname)),
+                           dir) < 0) {
+            scanner_close(&scanner);
+            *no_entries = 0;
+            return 0;
+        }
+    }
+
+    // children are the entries starting with "dir/" without any other slash but a trailing one
+    size_t path_length = path_key_len(dir, strlen(dir));
+    if (path_length == 1 && dir[0] == '/') {
+        path_length = 0;
+    }
+    if (path_length > 0) {
+        dir[path_length++] = '/';
+    }
+
+    scanner_rewind(&scanner);
+    while ((entry = scanner_next_entry(&scanner)) != NULL) {
+        size_t name_length = strnlen(entry->name, sizeof(entry->name));
+        if (name_length <= path_length || strncmp(entry->name, dir, path_length) != 0) {
+            continue;
+        }
+        const char *subpath = entry->name + path_length;
+        const char *slash_pos = memchr(subpath, '/', name_length - path_length);
+        if (slash_pos == NULL || slash_pos == entry->name + name_length - 1) {
+            // add to table if ok
+            if (entry_count < *no_entries) {
+                copy_entry_name(entries[entry_count], entry->name, name_length);
+            }
+            entry_count++;
+        }
+    }
+    scanner_close(&scanner);
+
+    *no_entries = entry_count;
+
+    // return 0 if not found
+    if (found || path_length == 0 || entry_count > 0) {
+        return 3;
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ *
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    STATS_SPAN(TAR_FN_READ_FILE, NULL, path);
+    scanner_t scanner;
+    tar_header_t header;
+    char link_target[PATH_BUF];
+    const char *name = path;
+
+    scanner_open(&scanner, tar_fd);
+
+    // symbolic link ?
+    for (int hops = 0;; hops++) {
+        if (scanner_find(&scanner, name, 0, &header) < 0 || hops > SYMLINK_MAX_HOPS) {
+            scanner_close(&scanner);
+            return -1;
+        }
+        if (header.typeflag != SYMTYPE) {
+            break;
+        }
+        STATS_ADD(symlinks, 1);
+        size_t dir_len = strnlen(header.name, sizeof(header.name));
+        while (dir_len > 0 && header.name[dir_len - 1] != '/') {
+            dir_len--;
+        }
+        if (path_normalize(header.name, dir_len, header.linkname, strnlen(header.linkname, sizeof(header.linkname)),
+                           link_target) < 0) {
+            scanner_close(&scanner);
+            return -1;
+        }
+        name = link_target;
+    }
+
+    // regular file ?
+    size_t file_size = HEADER_INT(header.size);
+    if (header.typeflag != REGTYPE && header.typeflag != AREGTYPE) {
+        scanner_close(&scanner);
+        return -1;
+    }
+
+    // offset ok ?
+    if (offset >= file_size) {
+        scanner_close(&scanner);
+        return -2;
+    }
+
+    size_t bytes_lenght;
+    if (file_size - offset < *len) {
+        bytes_lenght = file_size - offset;
+    } else {
+        bytes_lenght = *len;
+    }
+
+    // r data
+    ssize_t bytes_r = scanner_read(&scanner, scanner.current + sizeof(tar_header_t) + offset, dest, bytes_lenght);
+    scanner_close(&scanner);
+    if (bytes_r < 0) {
+        return -1;
+    }
+
+    *len = bytes_r;
+
+    // data remaining
+    size_t bytes_left = file_size - offset - bytes_r;
+    if (bytes_left > 0) {
+        return bytes_left;
+    } else {
+        return 0;
+    }
+}
+
+
+/*
+ * Entry index
+ *
+ * Entries are stored in one array, their names and link targets in a separate string arena, and lookups go
+ * through an open-addressing (linear probing) table of entry numbers keyed by the path without trailing slashes.
+ * The table keeps the hash of each path next to its entry number, so a probe reads 8 bytes of the table and only
+ * reaches for an entry and its name when the hashes match.
+ * Everything is referenced by position rather than by pointer so the arrays can grow freely while building.
+ *
+ * Once all the headers are in, the directory tree is laid out: each entry knows its parent, and the children of
+ * a directory sit next to each other in the `children` array, sorted by name. Parent directories without a
+ * header of their own get an implicit entry, which only shows in the tree, so that list() never has to look at
+ * anything but the children of the directory it lists.
+ *
+ * Symbolic links are resolved at the same time. A target is relative to the directory holding the link, may go
+ * through other links, including links to directories in the middle of a path, and each link records the entry
+ * it finally leads to, so following a link at lookup time is a single array access. Chains longer than
+ * SYMLINK_MAX_HOPS links are flagged as loops, which also catches cycles.
+ */
+
+#define INDEX_NO_SLOT 0xffffffffu
+#define ENTRY_IMPLICIT 0x1  // directory without a header, only part of the tree
+#define ENTRY_RESOLVED 0x2  // symbolic link whose target is known
+#define ENTRY_LOOP     0x4  // symbolic link leading to itself, or through too many links
+
+typedef struct {
+    uint64_t offset;    // offset of the header in the archive
+    uint64_t size;      // size of the file contents
+    uint32_t name;      // offset of the path in the arena
+    uint32_t name_len;  // length of the path, trailing slashes excluded
+    uint32_t link;      // offset of the link target in the arena
+    uint32_t parent;        // entry of the parent directory, INDEX_NO_SLOT for the root and shadowed entries
+    uint32_t children;      // first child in the children array
+    uint32_t no_children;
+    uint32_t target;        // entry a symbolic link finally leads to, INDEX_NO_SLOT if broken
+    char typeflag;
+    uint8_t flags;
+    uint16_t mode;      // permission bits
+} tar_entry_t;
+
+/* Hashes live in the table rather than in the entries, so that probing never touches an entry that does not match. */
+typedef struct {
+    uint32_t entry;     // INDEX_NO_SLOT if empty
+    uint32_t hash;
+} index_slot_t;
+
+struct tar_index {
+    tar_entry_t *entries;
+    size_t no_entries;
+    size_t cap_entries;
+
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+
+    index_slot_t *slots;
+    size_t no_slots;    // always a power of two
+
+    uint32_t *children; // children of each directory, grouped by parent
+    size_t no_children;
+    uint32_t root;      // implicit entry with an empty path
+
+    uint64_t start;     // offset of the first header in the archive
+    uint64_t end;       // offset of the end-of-archive marker, where appended entries start
+    void *map;          // sidecar file the arrays point into, if loaded from one
+    size_t map_size;
+
+    uint32_t *links;        // symbolic links, only tracked once refreshed by tar_index_refresh()
+    size_t no_links;
+    size_t cap_links;
+    size_t dead_children;   // part of the children array no directory points to anymore
+
+    uint64_t *digests;      // of the regular files, by entry, computed by tar_digest_all()
+    size_t no_digests;      // entries added later have none
+    int digest_algo;
+};
+
+static uint32_t path_hash(const char *path, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int index_grow_slots(tar_index_t *index) {
+    size_t no_slots = index->no_slots ? index->no_slots * 2 : 64;
+    index_slot_t *slots = malloc(no_slots * sizeof(index_slot_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    memset(slots, 0xff, no_slots * sizeof(index_slot_t));
+
+    for (size_t i = 0; i < index->no_slots; i++) {
+        if (index->slots[i].entry == INDEX_NO_SLOT) {
+            continue;
+        }
+        size_t pos = index->slots[i].hash & (no_slots - 1);
+        while (slots[pos].entry != INDEX_NO_SLOT) {
+            pos = (pos + 1) & (no_slots - 1);
+        }
+        slots[pos] = index->slots[i];
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->no_slots = no_slots;
+    return 0;
+}
+
+static uint32_t index_find(const tar_index_t *index, const char *path, size_t len) {
+    if (index->no_slots == 0) {
+        return INDEX_NO_SLOT;
+    }
+    len = path_key_len(path, len);
+    uint32_t hash = path_hash(path, len);
+    size_t pos = hash & (index->no_slots - 1);
+
+    for (; index->slots[pos].entry != INDEX_NO_SLOT; pos = (pos + 1) & (index->no_slots - 1)) {
+        if (index->slots[pos].hash != hash) {
+            continue;
+        }
+        const tar_entry_t *entry = &index->entries[index->slots[pos].entry];
+        if (entry->name_len == len && memcmp(index->names + entry->name, path, len) == 0) {
+            return index->slots[pos].entry;
+        }
+    }
+    return INDEX_NO_SLOT;
+}
+
+static int index_put_string(tar_index_t *index, const char *str, size_t len, uint32_t *off) {
+    if (index->names_len + len + 1 > index->names_cap) {
+        size_t cap = index->names_cap ? index->names_cap : 4096;
+        while (index->names_len + len + 1 > cap) {
+            cap *= 2;
+        }
+        char *names = realloc(index->names, cap);
+        if (names == NULL) {
+            return -1;
+        }
+        index->names = names;
+        index->names_cap = cap;
+    }
+    *off = index->names_len;
+    memcpy(index->names + index->names_len, str, len);
+    index->names[index->names_len + len] = '\0';
+    index->names_len += len + 1;
+    return 0;
+}
+
+static int index_add_entry(tar_index_t *index, const char *name, size_t name_len, const char *link, size_t link_len,
+                           uint64_t offset, uint64_t size, char typeflag, uint8_t flags, uint16_t mode) {
+    if (index->no_entries == index->cap_entries) {
+        size_t cap = index->cap_entries ? index->cap_entries * 2 : 256;
+        tar_entry_t *entries = realloc(index->entries, cap * sizeof(tar_entry_t));
+        if (entries == NULL) {
+            return -1;
+        }
+        index->entries = entries;
+        index->cap_entries = cap;
+    }
+    // keep the load factor under 1/2
+    if ((index->no_entries + 1) * 2 > index->no_slots && index_grow_slots(index) < 0) {
+        return -1;
+    }
+
+    tar_entry_t *entry = &index->entries[index->no_entries];
+    if (index_put_string(index, name, name_len, &entry->name) < 0
+            || index_put_string(index, link, link_len, &entry->link) < 0) {
+        return -1;
+    }
+    entry->offset = offset;
+    entry->size = size;
+    entry->typeflag = typeflag;
+    entry->flags = flags;
+    entry->mode = mode;
+    entry->name_len = path_key_len(name, name_len);
+    uint32_t hash = path_hash(name, entry->name_len);
+    entry->parent = INDEX_NO_SLOT;
+    entry->children = entry->no_children = 0;
+    entry->target = INDEX_NO_SLOT;
+
+    // later entries shadow earlier ones with the same path
+    size_t pos = hash & (index->no_slots - 1);
+    for (; index->slots[pos].entry != INDEX_NO_SLOT; pos = (pos + 1) & (index->no_slots - 1)) {
+        const tar_entry_t *other = &index->entries[index->slots[pos].entry];
+        if (index->slots[pos].hash == hash && other->name_len == entry->name_len
+                && memcmp(index->names + other->name, index->names + entry->name, entry->name_len) == 0) {
+            break;
+        }
+    }
+    index->slots[pos].entry = index->no_entries;
+    index->slots[pos].hash = hash;
+    index->no_entries++;
+    return 0;
+}
+
+/* Long ustar paths are split between the prefix and name fields, joined once here. */
+static size_t header_path(const tar_header_t *header, char *path) {
+    size_t len = strnlen(header->prefix, sizeof(header->prefix));
+    memcpy(path, header->prefix, len);
+    if (len > 0) {
+        path[len++] = '/';
+    }
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    memcpy(path + len, header->name, name_len);
+    return len + name_len;
+}
+
+static int index_add(tar_index_t *index, const tar_header_t *header, uint64_t offset) {
+    char path[sizeof(header->prefix) + 1 + sizeof(header->name)];
+    size_t len = header_path(header, path);
+    return index_add_entry(index, path, len,
+                           header->linkname, strnlen(header->linkname, sizeof(header->linkname)),
+                           offset, HEADER_INT(header->size), header->typeflag, 0, HEADER_INT(header->mode) & 07777);
+}
+
+static int entry_name_cmp(const tar_index_t *index, uint32_t a, uint32_t b) {
+    const tar_entry_t *x = &index->entries[a], *y = &index->entries[b];
+    size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int cmp = memcmp(index->names + x->name, index->names + y->name, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->name_len < y->name_len ? -1 : x->name_len > y->name_len;
+}
+
+/* Stable merge sort of entry numbers by path. */
+static void sort_by_name(const tar_index_t *index, uint32_t *items, uint32_t *tmp, size_t n) {
+    if (n < 2) {
+        return;
+    }
+    size_t half = n / 2;
+    sort_by_name(index, items, tmp, half);
+    sort_by_name(index, items + half, tmp, n - half);
+    if (entry_name_cmp(index, items[half - 1], items[half]) <= 0) {
+        return;
+    }
+
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        tmp[k++] = entry_name_cmp(index, items[j], items[i]) < 0 ? items[j++] : items[i++];
+    }
+    while (i < half) {
+        tmp[k++] = items[i++];
+    }
+    memcpy(items, tmp, k * sizeof(uint32_t));
+}
+
+/* Returns the directory holding an entry, adding an implicit one if the archive has none. */
+static uint32_t index_parent(tar_index_t *index, uint32_t e) {
+    const tar_entry_t *entry = &index->entries[e];
+    size_t len = entry->name_len;
+    char parent[len + 2];
+    memcpy(parent, index->names + entry->name, len);
+
+    while (len > 0 && parent[len - 1] != '/') {
+        len--;
+    }
+    while (len > 0 && parent[len - 1] == '/') {
+        len--;
+    }
+    if (len == 0) {
+        return index->root;
+    }
+
+    uint32_t p = index_find(index, parent, len);
+    if (p != INDEX_NO_SLOT) {
+        return p;
+    }
+    parent[len] = '/';
+    if (index_add_entry(index, parent, len + 1, "", 0, 0, 0, DIRTYPE, ENTRY_IMPLICIT, 0755) < 0) {
+        return INDEX_NO_SLOT;
+    }
+    return index->no_entries - 1;
+}
+
+static uint32_t index_walk(const tar_index_t *index, const char *path, size_t len, int follow_last, int *hops);
+
+/* Returns the entry a symbolic link leads to, INDEX_NO_SLOT if broken or after too many hops. */
+static uint32_t link_follow(const tar_index_t *index, uint32_t e, int *hops) {
+    const tar_entry_t *link = &index->entries[e];
+    STATS_ADD(symlinks, 1);
+    if (link->flags & ENTRY_RESOLVED) {
+        return link->target;
+    }
+    if (--*hops < 0) {
+        return INDEX_NO_SLOT;
+    }
+
+    // the link lives in the directory part of its own path
+    const char *name = index->names + link->name;
+    size_t dir_len = link->name_len;
+    while (dir_len > 0 && name[dir_len - 1] != '/') {
+        dir_len--;
+    }
+    char target[PATH_BUF];
+    const char *linkname = index->names + link->link;
+    ssize_t len = path_normalize(name, dir_len, linkname, strlen(linkname), target);
+    if (len < 0) {
+        return INDEX_NO_SLOT;
+    }
+    return index_walk(index, target, len, 1, hops);
+}
+
+/*
+ * Finds the entry at a path, going through the symbolic links to directories met along the way.
+ * The last component is followed too when `follow_last` is set, or when the path ends with a slash, which only
+ * names a directory.
+ */
+static uint32_t index_walk(const tar_index_t *index, const char *path, size_t len, int follow_last, int *hops) {
+    if (len > 1 && path[len - 1] == '/') {
+        uint32_t e = index_walk(index, path, path_key_len(path, len), 1, hops);
+        return e != INDEX_NO_SLOT && index->entries[e].typeflag == DIRTYPE ? e : INDEX_NO_SLOT;
+    }
+    uint32_t e = index_find(index, path, len);
+    if (e != INDEX_NO_SLOT) {
+        if (follow_last && index->entries[e].typeflag == SYMTYPE) {
+            return link_follow(index, e, hops);
+        }
+        return e;
+    }
+
+    // the longest leading part of the path in the archive has to be a link
+    len = path_key_len(path, len);
+    for (size_t cut = len; cut > 0; cut--) {
+        if (path[cut - 1] != '/') {
+            continue;
+        }
+        uint32_t p = index_find(index, path, cut - 1);
+        if (p == INDEX_NO_SLOT) {
+            continue;
+        }
+        if (index->entries[p].typeflag != SYMTYPE) {
+            return INDEX_NO_SLOT;
+        }
+        uint32_t dir = link_follow(index, p, hops);
+        if (dir == INDEX_NO_SLOT) {
+            return INDEX_NO_SLOT;
+        }
+
+        const tar_entry_t *target = &index->entries[dir];
+        char resolved[PATH_BUF];
+        if (target->name_len + 1 + (len - cut) + 1 > sizeof(resolved)) {
+            return INDEX_NO_SLOT;
+        }
+        size_t resolved_len = target->name_len;
+        memcpy(resolved, index->names + target->name, resolved_len);
+        if (resolved_len > 0) {
+            resolved[resolved_len++] = '/';
+        }
+        memcpy(resolved + resolved_len, path + cut, len - cut);
+        resolved_len += len - cut;
+        return index_walk(index, resolved, resolved_len, follow_last, hops);
+    }
+    return INDEX_NO_SLOT;
+}
+
+/* Records where a symbolic link leads, the links it goes through being either resolved or not flagged at all. */
+static void link_resolve(tar_index_t *index, uint32_t e) {
+    int hops = SYMLINK_MAX_HOPS;
+    uint32_t target = link_follow(index, e, &hops);
+    index->entries[e].target = target;
+    index->entries[e].flags |= ENTRY_RESOLVED;
+    if (hops < 0) {
+        index->entries[e].flags |= ENTRY_LOOP;
+    }
+}
+
+/* Records where each symbolic link leads, once every entry is known. */
+static void index_resolve_links(tar_index_t *index) {
+    for (size_t i = 0; i < index->no_entries; i++) {
+        index->entries[i].flags &= ~(ENTRY_RESOLVED | ENTRY_LOOP);
+    }
+    for (size_t i = 0; i < index->no_entries; i++) {
+        if (index->entries[i].typeflag == SYMTYPE) {
+            link_resolve(index, i);
+        }
+    }
+}
+
+/* Lays out the directory tree, to be done once all the headers have been added. */
+static int index_finish(tar_index_t *index) {
+    index->root = index_find(index, "", 0);
+    if (index->root == INDEX_NO_SLOT) {
+        if (index_add_entry(index, "", 0, "", 0, 0, 0, DIRTYPE, ENTRY_IMPLICIT, 0755) < 0) {
+            return -1;
+        }
+        index->root = index->no_entries - 1;
+    }
+
+    // implicit directories are appended while looping, and get their own parent in turn
+    size_t no_children = 0;
+    for (size_t i = 0; i < index->no_entries; i++) {
+        index->entries[i].no_children = 0;
+    }
+    for (size_t i = 0; i < index->no_entries; i++) {
+        tar_entry_t *entry = &index->entries[i];
+        entry->parent = INDEX_NO_SLOT;
+        if (i == index->root || index_find(index, index->names + entry->name, entry->name_len) != i) {
+            continue; // the root, or shadowed by a later entry
+        }
+        uint32_t parent = index_parent(index, i);
+        if (parent == INDEX_NO_SLOT) {
+            return -1;
+        }
+        index->entries[i].parent = parent;
+        index->entries[parent].no_children++;
+        no_children++;
+    }
+
+    uint32_t *children = malloc((no_children ? no_children : 1) * sizeof(uint32_t));
+    uint32_t *tmp = malloc((no_children ? no_children : 1) * sizeof(uint32_t));
+    if (children == NULL || tmp == NULL) {
+        free(children);
+        free(tmp);
+        return -1;
+    }
+    uint32_t start = 0;
+    for (size_t i = 0; i < index->no_entries; i++) {
+        index->entries[i].children = start;
+        start += index->entries[i].no_children;
+        index->entries[i].no_children = 0;
+    }
+    for (size_t i = 0; i < index->no_entries; i++) {
+        uint32_t parent = index->entries[i].parent;
+        if (parent != INDEX_NO_SLOT) {
+            tar_entry_t *dir = &index->entries[parent];
+            children[dir->children + dir->no_children++] = i;
+        }
+    }
+    for (size_t i = 0; i < index->no_entries; i++) {
+        sort_by_name(index, children + index->entries[i].children, tmp, index->entries[i].no_children);
+    }
+    free(tmp);
+
+    free(index->children);
+    index->children = children;
+    index->no_children = no_children;
+    index->dead_children = 0;
+
+    index_resolve_links(index);
+    return 0;
+}
+
+static tar_index_t *index_new(void) {
+    tar_index_t *index = calloc(1, sizeof(tar_index_t));
+    if (index == NULL) {
+        return NULL;
+    }
+    if (index_grow_slots(index) < 0) {
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+static tar_index_t *index_scan(scanner_t *scanner) {
+    tar_index_t *index = index_new();
+    if (index == NULL) {
+        return NULL;
+    }
+
+    const tar_header_t *header;
+    index->start = scanner->start;
+    while ((header = scanner_next_entry(scanner)) != NULL) {
+        if (index_add(index, header, scanner->current) < 0) {
+            tar_index_free(index);
+            return NULL;
+        }
+    }
+    index->end = scanner->next;
+
+    if (scanner->error || scanner->next < 0 || index_finish(index) < 0) {
+        tar_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/**
+ * Builds an index of all the entries of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *
+ * @return a newly allocated index to be released with tar_index_free(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_index_t *tar_index_build(int tar_fd) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_BUILD, NULL, NULL);
+    scanner_t scanner;
+
+    scanner_open(&scanner, tar_fd);
+    tar_index_t *index = index_scan(&scanner);
+    scanner_close(&scanner);
+    return index;
+}
+
+/* Builds an index from the file offset without moving it. */
+static tar_index_t *index_build_at(int tar_fd) {
+    scanner_t scanner;
+    off_t start = counted_lseek(tar_fd, 0, SEEK_CUR);
+
+    scanner_init(&scanner, tar_fd, start < 0 ? 0 : start);
+    tar_index_t *index = index_scan(&scanner);
+    scanner_close(&scanner);
+    return index;
+}
+
+/**
+ * Releases an index built by tar_index_build().
+ *
+ * @param index The index to release, may be NULL.
+ */
+void tar_index_free(tar_index_t *index) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_FREE, NULL, NULL);
+    if (index == NULL) {
+        return;
+    }
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+    } else {
+        free(index->entries);
+        free(index->names);
+        free(index->slots);
+        free(index->children);
+        free(index->links);
+    }
+    free(index->digests);
+    free(index);
+}
+
+/* Entries with a header, the tree aside. Links to directories in the middle of the path are followed. */
+static const tar_entry_t *index_lookup(const tar_index_t *index, const char *path) {
+    int hops = SYMLINK_MAX_HOPS;
+    uint32_t e = index_walk(index, path, strlen(path), 0, &hops);
+    if (e == INDEX_NO_SLOT || (index->entries[e].flags & ENTRY_IMPLICIT)) {
+        STATS_ADD(index_misses, 1);
+        return NULL;
+    }
+    STATS_ADD(index_hits, 1);
+    return &index->entries[e];
+}
+
+/* Follows a symbolic link, NULL if the link is broken or loops. */
+static const tar_entry_t *index_follow(const tar_index_t *index, const tar_entry_t *entry) {
+    if (entry == NULL || entry->typeflag != SYMTYPE) {
+        return entry;
+    }
+    STATS_ADD(symlinks, 1);
+    return entry->target == INDEX_NO_SLOT ? NULL : &index->entries[entry->target];
+}
+
+/* Finds the directory list() lists at a path, following links, NULL if there is none. */
+static const tar_entry_t *index_list_dir(const tar_index_t *index, const char *path) {
+    size_t path_len = strlen(path);
+    int hops = SYMLINK_MAX_HOPS;
+    uint32_t e = path_len == 1 && path[0] == '/' ? index->root : index_walk(index, path, path_len, 1, &hops);
+    const tar_entry_t *dir = e == INDEX_NO_SLOT ? NULL : &index->entries[e];
+
+    if (dir == NULL || dir->typeflag != DIRTYPE) {
+        STATS_ADD(index_misses, 1);
+        return NULL;
+    }
+    STATS_ADD(index_hits, 1);
+    return dir;
+}
+
+/* Same contract as list(), answered from the directory tree. */
+static int index_list(const tar_index_t *index, const char *path, char **entries, size_t *no_entries) {
+    const tar_entry_t *dir = index_list_dir(index, path);
+    if (dir == NULL) {
+        *no_entries = 0;
+        return 0;
+    }
+
+    const uint32_t *children = index->children + dir->children;
+    for (size_t i = 0; i < dir->no_children && i < *no_entries; i++) {
+        const char *name = index->names + index->entries[children[i]].name;
+        copy_entry_name(entries[i], name, strlen(name));
+    }
+    *no_entries = dir->no_children;
+    return 3;
+}
+
+/* Same contract as tar_list_arena(), the names pointing into the arena of the index. */
+static ssize_t index_list_arena(const tar_index_t *index, const char *path, tar_list_entry_t **out) {
+    *out = NULL;
+    const tar_entry_t *dir = index_list_dir(index, path);
+    if (dir == NULL) {
+        return -1;
+    }
+    if (dir->no_children == 0) {
+        return 0;
+    }
+
+    tar_list_entry_t *list = malloc(dir->no_children * sizeof(tar_list_entry_t));
+    if (list == NULL) {
+        return -2;
+    }
+    const uint32_t *children = index->children + dir->children;
+    for (size_t i = 0; i < dir->no_children; i++) {
+        const tar_entry_t *child = &index->entries[children[i]];
+        list[i].name = index->names + child->name;
+        list[i].len = strlen(list[i].name);
+        list[i].typeflag = child->typeflag;
+    }
+    *out = list;
+    return dir->no_children;
+}
+
+/**
+ * Index-backed version of exists().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_index_exists(const tar_index_t *index, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_EXISTS, NULL, path);
+    return index_lookup(index, path) != NULL ? 3 : 0;
+}
+
+/**
+ * Index-backed version of is_dir().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_index_is_dir(const tar_index_t *index, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_IS_DIR, NULL, path);
+    const tar_entry_t *entry = index_lookup(index, path);
+    return entry != NULL && entry->typeflag == DIRTYPE ? 3 : 0;
+}
+
+/**
+ * Index-backed version of is_file().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_index_is_file(const tar_index_t *index, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_IS_FILE, NULL, path);
+    const tar_entry_t *entry = index_lookup(index, path);
+    return entry != NULL && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) ? 3 : 0;
+}
+
+/**
+ * Index-backed version of is_symlink().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int tar_index_is_symlink(const tar_index_t *index, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_IS_SYMLINK, NULL, path);
+    const tar_entry_t *entry = index_lookup(index, path);
+    return entry != NULL && entry->typeflag == SYMTYPE ? 3 : 0;
+}
+
+/**
+ * Index-backed version of list().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_index_list(const tar_index_t *index, const char *path, char **entries, size_t *no_entries) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_LIST, NULL, path);
+    return index_list(index, path, entries, no_entries);
+}
+
+/**
+ * Index-backed version of tar_list_arena().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param out Set to an array of the entries listed, to be released with free(), or NULL if there are none.
+ *            The names stay valid until the index is freed.
+ *
+ * @return the number of entries listed,
+ *         -1 if no directory at the given path exists in the archive,
+ *         -2 if memory could not be allocated.
+ */
+ssize_t tar_index_list_arena(const tar_index_t *index, const char *path, tar_list_entry_t **out) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_LIST_ARENA, NULL, path);
+    return index_list_arena(index, path, out);
+}
+
+
+/*
+ * Memory-mapped archives
+ */
+
+struct tar_mmap {
+    const uint8_t *data;
+    size_t size;
+    tar_index_t *index;
+};
+
+/**
+ * Maps an archive in memory and indexes its entries.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file, opened for reading.
+ *
+ * @return a newly allocated handle to be released with tar_close_mmap(),
+ *         NULL if the archive could not be mapped or memory could not be allocated.
+ */
+tar_mmap_t *tar_open_mmap(int tar_fd) {
+    STATS_SPAN(TAR_FN_TAR_OPEN_MMAP, NULL, NULL);
+    struct stat st;
+    off_t start = counted_lseek(tar_fd, 0, SEEK_CUR);
+    if (start < 0 || fstat(tar_fd, &st) < 0) {
+        return NULL;
+    }
+
+    tar_mmap_t *archive = calloc(1, sizeof(tar_mmap_t));
+    if (archive == NULL) {
+        return NULL;
+    }
+    archive->size = st.st_size;
+    if (archive->size > 0) {
+        void *data = mmap(NULL, archive->size, PROT_READ, MAP_SHARED, tar_fd, 0);
+        if (data == MAP_FAILED) {
+            free(archive);
+            return NULL;
+        }
+        archive->data = data;
+    }
+
+    archive->index = index_new();
+    if (archive->index == NULL) {
+        tar_close_mmap(archive);
+        return NULL;
+    }
+
+    // headers are read in place from the mapping
+    size_t offset = start;
+    archive->index->start = start;
+    while (offset + sizeof(tar_header_t) <= archive->size) {
+        const tar_header_t *header = (const tar_header_t *)(archive->data + offset);
+        STATS_ADD(headers, 1);
+        if (is_null_block(header)) {
+            break;
+        }
+        off_t next = header_next(header, offset);
+        if (next < 0 || index_add(archive->index, header, offset) < 0) {
+            tar_close_mmap(archive);
+            return NULL;
+        }
+        offset = next;
+    }
+    if (index_finish(archive->index) < 0) {
+        tar_close_mmap(archive);
+        return NULL;
+    }
+
+    return archive;
+}
+
+/**
+ * Unmaps an archive mapped by tar_open_mmap().
+ *
+ * @param archive The handle to release, may be NULL.
+ */
+void tar_close_mmap(tar_mmap_t *archive) {
+    STATS_SPAN(TAR_FN_TAR_CLOSE_MMAP, NULL, NULL);
+    if (archive == NULL) {
+        return;
+    }
+    if (archive->data != NULL) {
+        munmap((void *)archive->data, archive->size);
+    }
+    tar_index_free(archive->index);
+    free(archive);
+}
+
+/**
+ * Gives access to the index of a mapped archive, to be used with the tar_index_* functions.
+ *
+ * @param archive A handle returned by tar_open_mmap().
+ *
+ * @return the index of the archive, owned by the handle.
+ */
+const tar_index_t *tar_mmap_index(const tar_mmap_t *archive) {
+    return archive->index;
+}
+
+/**
+ * Reads a file at a given path in a mapped archive without copying it.
+ *
+ * @param archive A handle returned by tar_open_mmap().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param data Set to the address, inside the mapping, of the byte at the given offset in the file.
+ * @param len An in-out argument.
+ *            The caller set it to the maximum number of bytes wanted.
+ *            The callee set it to the number of bytes available at `data`.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the slice reaches the end of the file,
+ *         a positive value if it does not, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t tar_mmap_read_file(const tar_mmap_t *archive, const char *path, size_t offset, const uint8_t **data, size_t *len) {
+    STATS_SPAN(TAR_FN_TAR_MMAP_READ_FILE, NULL, path);
+    const tar_entry_t *entry = index_follow(archive->index, index_lookup(archive->index, path));
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) {
+        return -1;
+    }
+    if (offset >= entry->size) {
+        return -2;
+    }
+
+    // a truncated archive holds less than the header says
+    uint64_t start = entry->offset + sizeof(tar_header_t) + offset;
+    if (start >= archive->size) {
+        return -1;
+    }
+    size_t available = archive->size - start;
+    size_t bytes_length = entry->size - offset;
+    if (bytes_length > available) {
+        bytes_length = available;
+    }
+    if (bytes_length > *len) {
+        bytes_length = *len;
+    }
+
+    *data = archive->data + start;
+    *len = bytes_length;
+    return entry->size - offset - bytes_length;
+}
+
+
+/*
+ * Block cache
+ *
+ * An optional cache of archive blocks for handles whose callers read the same small files over and over. Blocks of
+ * CACHE_BLOCK bytes are keyed by their number in the archive and spread over shards, each with its own lock, table
+ * and CLOCK hand, so that concurrent readers rarely contend. A miss reads the whole block without holding the lock
+ * and inserts it afterwards; two threads missing the same block both read it, and the second insert is dropped.
+ * Reads spanning more than CACHE_MAX_SPAN bytes bypass the cache so that a large file does not flush it.
+ */
+
+#define CACHE_BLOCK (16 * 1024)
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define CACHE_MAX_SPAN (16 * CACHE_BLOCK)
+#define CACHE_NO_FRAME 0xffffffffu
+
+typedef struct {
+    uint64_t block;
+    uint32_t len;       // bytes held, less than CACHE_BLOCK at the end of the archive
+    uint32_t next;      // next frame in the same bucket
+    uint8_t referenced; // second chance bit of the CLOCK
+} cache_frame_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    cache_frame_t *frames;
+    uint8_t *data;          // CACHE_BLOCK bytes per frame
+    uint32_t *buckets;      // first frame of each bucket
+    size_t no_frames;       // at most, allocated up front
+    size_t no_buckets;      // always a power of two
+    size_t used;
+    size_t hand;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} __attribute__((aligned(64))) cache_shard_t;
+
+typedef struct {
+    cache_shard_t shards[CACHE_SHARDS];
+} block_cache_t;
+
+static uint64_t cache_hash(uint64_t block) {
+    // Fibonacci hashing, the top bits being the best mixed
+    return block * 11400714819323198485ull;
+}
+
+static void cache_free(block_cache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&cache->shards[i].lock);
+        free(cache->shards[i].frames);
+        free(cache->shards[i].data);
+        free(cache->shards[i].buckets);
+    }
+    free(cache);
+}
+
+static block_cache_t *cache_new(size_t budget) {
+    block_cache_t *cache = calloc(1, sizeof(block_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    size_t no_frames = budget / CACHE_SHARDS / CACHE_BLOCK;
+    if (no_frames == 0) {
+        no_frames = 1;
+    }
+    size_t no_buckets = 1;
+    while (no_buckets < no_frames) {
+        no_buckets *= 2;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->no_frames = no_frames;
+        shard->no_buckets = no_buckets;
+        shard->frames = malloc(no_frames * sizeof(cache_frame_t));
+        shard->data = malloc(no_frames * CACHE_BLOCK);
+        shard->buckets = malloc(no_buckets * sizeof(uint32_t));
+        if (shard->frames == NULL || shard->data == NULL || shard->buckets == NULL) {
+            failed = 1;
+            continue;
+        }
+        memset(shard->buckets, 0xff, no_buckets * sizeof(uint32_t));
+    }
+    if (failed) {
+        cache_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static cache_shard_t *cache_shard(block_cache_t *cache, uint64_t block, uint32_t **bucket) {
+    uint64_t hash = cache_hash(block);
+    cache_shard_t *shard = &cache->shards[hash >> (64 - CACHE_SHARD_BITS)];
+    *bucket = &shard->buckets[(hash >> 16) & (shard->no_buckets - 1)];
+    return shard;
+}
+
+static uint32_t cache_find(const cache_shard_t *shard, const uint32_t *bucket, uint64_t block) {
+    uint32_t f = *bucket;
+    while (f != CACHE_NO_FRAME && shard->frames[f].block != block) {
+        f = shard->frames[f].next;
+    }
+    return f;
+}
+
+/* Takes a frame for a new block, evicting the first one the hand finds not referenced since it last passed. */
+static uint32_t cache_take_frame(block_cache_t *cache, cache_shard_t *shard) {
+    if (shard->used < shard->no_frames) {
+        return shard->used++;
+    }
+    while (shard->frames[shard->hand].referenced) {
+        shard->frames[shard->hand].referenced = 0;
+        shard->hand = (shard->hand + 1) % shard->no_frames;
+    }
+    uint32_t victim = shard->hand;
+    shard->hand = (shard->hand + 1) % shard->no_frames;
+
+    // unlink it from its bucket, unless cache_drop() already did
+    uint32_t *link;
+    cache_shard(cache, shard->frames[victim].block, &link);
+    while (*link != CACHE_NO_FRAME && *link != victim) {
+        link = &shard->frames[*link].next;
+    }
+    if (*link == victim) {
+        *link = shard->frames[victim].next;
+        shard->evictions++;
+    }
+    return victim;
+}
+
+/* Reads a whole block of the archive, returns its length, short at the end of the archive, or -1. */
+static ssize_t cache_fill(int fd, uint64_t block, uint8_t *data) {
+    size_t done = 0;
+    while (done < CACHE_BLOCK) {
+        ssize_t num_bytes = counted_pread(fd, data + done, CACHE_BLOCK - done, block * CACHE_BLOCK + done);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes < 0) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+        done += num_bytes;
+    }
+    return done;
+}
+
+/* Forgets the blocks holding a range of the archive so that they are read again, their frames left for the hand. */
+static void cache_drop(block_cache_t *cache, uint64_t from, uint64_t to) {
+    for (uint64_t block = from / CACHE_BLOCK; block <= to / CACHE_BLOCK; block++) {
+        uint32_t *link;
+        cache_shard_t *shard = cache_shard(cache, block, &link);
+        pthread_mutex_lock(&shard->lock);
+        while (*link != CACHE_NO_FRAME && shard->frames[*link].block != block) {
+            link = &shard->frames[*link].next;
+        }
+        if (*link != CACHE_NO_FRAME) {
+            uint32_t f = *link;
+            *link = shard->frames[f].next;
+            shard->frames[f].referenced = 0;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* Same as a pread() of the archive, served from the cache. Returns the number of bytes read or -1. */
+static ssize_t cache_read(block_cache_t *cache, int fd, uint8_t *dest, size_t len, uint64_t start) {
+    uint8_t block_data[CACHE_BLOCK];
+    size_t done = 0;
+    while (done < len) {
+        uint64_t block = (start + done) / CACHE_BLOCK;
+        size_t in_block = (start + done) % CACHE_BLOCK;
+        size_t want = len - done < CACHE_BLOCK - in_block ? len - done : CACHE_BLOCK - in_block;
+        size_t got;
+
+        uint32_t *bucket;
+        cache_shard_t *shard = cache_shard(cache, block, &bucket);
+        pthread_mutex_lock(&shard->lock);
+        uint32_t f = cache_find(shard, bucket, block);
+        if (f != CACHE_NO_FRAME) {
+            cache_frame_t *frame = &shard->frames[f];
+            frame->referenced = 1;
+            shard->hits++;
+            got = frame->len > in_block ? frame->len - in_block : 0;
+            got = got < want ? got : want;
+            memcpy(dest + done, shard->data + (size_t)f * CACHE_BLOCK + in_block, got);
+            pthread_mutex_unlock(&shard->lock);
+        } else {
+            shard->misses++;
+            pthread_mutex_unlock(&shard->lock);
+
+            ssize_t block_len = cache_fill(fd, block, block_data);
+            if (block_len < 0) {
+                return -1;
+            }
+            got = (size_t)block_len > in_block ? block_len - in_block : 0;
+            got = got < want ? got : want;
+            memcpy(dest + done, block_data + in_block, got);
+
+            pthread_mutex_lock(&shard->lock);
+            if (cache_find(shard, bucket, block) == CACHE_NO_FRAME) {
+                f = cache_take_frame(cache, shard);
+                shard->frames[f] = (cache_frame_t) { block, block_len, *bucket, 1 };
+                *bucket = f;
+                memcpy(shard->data + (size_t)f * CACHE_BLOCK, block_data, block_len);
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+
+        done += got;
+        if (got < want) {
+            break; // end of the archive
+        }
+    }
+    return done;
+}
+
+
+/*
+ * Reentrant archives
+ *
+ * A handle is only modified by tar_index_refresh(): lookups only read the index and file contents are read with
+ * pread(), so any number of threads can query the same handle without locking. The block cache, when enabled, is
+ * the only shared state and locks its shards.
+ */
+
+struct tar_archive {
+    int fd;
+    tar_index_t *index;
+    tar_stats_t stats;
+    block_cache_t *cache;   // NULL unless enabled with tar_cache_enable()
+    off_t size;             // of the archive when last refreshed by tar_index_refresh()
+    struct timespec mtime;
+};
+
+/**
+ * Opens an archive for concurrent queries.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *
+ * @return a newly allocated handle to be released with tar_close(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_archive_t *tar_open(int tar_fd) {
+    STATS_SPAN(TAR_FN_TAR_OPEN, NULL, NULL);
+    tar_archive_t *archive = calloc(1, sizeof(tar_archive_t));
+    if (archive == NULL) {
+        return NULL;
+    }
+    stats_span_attach(&stats_span, &archive->stats);
+
+    archive->fd = tar_fd;
+    archive->index = index_build_at(tar_fd);
+    if (archive->index == NULL) {
+        stats_span_attach(&stats_span, NULL);
+        free(archive);
+        return NULL;
+    }
+    return archive;
+}
+
+/**
+ * Releases a handle opened by tar_open(). The file descriptor is left open.
+ *
+ * @param archive The handle to release, may be NULL.
+ */
+void tar_close(tar_archive_t *archive) {
+    STATS_SPAN(TAR_FN_TAR_CLOSE, NULL, NULL);
+    if (archive == NULL) {
+        return;
+    }
+    tar_index_free(archive->index);
+    cache_free(archive->cache);
+    free(archive);
+}
+
+/**
+ * Copies the counters of a handle, or of the whole process.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the counters of every call in the process.
+ * @param out The structure to fill.
+ */
+void tar_stats_get(const tar_archive_t *archive, tar_stats_t *out) {
+    const uint64_t *from = (const uint64_t *)(archive != NULL ? HANDLE_STATS(archive) : &global_stats);
+    uint64_t *to = (uint64_t *)out;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Sets the counters of a handle, or of the whole process, back to zero.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the process-wide counters.
+ */
+void tar_stats_reset(tar_archive_t *archive) {
+    uint64_t *counters = (uint64_t *)(archive != NULL ? &archive->stats : &global_stats);
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Enables, resizes or disables the block cache of a handle. Must not be called while other threads use the handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param budget The memory the cached blocks may take, in bytes, or zero to disable the cache.
+ *
+ * @return zero on success, -1 if memory could not be allocated, in which case the cache is left disabled.
+ */
+int tar_cache_enable(tar_archive_t *archive, size_t budget) {
+    STATS_SPAN(TAR_FN_TAR_CACHE_ENABLE, HANDLE_STATS(archive), NULL);
+    cache_free(archive->cache);
+    archive->cache = NULL;
+    if (budget == 0) {
+        return 0;
+    }
+    archive->cache = cache_new(budget);
+    return archive->cache != NULL ? 0 : -1;
+}
+
+/**
+ * Copies the counters of the block cache of a handle, which are kept whether tar_stats_enable() was called or not.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param out The structure to fill, zeroed if the cache is disabled.
+ */
+void tar_cache_stats(const tar_archive_t *archive, tar_cache_stats_t *out) {
+    memset(out, 0, sizeof(tar_cache_stats_t));
+    if (archive->cache == NULL) {
+        return;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &archive->cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        out->hits += shard->hits;
+        out->misses += shard->misses;
+        out->evictions += shard->evictions;
+        out->capacity += shard->no_frames * CACHE_BLOCK;
+        out->used += shard->used * CACHE_BLOCK;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* Reads a span of the archive, through the cache if it is enabled and the span small enough. */
+static ssize_t handle_read(const tar_archive_t *archive, uint8_t *dest, size_t len, uint64_t start) {
+    if (archive->cache != NULL && len <= CACHE_MAX_SPAN) {
+        return cache_read(archive->cache, archive->fd, dest, len, start);
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t num_bytes = counted_pread(archive->fd, dest + done, len - done, start + done);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes < 0) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+        done += num_bytes;
+    }
+    return done;
+}
+
+/**
+ * Reentrant version of exists().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_exists(const tar_archive_t *archive, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_EXISTS, HANDLE_STATS(archive), path);
+    return tar_index_exists(archive->index, path);
+}
+
+/**
+ * Reentrant version of is_dir().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_is_dir(const tar_archive_t *archive, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_IS_DIR, HANDLE_STATS(archive), path);
+    return tar_index_is_dir(archive->index, path);
+}
+
+/**
+ * Reentrant version of is_file().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_is_file(const tar_archive_t *archive, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_IS_FILE, HANDLE_STATS(archive), path);
+    return tar_index_is_file(archive->index, path);
+}
+
+/**
+ * Reentrant version of is_symlink().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int tar_is_symlink(const tar_archive_t *archive, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_IS_SYMLINK, HANDLE_STATS(archive), path);
+    return tar_index_is_symlink(archive->index, path);
+}
+
+/**
+ * Reentrant version of list().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_list(const tar_archive_t *archive, const char *path, char **entries, size_t *no_entries) {
+    STATS_SPAN(TAR_FN_TAR_LIST, HANDLE_STATS(archive), path);
+    return index_list(archive->index, path, entries, no_entries);
+}
+
+/**
+ * Lists the entries at a given path in the archive without copying their names nor bounding their number.
+ * The array is allocated to the exact number of entries, and each name points into the index of the handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param out Set to an array of the entries listed, to be released with free(), or NULL if there are none.
+ *            The names stay valid until tar_close() or tar_index_refresh() is called.
+ *
+ * @return the number of entries listed,
+ *         -1 if no directory at the given path exists in the archive,
+ *         -2 if memory could not be allocated.
+ */
+ssize_t tar_list_arena(const tar_archive_t *archive, const char *path, tar_list_entry_t **out) {
+    STATS_SPAN(TAR_FN_TAR_LIST_ARENA, HANDLE_STATS(archive), path);
+    return index_list_arena(archive->index, path, out);
+}
+
+/*
+ * Finds what to read for read_file() semantics: sets the offset in the archive and the number of bytes to read,
+ * returns -1 or -2 as read_file() does, or the number of bytes left in the file from the given offset.
+ */
+static ssize_t handle_span(const tar_archive_t *archive, const char *path, size_t offset, size_t len,
+                           uint64_t *start, size_t *length) {
+    const tar_entry_t *entry = index_follow(archive->index, index_lookup(archive->index, path));
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) {
+        return -1;
+    }
+    if (offset >= entry->size) {
+        return -2;
+    }
+
+    *start = entry->offset + sizeof(tar_header_t) + offset;
+    *length = entry->size - offset < len ? entry->size - offset : len;
+    return entry->size - offset;
+}
+
+/**
+ * Reentrant version of read_file().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t tar_read_file(const tar_archive_t *archive, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    STATS_SPAN(TAR_FN_TAR_READ_FILE, HANDLE_STATS(archive), path);
+    uint64_t start;
+    size_t bytes_length;
+    ssize_t remaining = handle_span(archive, path, offset, *len, &start, &bytes_length);
+    if (remaining < 0) {
+        return remaining;
+    }
+
+    ssize_t done = handle_read(archive, dest, bytes_length, start);
+    if (done < 0) {
+        return -1;
+    }
+    *len = done;
+    return remaining - done;
+}
+
+/* Copies with a buffer, where the kernel can do neither copy. */
+static ssize_t copy_by_buffer(int in_fd, off_t *offset, int out_fd, size_t length) {
+    uint8_t buffer[65536];
+    size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+    ssize_t num_bytes = counted_pread(in_fd, buffer, chunk, *offset);
+    if (num_bytes <= 0) {
+        return num_bytes;
+    }
+
+    ssize_t written = write(out_fd, buffer, num_bytes);
+    if (written > 0) {
+        *offset += written;
+    }
+    return written;
+}
+
+/* Same as copy_by_buffer(), one cached block at a time. */
+static ssize_t copy_from_cache(const tar_archive_t *archive, off_t *offset, int out_fd, size_t length) {
+    uint8_t buffer[CACHE_BLOCK];
+    size_t in_block = CACHE_BLOCK - *offset % CACHE_BLOCK;
+    size_t chunk = length < in_block ? length : in_block;
+    ssize_t num_bytes = cache_read(archive->cache, archive->fd, buffer, chunk, *offset);
+    if (num_bytes <= 0) {
+        return num_bytes;
+    }
+
+    ssize_t written = write(out_fd, buffer, num_bytes);
+    if (written > 0) {
+        *offset += written;
+    }
+    return written;
+}
+
+/**
+ * Copies a file at a given path in the archive to another file descriptor without going through a user space
+ * buffer, with copy_file_range() if the destination is a regular file and sendfile() otherwise.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param len An in-out argument.
+ *            The caller set it to the maximum number of bytes to copy.
+ *            The callee set it to the number of bytes written to out_fd.
+ * @param out_fd A file descriptor to write to, at its current offset.
+ *
+ * @return -1 if no entry at the given path exists in the archive, the entry is not a file or writing failed,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was copied in its entirety,
+ *         a positive value if the file was partially copied, representing the remaining bytes left to be copied to
+ *         reach the end of the file.
+ */
+ssize_t tar_read_file_to_fd(const tar_archive_t *archive, const char *path, size_t offset, size_t *len, int out_fd) {
+    STATS_SPAN(TAR_FN_TAR_READ_FILE_TO_FD, HANDLE_STATS(archive), path);
+    uint64_t start;
+    size_t bytes_length;
+    ssize_t remaining = handle_span(archive, path, offset, *len, &start, &bytes_length);
+    if (remaining < 0) {
+        return remaining;
+    }
+
+    // cached blocks are worth more than a copy in the kernel
+    int use_cache = archive->cache != NULL && bytes_length <= CACHE_MAX_SPAN;
+    struct stat st;
+    int use_copy_range = !use_cache && fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode);
+    int use_sendfile = !use_cache;
+    off_t in_offset = start;
+    size_t done = 0;
+    while (done < bytes_length) {
+        ssize_t num_bytes;
+        if (use_cache) {
+            num_bytes = copy_from_cache(archive, &in_offset, out_fd, bytes_length - done);
+        } else if (use_copy_range) {
+            num_bytes = copy_file_range(archive->fd, &in_offset, out_fd, NULL, bytes_length - done, 0);
+            // across file systems on older kernels, or unsupported by the file system
+            if (num_bytes < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_copy_range = 0;
+                continue;
+            }
+        } else if (use_sendfile) {
+            num_bytes = sendfile(out_fd, archive->fd, &in_offset, bytes_length - done);
+            if (num_bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = 0;
+                continue;
+            }
+        } else {
+            num_bytes = copy_by_buffer(archive->fd, &in_offset, out_fd, bytes_length - done);
+        }
+
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break; // non-blocking destination full, the caller resumes from offset + len
+        }
+        if (num_bytes < 0) {
+            *len = done;
+            return -1;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+        done += num_bytes;
+    }
+
+    *len = done;
+    return remaining - done;
+}
+
+/*
+ * Batched reads: bodies are read in offset order, and the ones close enough to each other with one preadv() call,
+ * the bytes in between going to a scratch buffer.
+ */
+
+#define BATCH_GAP (64 * 1024)
+#define BATCH_SPAN (4 << 20)
+#define BATCH_IOV 1024
+
+typedef struct {
+    uint64_t start;     // offset of the first byte to read in the archive
+    size_t length;      // number of bytes to read
+    size_t request;
+} batch_item_t;
+
+static int batch_item_cmp(const void *a, const void *b) {
+    const batch_item_t *x = a, *y = b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->request < y->request ? -1 : x->request > y->request;
+}
+
+/* preadv() until every buffer is filled or the end of file, returns the number of bytes read or -1. */
+static ssize_t preadv_full(int fd, struct iovec *iov, int iovcnt, uint64_t offset) {
+    size_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t num_bytes = counted_preadv(fd, iov, iovcnt, offset + total);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes < 0) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+        total += num_bytes;
+        // drop what was filled
+        while (iovcnt > 0 && (size_t)num_bytes >= iov->iov_len) {
+            num_bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + num_bytes;
+            iov->iov_len -= num_bytes;
+        }
+    }
+    return total;
+}
+
+/**
+ * Reads several files of an archive at once, ordering and merging the reads by offset in the archive.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param requests The files to read, see tar_read_req_t. Each one gets the status tar_read_file() would return.
+ * @param no_requests The number of requests.
+ *
+ * @return zero if every request was attempted,
+ *         -1 if memory could not be allocated, in which case no request was attempted.
+ */
+int tar_read_files_batch(const tar_archive_t *archive, tar_read_req_t *requests, size_t no_requests) {
+    STATS_SPAN(TAR_FN_TAR_READ_FILES_BATCH, HANDLE_STATS(archive), NULL);
+    batch_item_t *items = malloc((no_requests ? no_requests : 1) * sizeof(batch_item_t));
+    struct iovec *iov = malloc(BATCH_IOV * sizeof(struct iovec));
+    uint8_t *gap = malloc(BATCH_GAP);
+    if (items == NULL || iov == NULL || gap == NULL) {
+        free(items);
+        free(iov);
+        free(gap);
+        return -1;
+    }
+
+    // resolve every path first
+    size_t no_items = 0;
+    for (size_t i = 0; i < no_requests; i++) {
+        tar_read_req_t *request = &requests[i];
+        uint64_t start;
+        size_t bytes_length;
+        // what is left if nothing is read
+        request->status = handle_span(archive, request->path, request->offset, request->len, &start, &bytes_length);
+        if (request->status < 0) {
+            continue;
+        }
+        request->len = 0;
+        if (archive->cache != NULL && bytes_length <= CACHE_MAX_SPAN) {
+            // small bodies are served from the cache rather than merged
+            ssize_t done = cache_read(archive->cache, archive->fd, request->dest, bytes_length, start);
+            request->status = done < 0 ? -1 : request->status - done;
+            request->len = done < 0 ? 0 : done;
+        } else if (bytes_length > 0) {
+            items[no_items++] = (batch_item_t) { start, bytes_length, i };
+        }
+    }
+    qsort(items, no_items, sizeof(batch_item_t), batch_item_cmp);
+
+    for (size_t first = 0; first < no_items;) {
+        // extend the group while the next body starts shortly after the previous one ends
+        uint64_t start = items[first].start;
+        uint64_t end = start + items[first].length;
+        size_t last = first + 1;
+        int iovcnt = 1;
+        while (last < no_items && items[last].start >= end && items[last].start - end <= BATCH_GAP &&
+               items[last].start + items[last].length - start <= BATCH_SPAN && iovcnt + 2 <= BATCH_IOV) {
+            iovcnt += items[last].start > end ? 2 : 1;
+            end = items[last].start + items[last].length;
+            last++;
+        }
+
+        iovcnt = 0;
+        uint64_t position = start;
+        for (size_t i = first; i < last; i++) {
+            if (items[i].start > position) {
+                iov[iovcnt++] = (struct iovec) { gap, items[i].start - position };
+            }
+            iov[iovcnt++] = (struct iovec) { requests[items[i].request].dest, items[i].length };
+            position = items[i].start + items[i].length;
+        }
+
+        ssize_t total = preadv_full(archive->fd, iov, iovcnt, start);
+        for (size_t i = first; i < last; i++) {
+            tar_read_req_t *request = &requests[items[i].request];
+            if (total < 0) {
+                request->status = -1;
+                continue;
+            }
+            // a short read only happens on a truncated archive
+            uint64_t read_end = start + total;
+            size_t done = read_end <= items[i].start ? 0 :
+                          read_end - items[i].start < items[i].length ? read_end - items[i].start : items[i].length;
+            request->len = done;
+            request->status -= done;
+        }
+        first = last;
+    }
+
+    free(items);
+    free(iov);
+    free(gap);
+    return 0;
+}
+
+
+/*
+ * Sidecar index files
+ *
+ * The arrays of an index are written one after the other behind a small header, each one aligned on 8 bytes.
+ * Loading a sidecar maps it and points the index straight at them: nothing is parsed nor copied, the pages are
+ * only read when a lookup touches them. The header records what the archive looked like when the sidecar was
+ * written (size, modification time and a hash of its first and last headers) so that a stale sidecar is never
+ * used. Entries are stored as they are in memory, so a sidecar is only valid for the build that wrote it, which
+ * the size of an entry and the byte order marker check roughly.
+ * Backends other than plain archives append what they need to the sidecar as an extra, mapped, blob.
+ */
+
+#define SIDECAR_MAGIC "TARIDX"
+#define SIDECAR_VERSION 5
+#define SIDECAR_TAR 0
+#define SIDECAR_GZ  1
+#define SIDECAR_BYTE_ORDER 0x01020304u
+#define SIDECAR_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t entry_size;
+    uint32_t root;
+    uint32_t kind;          // one of the SIDECAR_* backends
+    uint32_t reserved;
+
+    // the archive the index was built from
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t start;
+    uint64_t last;          // offset of the second block hashed, the last header of a plain archive
+    uint64_t first_hash;
+    uint64_t last_hash;
+
+    uint64_t no_entries;
+    uint64_t names_len;
+    uint64_t no_slots;
+    uint64_t no_children;
+    uint64_t entries_off;
+    uint64_t names_off;
+    uint64_t slots_off;
+    uint64_t children_off;
+    uint64_t extra_off;
+    uint64_t extra_len;
+} sidecar_header_t;
+
+static uint64_t block_hash(int tar_fd, uint64_t offset) {
+    tar_header_t header;
+    if (counted_pread(tar_fd, &header, sizeof(header), offset) != sizeof(header)) {
+        return 0;
+    }
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(header); i++) {
+        hash ^= ((const uint8_t *)&header)[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t index_last_header(const tar_index_t *index) {
+    uint64_t last = index->start;
+    for (size_t i = 0; i < index->no_entries; i++) {
+        if (!(index->entries[i].flags & ENTRY_IMPLICIT) && index->entries[i].offset > last) {
+            last = index->entries[i].offset;
+        }
+    }
+    return last;
+}
+
+/* Fills in what the sidecar has to match in the archive. */
+static int sidecar_describe(int tar_fd, uint64_t start, uint64_t last, sidecar_header_t *header) {
+    struct stat st;
+    if (fstat(tar_fd, &st) < 0) {
+        return -1;
+    }
+    header->archive_size = st.st_size;
+    header->archive_mtime_sec = st.st_mtim.tv_sec;
+    header->archive_mtime_nsec = st.st_mtim.tv_nsec;
+    header->start = start;
+    header->last = last;
+    header->first_hash = block_hash(tar_fd, start);
+    header->last_hash = block_hash(tar_fd, last);
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t num_bytes = write(fd, buf, len);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0) {
+            return -1;
+        }
+        buf = (const uint8_t *)buf + num_bytes;
+        len -= num_bytes;
+    }
+    return 0;
+}
+
+static int sidecar_write(const tar_index_t *index, int tar_fd, const char *idx_path, uint32_t kind, uint64_t last,
+                         const void *extra, size_t extra_len) {
+    sidecar_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+    header.version = SIDECAR_VERSION;
+    header.byte_order = SIDECAR_BYTE_ORDER;
+    header.entry_size = sizeof(tar_entry_t);
+    header.root = index->root;
+    header.kind = kind;
+    if (sidecar_describe(tar_fd, index->start, last, &header) < 0) {
+        return -1;
+    }
+
+    header.no_entries = index->no_entries;
+    header.names_len = index->names_len;
+    header.no_slots = index->no_slots;
+    header.no_children = index->no_children;
+    header.entries_off = SIDECAR_ALIGN(sizeof(header));
+    header.names_off = SIDECAR_ALIGN(header.entries_off + header.no_entries * sizeof(tar_entry_t));
+    header.slots_off = SIDECAR_ALIGN(header.names_off + header.names_len);
+    header.children_off = SIDECAR_ALIGN(header.slots_off + header.no_slots * sizeof(index_slot_t));
+    header.extra_off = SIDECAR_ALIGN(header.children_off + header.no_children * sizeof(uint32_t));
+    header.extra_len = extra_len;
+
+    // written next to the final file, then renamed over it
+    char tmp_path[PATH_BUF];
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", idx_path, (int)getpid()) >= sizeof(tmp_path)) {
+        return -1;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    static const uint8_t padding[8];
+    struct {
+        const void *data;
+        uint64_t len;
+        uint64_t off;
+    } parts[] = {
+        { &header, sizeof(header), 0 },
+        { index->entries, header.no_entries * sizeof(tar_entry_t), header.entries_off },
+        { index->names, header.names_len, header.names_off },
+        { index->slots, header.no_slots * sizeof(index_slot_t), header.slots_off },
+        { index->children, header.no_children * sizeof(uint32_t), header.children_off },
+        { extra, extra_len, header.extra_off },
+    };
+    uint64_t written = 0;
+    int ret = 0;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]) && ret == 0; i++) {
+        ret = write_all(fd, padding, parts[i].off - written);
+        if (ret == 0 && parts[i].len > 0) {
+            ret = write_all(fd, parts[i].data, parts[i].len);
+        }
+        written = parts[i].off + parts[i].len;
+    }
+
+    if (close(fd) < 0 || ret < 0 || rename(tmp_path, idx_path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes an index to a sidecar file.
+ *
+ * @param index An index of the archive.
+ * @param tar_fd A file descriptor of the archive the index was built from.
+ * @param idx_path The path of the sidecar file, replaced atomically if it exists.
+ *
+ * @return zero if the sidecar was written, -1 otherwise.
+ */
+int tar_index_save(const tar_index_t *index, int tar_fd, const char *idx_path) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_SAVE, NULL, idx_path);
+    return sidecar_write(index, tar_fd, idx_path, SIDECAR_TAR, index_last_header(index), NULL, 0);
+}
+
+/* Whether count items of the given size at off fit in a file of the given size, off being aligned. */
+static int sidecar_fits(uint64_t off, uint64_t count, size_t item_size, uint64_t size) {
+    return off % 8 == 0 && off <= size && count <= (size - off) / item_size;
+}
+
+static int entry_ref_valid(uint32_t e, uint64_t no_entries) {
+    return e == INDEX_NO_SLOT || e < no_entries;
+}
+
+/*
+ * Checks every reference of the mapped arrays once, so that lookups can trust them: entries, children and slots
+ * stay within their arrays, names within the arena, which ends with a null, every entry is the child of at most one
+ * directory and the root of none, so that walks from the root end, and the table has an empty slot to end probes.
+ */
+static int sidecar_check(const sidecar_header_t *header, const uint8_t *map) {
+    const tar_entry_t *entries = (const tar_entry_t *)(map + header->entries_off);
+    const char *names = (const char *)map + header->names_off;
+    const index_slot_t *slots = (const index_slot_t *)(map + header->slots_off);
+    const uint32_t *children = (const uint32_t *)(map + header->children_off);
+    uint64_t no_entries = header->no_entries;
+
+    if (header->names_len == 0 || names[header->names_len - 1] != '\0') {
+        return -1;
+    }
+    for (uint64_t i = 0; i < no_entries; i++) {
+        const tar_entry_t *entry = &entries[i];
+        if (entry->name >= header->names_len || entry->name_len >= header->names_len - entry->name
+                || entry->link >= header->names_len
+                || !entry_ref_valid(entry->parent, no_entries) || !entry_ref_valid(entry->target, no_entries)
+                || entry->children > header->no_children
+                || entry->no_children > header->no_children - entry->children
+                || (header->kind == SIDECAR_TAR && (entry->size > header->archive_size
+                                                    || entry->offset > header->archive_size - entry->size))) {
+            return -1;
+        }
+    }
+
+    uint8_t *seen = calloc(no_entries ? no_entries : 1, 1);
+    if (seen == NULL) {
+        return -1;
+    }
+    int ret = 0;
+    seen[header->root] = 1;
+    for (uint64_t i = 0; i < no_entries && ret == 0; i++) {
+        const tar_entry_t *entry = &entries[i];
+        for (uint32_t c = 0; c < entry->no_children && ret == 0; c++) {
+            uint32_t child = children[entry->children + c];
+            ret = child < no_entries && !seen[child] ? 0 : -1;
+            if (ret == 0) {
+                seen[child] = 1;
+            }
+        }
+    }
+    free(seen);
+
+    int has_empty = 0;
+    for (uint64_t i = 0; i < header->no_slots && ret == 0; i++) {
+        has_empty |= slots[i].entry == INDEX_NO_SLOT;
+        ret = entry_ref_valid(slots[i].entry, no_entries) ? 0 : -1;
+    }
+    return ret == 0 && has_empty ? 0 : -1;
+}
+
+static tar_index_t *sidecar_map(int tar_fd, uint64_t start, const char *idx_path, uint32_t kind,
+                                const void **extra, size_t *extra_len) {
+    int fd = open(idx_path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(sidecar_header_t)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const sidecar_header_t *header = map;
+    uint64_t size = st.st_size;
+    sidecar_header_t current;
+
+    int valid = memcmp(header->magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC)) == 0
+        && header->version == SIDECAR_VERSION
+        && header->byte_order == SIDECAR_BYTE_ORDER
+        && header->entry_size == sizeof(tar_entry_t)
+        && header->kind == kind
+        && header->no_entries < INDEX_NO_SLOT && header->root < header->no_entries
+        && header->no_slots > 0 && (header->no_slots & (header->no_slots - 1)) == 0
+        && header->names_len < INDEX_NO_SLOT && header->no_children < INDEX_NO_SLOT
+        && sidecar_fits(header->entries_off, header->no_entries, sizeof(tar_entry_t), size)
+        && sidecar_fits(header->names_off, header->names_len, 1, size)
+        && sidecar_fits(header->slots_off, header->no_slots, sizeof(index_slot_t), size)
+        && sidecar_fits(header->children_off, header->no_children, sizeof(uint32_t), size)
+        && sidecar_fits(header->extra_off, header->extra_len, 1, size);
+
+    // stale if the archive changed since
+    valid = valid && sidecar_describe(tar_fd, start, header->last, &current) == 0
+        && current.archive_size == header->archive_size
+        && current.archive_mtime_sec == header->archive_mtime_sec
+        && current.archive_mtime_nsec == header->archive_mtime_nsec
+        && current.start == header->start
+        && current.first_hash == header->first_hash
+        && current.last_hash == header->last_hash
+        && sidecar_check(header, map) == 0;
+
+    tar_index_t *index = valid ? calloc(1, sizeof(tar_index_t)) : NULL;
+    if (index == NULL) {
+        munmap(map, size);
+        return NULL;
+    }
+    index->entries = (tar_entry_t *)((uint8_t *)map + header->entries_off);
+    index->no_entries = header->no_entries;
+    index->names = (char *)map + header->names_off;
+    index->names_len = header->names_len;
+    index->slots = (index_slot_t *)((uint8_t *)map + header->slots_off);
+    index->no_slots = header->no_slots;
+    index->children = (uint32_t *)((uint8_t *)map + header->children_off);
+    index->no_children = header->no_children;
+    index->root = header->root;
+    index->start = header->start;
+    index->map = map;
+    index->map_size = size;
+    if (extra != NULL) {
+        *extra = (uint8_t *)map + header->extra_off;
+        *extra_len = header->extra_len;
+    }
+    return index;
+}
+
+/**
+ * Loads an index from a sidecar file, provided it matches the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of the archive the sidecar was written for.
+ * @param idx_path The path of the sidecar file.
+ *
+ * @return an index to be released with tar_index_free(),
+ *         NULL if the sidecar is missing, invalid or stale.
+ */
+tar_index_t *tar_index_load(int tar_fd, const char *idx_path) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_LOAD, NULL, idx_path);
+    off_t start = counted_lseek(tar_fd, 0, SEEK_CUR);
+    return sidecar_map(tar_fd, start < 0 ? 0 : start, idx_path, SIDECAR_TAR, NULL, NULL);
+}
+
+/**
+ * Loads an index from a sidecar file, or builds it and writes the sidecar if it is missing or stale.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file. Its offset is not moved.
+ * @param idx_path The path of the sidecar file.
+ *
+ * @return an index to be released with tar_index_free(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ *         Failing to write the sidecar is not an error.
+ */
+tar_index_t *tar_index_open(int tar_fd, const char *idx_path) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_OPEN, NULL, idx_path);
+    tar_index_t *index = tar_index_load(tar_fd, idx_path);
+    if (index != NULL) {
+        return index;
+    }
+    index = index_build_at(tar_fd);
+    if (index != NULL) {
+        tar_index_save(index, tar_fd, idx_path);
+    }
+    return index;
+}
+
+/**
+ * Opens an archive for concurrent queries, using a sidecar index file to skip indexing the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until tar_close() is called.
+ * @param idx_path The path of the sidecar file, written if missing or stale.
+ *
+ * @return a newly allocated handle to be released with tar_close(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_archive_t *tar_open_indexed(int tar_fd, const char *idx_path) {
+    STATS_SPAN(TAR_FN_TAR_OPEN_INDEXED, NULL, idx_path);
+    tar_archive_t *archive = calloc(1, sizeof(tar_archive_t));
+    if (archive == NULL) {
+        return NULL;
+    }
+    stats_span_attach(&stats_span, &archive->stats);
+    archive->fd = tar_fd;
+    archive->index = tar_index_open(tar_fd, idx_path);
+    if (archive->index == NULL) {
+        stats_span_attach(&stats_span, NULL);
+        free(archive);
+        return NULL;
+    }
+    return archive;
+}
+
+
+/*
+ * Streaming iterator
+ *
+ * Only sequential read() calls are made, through a buffer, so any file descriptor works. When the descriptor is
+ * seekable, file contents larger than the buffer are skipped with lseek() instead of being read.
+ */
+
+#define ITER_BUFFER (64 * 1024)
+
+static ssize_t iter_fill(tar_iter_t *it) {
+    for (;;) {
+        ssize_t num_bytes = counted_read(it->fd, it->buf, it->cap);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes >= 0) {
+            it->len = num_bytes;
+            it->pos = 0;
+        }
+        return num_bytes;
+    }
+}
+
+/* Reads exactly len bytes unless the archive ends first. */
+static ssize_t iter_read(tar_iter_t *it, void *dest, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (it->pos == it->len) {
+            // large reads go straight to the destination
+            if (len - done >= it->cap) {
+                ssize_t num_bytes = counted_read(it->fd, (uint8_t *)dest + done, len - done);
+                if (num_bytes < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (num_bytes <= 0) {
+                    it->offset += done;
+                    return num_bytes < 0 ? -1 : (ssize_t)done;
+                }
+                done += num_bytes;
+                continue;
+            }
+            ssize_t num_bytes = iter_fill(it);
+            if (num_bytes <= 0) {
+                it->offset += done;
+                return num_bytes < 0 ? -1 : (ssize_t)done;
+            }
+        }
+        size_t chunk = it->len - it->pos < len - done ? it->len - it->pos : len - done;
+        memcpy((uint8_t *)dest + done, it->buf + it->pos, chunk);
+        it->pos += chunk;
+        done += chunk;
+    }
+    it->offset += done;
+    return done;
+}
+
+static int iter_skip(tar_iter_t *it, uint64_t len) {
+    uint64_t buffered = it->len - it->pos < len ? it->len - it->pos : len;
+    it->pos += buffered;
+    it->offset += buffered;
+    len -= buffered;
+
+    if (len >= it->cap && it->seekable) {
+        if (counted_lseek(it->fd, len, SEEK_CUR) < 0) {
+            return -1;
+        }
+        it->offset += len;
+        return 0;
+    }
+    while (len > 0) {
+        ssize_t num_bytes = iter_fill(it);
+        if (num_bytes <= 0) {
+            return -1;
+        }
+        size_t chunk = (uint64_t)num_bytes < len ? (size_t)num_bytes : len;
+        it->pos = chunk;
+        it->offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Starts iterating over an archive.
+ *
+ * @param it The iterator to initialize.
+ * @param tar_fd A file descriptor pointing to the start of a tar archive, seekable or not.
+ *
+ * @return zero on success, -1 if memory could not be allocated.
+ */
+int tar_iter_init(tar_iter_t *it, int tar_fd) {
+    STATS_SPAN(TAR_FN_TAR_ITER_INIT, NULL, NULL);
+    struct stat st;
+    memset(it, 0, sizeof(tar_iter_t));
+    it->fd = tar_fd;
+    it->seekable = fstat(tar_fd, &st) == 0 && S_ISREG(st.st_mode) && counted_lseek(tar_fd, 0, SEEK_CUR) >= 0;
+    it->cap = ITER_BUFFER;
+    it->buf = malloc(it->cap);
+    return it->buf != NULL ? 0 : -1;
+}
+
+/**
+ * Moves to the next entry of the archive, skipping what was not read of the contents of the previous one.
+ *
+ * @param it An iterator initialized by tar_iter_init().
+ * @param entry Filled with the next entry.
+ *
+ * @return 1 if an entry was read,
+ *         zero at the end of the archive,
+ *         -1, -2 or -3 if the next header has an invalid magic value, version value or checksum value,
+ *         -4 if the archive could not be read or ends in the middle of an entry.
+ */
+int tar_iter_next(tar_iter_t *it, tar_iter_entry_t *entry) {
+    STATS_SPAN(TAR_FN_TAR_ITER_NEXT, NULL, NULL);
+    tar_header_t header;
+
+    if (it->done) {
+        return 0;
+    }
+    if (iter_skip(it, it->body_left + it->padding_left) < 0) {
+        return -4;
+    }
+    it->body_left = it->padding_left = 0;
+
+    uint64_t offset = it->offset;
+    ssize_t num_bytes = iter_read(it, &header, sizeof(tar_header_t));
+    if (num_bytes < 0 || (num_bytes > 0 && num_bytes < (ssize_t)sizeof(tar_header_t))) {
+        return -4;
+    }
+    if (num_bytes == 0) {
+        it->done = 1;
+        return 0;
+    }
+    STATS_ADD(headers, 1);
+
+    if (is_null_block(&header)) {
+        // the end of the archive is marked by two null blocks, a lone one is an invalid header
+        num_bytes = iter_read(it, &header, sizeof(tar_header_t));
+        if (num_bytes == 0 || (num_bytes == sizeof(tar_header_t) && is_null_block(&header))) {
+            it->done = 1;
+            return 0;
+        }
+        return num_bytes < 0 ? -4 : -1;
+    }
+
+    int ret = check_header(&header);
+    if (ret < 0) {
+        return ret;
+    }
+
+    copy_entry_name(entry->name, header.name, strnlen(header.name, sizeof(header.name)));
+    memcpy(entry->linkname, header.linkname, sizeof(header.linkname));
+    entry->linkname[sizeof(header.linkname)] = '\0';
+    entry->typeflag = header.typeflag;
+    entry->size = HEADER_INT(header.size);
+    entry->offset = offset;
+
+    it->body_left = entry->size;
+    it->padding_left = ((entry->size + 511) / 512) * 512 - entry->size;
+    return 1;
+}
+
+/**
+ * Reads the contents of the current entry, sequentially.
+ *
+ * @param it An iterator positioned on an entry by tar_iter_next().
+ * @param dest A destination buffer.
+ * @param len The size of dest.
+ *
+ * @return the number of bytes written to dest, zero once the contents have been read entirely,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_iter_read_body(tar_iter_t *it, void *dest, size_t len) {
+    STATS_SPAN(TAR_FN_TAR_ITER_READ_BODY, NULL, NULL);
+    if (len > it->body_left) {
+        len = it->body_left;
+    }
+    ssize_t num_bytes = iter_read(it, dest, len);
+    if (num_bytes < 0 || (size_t)num_bytes < len) {
+        return -1;
+    }
+    it->body_left -= num_bytes;
+    return num_bytes;
+}
+
+/**
+ * Releases the resources of an iterator. The file descriptor is left open.
+ *
+ * @param it An iterator initialized by tar_iter_init().
+ */
+void tar_iter_close(tar_iter_t *it) {
+    STATS_SPAN(TAR_FN_TAR_ITER_CLOSE, NULL, NULL);
+    free(it->buf);
+    it->buf = NULL;
+}
+
+
+/*
+ * Gzip-compressed archives
+ *
+ * A deflate stream cannot be entered at an arbitrary point, so one decompression pass records checkpoints about
+ * every GZ_SPAN bytes of archive: where the next deflate block starts in the compressed file, down to the bit, and
+ * the last 32 KiB of output it may refer back to. Reading from an offset then inflates from the closest checkpoint
+ * before it only. The same pass indexes the headers as they come out. Checkpoints are kept in one flat array so
+ * that they can be stored in the sidecar of the index and mapped back as is.
+ */
+
+#define GZ_WINDOW 32768
+#define GZ_SPAN (1 << 20)
+#define GZ_CHUNK 65536
+
+typedef struct {
+    uint64_t in;        // offset of the first full byte of the block in the compressed file
+    uint64_t out;       // offset in the archive
+    uint32_t bits;      // bits of the byte before `in` that belong to the block
+    uint32_t reserved;
+    uint8_t window[GZ_WINDOW];
+} gz_checkpoint_t;
+
+struct tar_gz {
+    int fd;
+    tar_index_t *index;
+    gz_checkpoint_t *points;
+    size_t no_points;
+    size_t cap_points;
+    int mapped;         // points live in the sidecar mapping of the index
+};
+
+/* Reassembles headers as the archive is decompressed. */
+typedef struct {
+    tar_index_t *index;
+    uint64_t next;      // offset of the next header
+    uint8_t header[sizeof(tar_header_t)];
+    size_t fill;
+    int done;
+    int error;
+} gz_indexer_t;
+
+static void gz_index_output(gz_indexer_t *indexer, const uint8_t *data, size_t len, uint64_t out) {
+    while (len > 0 && !indexer->done) {
+        // skip file contents
+        if (out < indexer->next) {
+            uint64_t skip = indexer->next - out < len ? indexer->next - out : len;
+            data += skip;
+            len -= skip;
+            out += skip;
+            continue;
+        }
+        size_t chunk = sizeof(tar_header_t) - indexer->fill < len ? sizeof(tar_header_t) - indexer->fill : len;
+        memcpy(indexer->header + indexer->fill, data, chunk);
+        indexer->fill += chunk;
+        data += chunk;
+        len -= chunk;
+        out += chunk;
+        if (indexer->fill < sizeof(tar_header_t)) {
+            break;
+        }
+
+        const tar_header_t *header = (const tar_header_t *)indexer->header;
+        indexer->fill = 0;
+        STATS_ADD(headers, 1);
+        off_t next = header_next(header, indexer->next);
+        if (is_null_block(header)) {
+            indexer->done = 1;
+        } else if (next < 0 || index_add(indexer->index, header, indexer->next) < 0) {
+            indexer->error = indexer->done = 1;
+        } else {
+            indexer->next = next;
+        }
+    }
+}
+
+static int gz_add_point(tar_gz_t *gz, int bits, uint64_t in, uint64_t out, size_t left, const uint8_t *window) {
+    if (gz->no_points == gz->cap_points) {
+        size_t cap = gz->cap_points ? gz->cap_points * 2 : 16;
+        gz_checkpoint_t *points = realloc(gz->points, cap * sizeof(gz_checkpoint_t));
+        if (points == NULL) {
+            return -1;
+        }
+        gz->points = points;
+        gz->cap_points = cap;
+    }
+    gz_checkpoint_t *point = &gz->points[gz->no_points++];
+    point->in = in;
+    point->out = out;
+    point->bits = bits;
+    point->reserved = 0;
+    // the window is circular, the oldest bytes sit right after the write position
+    if (left > 0) {
+        memcpy(point->window, window + GZ_WINDOW - left, left);
+    }
+    if (left < GZ_WINDOW) {
+        memcpy(point->window + left, window, GZ_WINDOW - left);
+    }
+    return 0;
+}
+
+/* The decompression pass: checkpoints and headers. */
+static int gz_build(tar_gz_t *gz) {
+    z_stream strm;
+    uint8_t *input = malloc(GZ_CHUNK);
+    uint8_t *window = calloc(1, GZ_WINDOW);
+    gz_indexer_t indexer = { .index = gz->index };
+    uint64_t in_offset = 0, totin = 0, totout = 0, last = 0;
+    int ret = Z_OK;
+
+    memset(&strm, 0, sizeof(strm));
+    // 32 + 15: gzip or zlib header, automatically detected
+    if (input == NULL || window == NULL || inflateInit2(&strm, 47) != Z_OK) {
+        free(input);
+        free(window);
+        return -1;
+    }
+
+    while (ret != Z_STREAM_END && !indexer.done) {
+        ssize_t num_bytes = counted_pread(gz->fd, input, GZ_CHUNK, in_offset);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0) {
+            break; // truncated: what was indexed so far stays usable
+        }
+        in_offset += num_bytes;
+        strm.next_in = input;
+        strm.avail_in = num_bytes;
+
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = GZ_WINDOW;
+                strm.next_out = window;
+            }
+            uint8_t *produced = strm.next_out;
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+                indexer.error = 1;
+                break;
+            }
+
+            gz_index_output(&indexer, produced, strm.next_out - produced, totout - (strm.next_out - produced));
+            if (ret == Z_STREAM_END || indexer.done) {
+                break;
+            }
+
+            // at the end of a deflate block, but not of the last one
+            if ((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > GZ_SPAN)) {
+                if (gz_add_point(gz, strm.data_type & 7, totin, totout, strm.avail_out, window) < 0) {
+                    indexer.error = 1;
+                    break;
+                }
+                last = totout;
+            }
+        } while (strm.avail_in != 0);
+
+        if (indexer.error) {
+            break;
+        }
+    }
+
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    return indexer.error || gz->no_points == 0 ? -1 : 0;
+}
+
+/* Inflates len bytes of the archive from the given offset, returns the number of bytes produced or -1. */
+static ssize_t gz_extract(const tar_gz_t *gz, uint64_t offset, uint8_t *dest, size_t len) {
+    // last checkpoint at or before the offset
+    size_t lo = 0, hi = gz->no_points;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (gz->points[mid].out <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const gz_checkpoint_t *point = &gz->points[lo];
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK) {
+        return -1;
+    }
+    uint8_t *input = malloc(GZ_CHUNK);
+    uint8_t *discard = malloc(GZ_WINDOW);
+    if (input == NULL || discard == NULL) {
+        free(input);
+        free(discard);
+        inflateEnd(&strm);
+        return -1;
+    }
+
+    ssize_t ret = -1;
+    uint64_t in_offset = point->in;
+    if (point->bits) {
+        uint8_t byte;
+        if (counted_pread(gz->fd, &byte, 1, point->in - 1) != 1) {
+            goto out;
+        }
+        inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+    }
+    inflateSetDictionary(&strm, point->window, GZ_WINDOW);
+
+    uint64_t skip = offset - point->out;
+    size_t done = 0;
+    int status = Z_OK;
+    while (done < len && status != Z_STREAM_END) {
+        if (strm.avail_in == 0) {
+            ssize_t num_bytes = counted_pread(gz->fd, input, GZ_CHUNK, in_offset);
+            if (num_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (num_bytes <= 0) {
+                break;
+            }
+            in_offset += num_bytes;
+            strm.next_in = input;
+            strm.avail_in = num_bytes;
+        }
+        if (skip > 0) {
+            strm.next_out = discard;
+            strm.avail_out = skip < GZ_WINDOW ? skip : GZ_WINDOW;
+        } else {
+            strm.next_out = dest + done;
+            strm.avail_out = len - done;
+        }
+        size_t avail = strm.avail_out;
+        status = inflate(&strm, Z_NO_FLUSH);
+        if (status == Z_NEED_DICT || status == Z_DATA_ERROR || status == Z_MEM_ERROR) {
+            goto out;
+        }
+        if (skip > 0) {
+            skip -= avail - strm.avail_out;
+        } else {
+            done += avail - strm.avail_out;
+        }
+    }
+    ret = done;
+
+out:
+    inflateEnd(&strm);
+    free(input);
+    free(discard);
+    return ret;
+}
+
+static tar_gz_t *gz_new(int gz_fd) {
+    tar_gz_t *gz = calloc(1, sizeof(tar_gz_t));
+    if (gz != NULL) {
+        gz->fd = gz_fd;
+    }
+    return gz;
+}
+
+/**
+ * Opens a gzip-compressed archive for random access, decompressing it once.
+ *
+ * @param gz_fd A file descriptor of a gzip-compressed tar archive.
+ *
+ * @return a newly allocated handle to be released with tar_gz_close(),
+ *         NULL if the archive could not be decompressed or memory could not be allocated.
+ */
+tar_gz_t *tar_gz_open(int gz_fd) {
+    STATS_SPAN(TAR_FN_TAR_GZ_OPEN, NULL, NULL);
+    tar_gz_t *gz = gz_new(gz_fd);
+    if (gz == NULL) {
+        return NULL;
+    }
+    gz->index = index_new();
+    if (gz->index == NULL || gz_build(gz) < 0 || index_finish(gz->index) < 0) {
+        tar_gz_close(gz);
+        return NULL;
+    }
+    return gz;
+}
+
+static uint64_t gz_last_block(int gz_fd) {
+    struct stat st;
+    if (fstat(gz_fd, &st) < 0 || st.st_size < (off_t)sizeof(tar_header_t)) {
+        return 0;
+    }
+    return st.st_size - sizeof(tar_header_t);
+}
+
+/**
+ * Writes the index and checkpoints of a compressed archive to a sidecar file.
+ *
+ * @param gz A handle returned by tar_gz_open().
+ * @param idx_path The path of the sidecar file, replaced atomically if it exists.
+ *
+ * @return zero if the sidecar was written, -1 otherwise.
+ */
+int tar_gz_save(const tar_gz_t *gz, const char *idx_path) {
+    STATS_SPAN(TAR_FN_TAR_GZ_SAVE, NULL, idx_path);
+    return sidecar_write(gz->index, gz->fd, idx_path, SIDECAR_GZ, gz_last_block(gz->fd),
+                         gz->points, gz->no_points * sizeof(gz_checkpoint_t));
+}
+
+/* Whether checkpoints read from a sidecar can be trusted: the first one at the start, all in order within the file. */
+static int gz_points_valid(int gz_fd, const gz_checkpoint_t *points, size_t no_points) {
+    struct stat st;
+    if (no_points == 0 || points[0].out != 0 || fstat(gz_fd, &st) < 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < no_points; i++) {
+        const gz_checkpoint_t *point = &points[i];
+        if (point->bits > 7 || (point->bits != 0 && point->in == 0) || point->in > (uint64_t)st.st_size
+                || (i > 0 && (point->in <= points[i - 1].in || point->out <= points[i - 1].out))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Opens a gzip-compressed archive for random access from its sidecar file, or decompresses it once and writes the
+ * sidecar if it is missing, stale or corrupt.
+ *
+ * @param gz_fd A file descriptor of a gzip-compressed tar archive.
+ * @param idx_path The path of the sidecar file.
+ *
+ * @return a newly allocated handle to be released with tar_gz_close(),
+ *         NULL if the archive could not be decompressed or memory could not be allocated.
+ */
+tar_gz_t *tar_gz_open_indexed(int gz_fd, const char *idx_path) {
+    STATS_SPAN(TAR_FN_TAR_GZ_OPEN_INDEXED, NULL, idx_path);
+    const void *extra;
+    size_t extra_len;
+    tar_index_t *index = sidecar_map(gz_fd, 0, idx_path, SIDECAR_GZ, &extra, &extra_len);
+
+    if (index != NULL && extra_len % sizeof(gz_checkpoint_t) == 0
+            && gz_points_valid(gz_fd, extra, extra_len / sizeof(gz_checkpoint_t))) {
+        tar_gz_t *gz = gz_new(gz_fd);
+        if (gz == NULL) {
+            tar_index_free(index);
+            return NULL;
+        }
+        gz->index = index;
+        gz->points = (gz_checkpoint_t *)extra;
+        gz->no_points = extra_len / sizeof(gz_checkpoint_t);
+        gz->mapped = 1;
+        return gz;
+    }
+    tar_index_free(index);
+
+    tar_gz_t *gz = tar_gz_open(gz_fd);
+    if (gz != NULL) {
+        tar_gz_save(gz, idx_path);
+    }
+    return gz;
+}
+
+/**
+ * Releases a handle opened by tar_gz_open() or tar_gz_open_indexed(). The file descriptor is left open.
+ *
+ * @param gz The handle to release, may be NULL.
+ */
+void tar_gz_close(tar_gz_t *gz) {
+    STATS_SPAN(TAR_FN_TAR_GZ_CLOSE, NULL, NULL);
+    if (gz == NULL) {
+        return;
+    }
+    if (!gz->mapped) {
+        free(gz->points);
+    }
+    tar_index_free(gz->index);
+    free(gz);
+}
+
+/**
+ * Gives access to the index of a compressed archive, to be used with the tar_index_* functions.
+ *
+ * @param gz A handle returned by tar_gz_open() or tar_gz_open_indexed().
+ *
+ * @return the index of the archive, owned by the handle.
+ */
+const tar_index_t *tar_gz_index(const tar_gz_t *gz) {
+    return gz->index;
+}
+
+/**
+ * Reads a file at a given path in a compressed archive, inflating from the closest checkpoint.
+ *
+ * @param gz A handle returned by tar_gz_open() or tar_gz_open_indexed().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t tar_gz_read_file(const tar_gz_t *gz, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    STATS_SPAN(TAR_FN_TAR_GZ_READ_FILE, NULL, path);
+    const tar_entry_t *entry = index_follow(gz->index, index_lookup(gz->index, path));
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) {
+        return -1;
+    }
+    if (offset >= entry->size) {
+        return -2;
+    }
+
+    size_t bytes_length = entry->size - offset;
+    if (bytes_length > *len) {
+        bytes_length = *len;
+    }
+    ssize_t done = gz_extract(gz, entry->offset + sizeof(tar_header_t) + offset, dest, bytes_length);
+    if (done < 0) {
+        return -1;
+    }
+
+    *len = done;
+    return entry->size - offset - done;
+}
+
+
+/*
+ * Asynchronous reads
+ *
+ * Requests are resolved through the index when submitted and their bodies read in the background, either by the
+ * kernel through io_uring or, where it is not available, by a pool of threads calling pread(). Every request in
+ * flight owns a slot; completions are queued and their callbacks run from tar_aio_poll(), on the thread that owns
+ * the engine. io_uring is driven through its system calls directly, there is no dependency on liburing.
+ */
+
+#define AIO_MAX_THREADS 16
+
+typedef struct {
+    tar_read_req_t *request;
+    tar_aio_cb callback;
+    void *data;
+    uint64_t start;     // next offset to read in the archive
+    size_t length;      // bytes still to read
+    int buffer;         // registered buffer holding dest, -1 if none
+} aio_slot_t;
+
+struct tar_aio {
+    const tar_archive_t *archive;
+    int backend;
+    unsigned depth;
+    aio_slot_t *slots;
+    unsigned *free_slots;
+    unsigned no_free;
+    unsigned *finished;     // completed slots whose callbacks have not run yet
+    unsigned no_finished;
+    unsigned *completed;    // the finished slots taken by tar_aio_poll()
+
+    // io_uring
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    struct iovec *buffers;
+    unsigned no_buffers;
+
+    // thread pool
+    pthread_t threads[AIO_MAX_THREADS];
+    unsigned no_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    unsigned *queue;        // circular queue of slots waiting for a thread
+    unsigned queue_head;
+    unsigned queue_len;
+    int stop;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static int aio_uring_init(tar_aio_t *aio) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    aio->ring_fd = uring_setup(aio->depth, &params);
+    if (aio->ring_fd < 0) {
+        return -1;
+    }
+    // IORING_OP_READ came with the current position feature
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(aio->ring_fd);
+        return -1;
+    }
+
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        aio->ring_fd, IORING_OFF_SQ_RING);
+    aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        aio->ring_fd, IORING_OFF_CQ_RING);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     aio->ring_fd, IORING_OFF_SQES);
+    if (aio->sq_ring == MAP_FAILED || aio->cq_ring == MAP_FAILED || aio->sqes == MAP_FAILED) {
+        if (aio->sq_ring != MAP_FAILED) {
+            munmap(aio->sq_ring, aio->sq_ring_size);
+        }
+        if (aio->cq_ring != MAP_FAILED) {
+            munmap(aio->cq_ring, aio->cq_ring_size);
+        }
+        if (aio->sqes != MAP_FAILED) {
+            munmap(aio->sqes, aio->sqes_size);
+        }
+        close(aio->ring_fd);
+        return -1;
+    }
+
+    uint8_t *sq = aio->sq_ring, *cq = aio->cq_ring;
+    aio->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    aio->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)(sq + params.sq_off.array);
+    aio->cq_head = (unsigned *)(cq + params.cq_off.head);
+    aio->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    aio->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    aio->backend = TAR_AIO_URING;
+    return 0;
+}
+
+static void aio_uring_free(tar_aio_t *aio) {
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    munmap(aio->cq_ring, aio->cq_ring_size);
+    munmap(aio->sqes, aio->sqes_size);
+    close(aio->ring_fd);
+}
+
+/* Queues a read of what is left of the slot, submitted by the next io_uring_enter(). */
+static void aio_uring_queue(tar_aio_t *aio, unsigned slot_no) {
+    aio_slot_t *slot = &aio->slots[slot_no];
+    tar_read_req_t *request = slot->request;
+    unsigned tail = *aio->sq_tail;
+    unsigned index = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = slot->buffer >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = aio->archive->fd;
+    sqe->off = slot->start;
+    sqe->addr = (uint64_t)(uintptr_t)(request->dest + request->len);
+    sqe->len = slot->length;
+    sqe->buf_index = slot->buffer >= 0 ? slot->buffer : 0;
+    sqe->user_data = slot_no;
+    aio->sq_array[index] = index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->to_submit++;
+}
+
+/* Submits the queued reads and moves completed slots to the finished list. */
+static int aio_uring_reap(tar_aio_t *aio, int wait) {
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    if (aio->to_submit > 0 || wait) {
+        int ret = uring_enter(aio->ring_fd, aio->to_submit, wait ? 1 : 0, flags);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+        if (ret > 0) {
+            aio->to_submit -= (unsigned)ret < aio->to_submit ? (unsigned)ret : aio->to_submit;
+        }
+    }
+
+    unsigned head = *aio->cq_head;
+    unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+        unsigned slot_no = cqe->user_data;
+        aio_slot_t *slot = &aio->slots[slot_no];
+        tar_read_req_t *request = slot->request;
+
+        if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+            aio_uring_queue(aio, slot_no);
+            continue;
+        }
+        if (cqe->res < 0) {
+            request->status = -1;
+            aio->finished[aio->no_finished++] = slot_no;
+            continue;
+        }
+        request->len += cqe->res;
+        request->status -= cqe->res;
+        slot->start += cqe->res;
+        slot->length -= cqe->res;
+        // short read: ask for the rest, unless at the end of the archive
+        if (slot->length > 0 && cqe->res > 0) {
+            aio_uring_queue(aio, slot_no);
+        } else {
+            aio->finished[aio->no_finished++] = slot_no;
+        }
+    }
+    __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void *aio_worker(void *arg) {
+    tar_aio_t *aio = arg;
+
+    current_stats = HANDLE_STATS(aio->archive);
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (aio->queue_len == 0 && !aio->stop) {
+            pthread_cond_wait(&aio->work, &aio->lock);
+        }
+        if (aio->queue_len == 0) {
+            break;
+        }
+        unsigned slot_no = aio->queue[aio->queue_head];
+        aio->queue_head = (aio->queue_head + 1) % aio->depth;
+        aio->queue_len--;
+        pthread_mutex_unlock(&aio->lock);
+
+        aio_slot_t *slot = &aio->slots[slot_no];
+        tar_read_req_t *request = slot->request;
+        size_t done = 0;
+        while (done < slot->length) {
+            ssize_t num_bytes = counted_pread(aio->archive->fd, request->dest + done, slot->length - done, slot->start + done);
+            if (num_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (num_bytes < 0) {
+                request->status = -1;
+                break;
+            }
+            if (num_bytes == 0) {
+                break;
+            }
+            done += num_bytes;
+        }
+        request->len = done;
+        if (request->status >= 0) {
+            request->status -= done;
+        }
+
+        pthread_mutex_lock(&aio->lock);
+        aio->finished[aio->no_finished++] = slot_no;
+        pthread_cond_signal(&aio->done);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+static int aio_pool_init(tar_aio_t *aio, unsigned no_threads) {
+    aio->queue = malloc(aio->depth * sizeof(unsigned));
+    if (aio->queue == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->done, NULL);
+    aio->backend = TAR_AIO_THREADS;
+
+    for (aio->no_threads = 0; aio->no_threads < no_threads; aio->no_threads++) {
+        if (pthread_create(&aio->threads[aio->no_threads], NULL, aio_worker, aio) != 0) {
+            break;
+        }
+    }
+    if (aio->no_threads == 0) {
+        pthread_mutex_destroy(&aio->lock);
+        pthread_cond_destroy(&aio->work);
+        pthread_cond_destroy(&aio->done);
+        free(aio->queue);
+        return -1;
+    }
+    return 0;
+}
+
+static void aio_pool_free(tar_aio_t *aio) {
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = 1;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+    for (unsigned i = 0; i < aio->no_threads; i++) {
+        pthread_join(aio->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->work);
+    pthread_cond_destroy(&aio->done);
+    free(aio->queue);
+}
+
+/**
+ * Creates an engine to read files of an archive asynchronously.
+ *
+ * @param archive A handle returned by tar_open(), which must outlive the engine.
+ * @param queue_depth The maximum number of requests in flight.
+ * @param flags TAR_AIO_THREADS to use the thread pool even if io_uring is available.
+ *
+ * @return a newly allocated engine to be released with tar_aio_close(),
+ *         NULL if memory or threads could not be allocated.
+ */
+tar_aio_t *tar_aio_open(const tar_archive_t *archive, unsigned queue_depth, int flags) {
+    STATS_SPAN(TAR_FN_TAR_AIO_OPEN, HANDLE_STATS(archive), NULL);
+    if (queue_depth == 0) {
+        return NULL;
+    }
+    tar_aio_t *aio = calloc(1, sizeof(tar_aio_t));
+    if (aio == NULL) {
+        return NULL;
+    }
+    aio->archive = archive;
+    aio->depth = queue_depth;
+    aio->slots = malloc(queue_depth * sizeof(aio_slot_t));
+    aio->free_slots = malloc(queue_depth * sizeof(unsigned));
+    aio->finished = malloc(queue_depth * sizeof(unsigned));
+    aio->completed = malloc(queue_depth * sizeof(unsigned));
+    if (aio->slots == NULL || aio->free_slots == NULL || aio->finished == NULL || aio->completed == NULL) {
+        goto error;
+    }
+    for (unsigned i = 0; i < queue_depth; i++) {
+        aio->free_slots[aio->no_free++] = queue_depth - 1 - i;
+    }
+
+    if ((flags & TAR_AIO_THREADS) || aio_uring_init(aio) < 0) {
+        unsigned no_threads = queue_depth < AIO_MAX_THREADS ? queue_depth : AIO_MAX_THREADS;
+        if (aio_pool_init(aio, no_threads) < 0) {
+            goto error;
+        }
+    }
+    return aio;
+
+error:
+    free(aio->slots);
+    free(aio->free_slots);
+    free(aio->finished);
+    free(aio->completed);
+    free(aio);
+    return NULL;
+}
+
+/**
+ * Tells which backend an engine uses.
+ *
+ * @param aio An engine returned by tar_aio_open().
+ *
+ * @return TAR_AIO_URING or TAR_AIO_THREADS.
+ */
+int tar_aio_backend(const tar_aio_t *aio) {
+    return aio->backend;
+}
+
+/**
+ * Registers buffers with the kernel, so that reads into them skip mapping the pages of the destination each time.
+ *
+ * @param aio An engine returned by tar_aio_open(), with no request in flight.
+ * @param buffers The buffers to register.
+ * @param no_buffers The number of buffers.
+ *
+ * @return zero if the buffers were registered or if the engine does not use io_uring, where it makes no difference,
+ *         -1 otherwise.
+ */
+int tar_aio_register(tar_aio_t *aio, const struct iovec *buffers, unsigned no_buffers) {
+    STATS_SPAN(TAR_FN_TAR_AIO_REGISTER, HANDLE_STATS(aio->archive), NULL);
+    if (aio->backend != TAR_AIO_URING) {
+        return 0;
+    }
+    if (aio->no_buffers > 0) {
+        uring_register(aio->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        free(aio->buffers);
+        aio->buffers = NULL;
+        aio->no_buffers = 0;
+    }
+    if (no_buffers == 0) {
+        return 0;
+    }
+
+    aio->buffers = malloc(no_buffers * sizeof(struct iovec));
+    if (aio->buffers == NULL) {
+        return -1;
+    }
+    memcpy(aio->buffers, buffers, no_buffers * sizeof(struct iovec));
+    if (uring_register(aio->ring_fd, IORING_REGISTER_BUFFERS, buffers, no_buffers) < 0) {
+        free(aio->buffers);
+        aio->buffers = NULL;
+        return -1;
+    }
+    aio->no_buffers = no_buffers;
+    return 0;
+}
+
+/**
+ * Submits a read. Paths are resolved right away, the body is read in the background.
+ *
+ * @param aio An engine returned by tar_aio_open().
+ * @param request The file to read, see tar_read_req_t. It must stay valid until its callback has run.
+ * @param callback Called from tar_aio_poll() once the request has completed, may be NULL.
+ * @param data Passed to the callback.
+ *
+ * @return zero if the request was submitted,
+ *         -1 if the queue is full, tar_aio_poll() must be called first.
+ */
+int tar_aio_submit(tar_aio_t *aio, tar_read_req_t *request, tar_aio_cb callback, void *data) {
+    STATS_SPAN(TAR_FN_TAR_AIO_SUBMIT, HANDLE_STATS(aio->archive), request->path);
+    if (aio->no_free == 0) {
+        return -1;
+    }
+    unsigned slot_no = aio->free_slots[--aio->no_free];
+    aio_slot_t *slot = &aio->slots[slot_no];
+    slot->request = request;
+    slot->callback = callback;
+    slot->data = data;
+    slot->buffer = -1;
+
+    // what is left if nothing is read
+    request->status = handle_span(aio->archive, request->path, request->offset, request->len,
+                                  &slot->start, &slot->length);
+    if (request->status < 0 || slot->length == 0) {
+        if (request->status >= 0) {
+            request->len = 0;
+        }
+        if (aio->backend == TAR_AIO_THREADS) {
+            pthread_mutex_lock(&aio->lock);
+        }
+        aio->finished[aio->no_finished++] = slot_no;
+        if (aio->backend == TAR_AIO_THREADS) {
+            pthread_mutex_unlock(&aio->lock);
+        }
+        return 0;
+    }
+    request->len = 0;
+
+    if (aio->backend == TAR_AIO_URING) {
+        for (unsigned i = 0; i < aio->no_buffers; i++) {
+            uint8_t *base = aio->buffers[i].iov_base;
+            if (request->dest >= base && request->dest + slot->length <= base + aio->buffers[i].iov_len) {
+                slot->buffer = i;
+                break;
+            }
+        }
+        aio_uring_queue(aio, slot_no);
+        return 0;
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    aio->queue[(aio->queue_head + aio->queue_len) % aio->depth] = slot_no;
+    aio->queue_len++;
+    pthread_cond_signal(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+    return 0;
+}
+
+/**
+ * Runs the callbacks of the completed requests. Submitted requests are only sent to the kernel by this call when
+ * io_uring is used.
+ *
+ * @param aio An engine returned by tar_aio_open().
+ * @param wait Non-zero to wait for at least one completion if none is ready and requests are in flight.
+ *
+ * @return the number of requests completed, -1 if io_uring failed.
+ */
+int tar_aio_poll(tar_aio_t *aio, int wait) {
+    STATS_SPAN(TAR_FN_TAR_AIO_POLL, HANDLE_STATS(aio->archive), NULL);
+    unsigned no_finished;
+
+    if (aio->backend == TAR_AIO_URING) {
+        int in_flight = aio->no_free + aio->no_finished < aio->depth;
+        if (aio_uring_reap(aio, wait && aio->no_finished == 0 && in_flight) < 0) {
+            return -1;
+        }
+        no_finished = aio->no_finished;
+        memcpy(aio->completed, aio->finished, no_finished * sizeof(unsigned));
+        aio->no_finished = 0;
+    } else {
+        pthread_mutex_lock(&aio->lock);
+        while (wait && aio->no_finished == 0 && aio->no_free < aio->depth) {
+            pthread_cond_wait(&aio->done, &aio->lock);
+        }
+        no_finished = aio->no_finished;
+        memcpy(aio->completed, aio->finished, no_finished * sizeof(unsigned));
+        aio->no_finished = 0;
+        pthread_mutex_unlock(&aio->lock);
+    }
+
+    // a callback may submit again, so its slot is freed right before it runs
+    for (unsigned i = 0; i < no_finished; i++) {
+        aio_slot_t slot = aio->slots[aio->completed[i]];
+        aio->free_slots[aio->no_free++] = aio->completed[i];
+        if (slot.callback != NULL) {
+            slot.callback(slot.request, slot.data);
+        }
+    }
+    return no_finished;
+}
+
+/**
+ * Waits for the requests in flight, running their callbacks, then releases an engine.
+ *
+ * @param aio The engine to release, may be NULL.
+ */
+void tar_aio_close(tar_aio_t *aio) {
+    STATS_SPAN(TAR_FN_TAR_AIO_CLOSE, NULL, NULL);
+    if (aio == NULL) {
+        return;
+    }
+    while (aio->no_free < aio->depth) {
+        if (tar_aio_poll(aio, 1) < 0) {
+            break;
+        }
+    }
+
+    if (aio->backend == TAR_AIO_URING) {
+        aio_uring_free(aio);
+    } else {
+        aio_pool_free(aio);
+    }
+    free(aio->buffers);
+    free(aio->slots);
+    free(aio->free_slots);
+    free(aio->finished);
+    free(aio->completed);
+    free(aio);
+}
+
+
+/*
+ * Extraction
+ *
+ * The tree of the index is walked breadth first, so every directory is created before what it holds. Files become
+ * tasks, large ones split in chunks, spread over the workers in contiguous runs: each worker takes tasks from the
+ * front of its own run and, once it is empty, steals the back half of the run of another worker. Links come last,
+ * in archive order, so that hard links find their targets.
+ */
+
+#define EXTRACT_CHUNK (8 << 20)
+#define EXTRACT_MAX_THREADS 64
+
+typedef struct {
+    uint32_t entry;
+    uint64_t offset;    // offset in the file
+    uint64_t length;
+} extract_task_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;        // the tasks left to the worker are [head, tail) of the task array
+    size_t tail;
+} extract_run_t;
+
+typedef struct {
+    const tar_archive_t *archive;
+    int dir_fd;
+    extract_task_t *tasks;
+    extract_run_t *runs;
+    int nthreads;
+    int errors;
+} extract_t;
+
+typedef struct {
+    extract_t *extract;
+    int id;
+} extract_worker_t;
+
+/* Path of an entry to create under the destination, which ".." components cannot leave. */
+static ssize_t extract_path(const tar_index_t *index, const tar_entry_t *entry, char *out) {
+    return path_normalize("", 0, index->names + entry->name, entry->name_len, out);
+}
+
+/* Copies a range of the archive to a file, in the kernel if it can. */
+static int copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length) {
+    off_t in = in_offset, out = out_offset;
+    int use_copy_range = 1;
+    uint8_t buffer[65536];
+
+    while (length > 0) {
+        ssize_t num_bytes;
+        if (use_copy_range) {
+            num_bytes = copy_file_range(in_fd, &in, out_fd, &out, length, 0);
+            if (num_bytes < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_copy_range = 0;
+                continue;
+            }
+        } else {
+            num_bytes = counted_pread(in_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), in);
+            if (num_bytes > 0) {
+                size_t written = 0;
+                while (written < (size_t)num_bytes) {
+                    ssize_t ret = pwrite(out_fd, buffer + written, num_bytes - written, out + written);
+                    if (ret < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (ret < 0) {
+                        return -1;
+                    }
+                    written += ret;
+                }
+                in += num_bytes;
+                out += num_bytes;
+            }
+        }
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes <= 0) {
+            return -1; // truncated archive
+        }
+        length -= num_bytes;
+    }
+    return 0;
+}
+
+/* Takes back the owner permissions given to files written in chunks, the umask applied at creation kept. */
+static int extract_restore_modes(const extract_t *extract, size_t no_tasks) {
+    const tar_index_t *index = extract->archive->index;
+    int errors = 0;
+    for (size_t i = 0; i < no_tasks; i++) {
+        const extract_task_t *task = &extract->tasks[i];
+        const tar_entry_t *entry = &index->entries[task->entry];
+        if (task->offset != 0 || task->length == entry->size || (entry->mode & 0600) == 0600) {
+            continue;
+        }
+        char path[PATH_BUF];
+        struct stat st;
+        if (extract_path(index, entry, path) <= 0 || fstatat(extract->dir_fd, path, &st, AT_SYMLINK_NOFOLLOW) < 0
+                || fchmodat(extract->dir_fd, path, st.st_mode & 07777 & ~(0600 & ~entry->mode), 0) < 0) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+static int extract_task(extract_t *extract, const extract_task_t *task) {
+    const tar_index_t *index = extract->archive->index;
+    const tar_entry_t *entry = &index->entries[task->entry];
+    char path[PATH_BUF];
+    if (extract_path(index, entry, path) <= 0) {
+        return -1;
+    }
+
+    // chunks go to a file created beforehand
+    int whole = task->offset == 0 && task->length == entry->size;
+    int fd = whole ? openat(extract->dir_fd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, entry->mode)
+                   : openat(extract->dir_fd, path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = copy_range(extract->archive->fd, entry->offset + sizeof(tar_header_t) + task->offset,
+                         fd, task->offset, task->length);
+    if (close(fd) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Takes the next task of the worker, stealing from the others when it has none left. */
+static int extract_next(extract_t *extract, int id, extract_task_t *task) {
+    extract_run_t *own = &extract->runs[id];
+
+    for (;;) {
+        pthread_mutex_lock(&own->lock);
+        if (own->head < own->tail) {
+            *task = extract->tasks[own->head++];
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&own->lock);
+
+        size_t head = 0, tail = 0;
+        for (int i = 1; i < extract->nthreads && head == tail; i++) {
+            extract_run_t *victim = &extract->runs[(id + i) % extract->nthreads];
+            pthread_mutex_lock(&victim->lock);
+            size_t left = victim->tail - victim->head;
+            if (left > 0) {
+                tail = victim->tail;
+                head = tail - (left + 1) / 2;
+                victim->tail = head;
+            }
+            pthread_mutex_unlock(&victim->lock);
+        }
+        // tasks are never added, so nothing to steal means nothing left
+        if (head == tail) {
+            return 0;
+        }
+
+        pthread_mutex_lock(&own->lock);
+        own->head = head;
+        own->tail = tail;
+        pthread_mutex_unlock(&own->lock);
+    }
+}
+
+static void *extract_worker(void *arg) {
+    extract_worker_t *worker = arg;
+    extract_t *extract = worker->extract;
+    extract_task_t task;
+
+    // the calling thread is a worker too
+    tar_stats_t *saved_stats = current_stats;
+    current_stats = HANDLE_STATS(extract->archive);
+    while (extract_next(extract, worker->id, &task)) {
+        if (extract_task(extract, &task) < 0) {
+            __atomic_fetch_add(&extract->errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+    current_stats = saved_stats;
+    return NULL;
+}
+
+static int extract_add_task(extract_task_t **tasks, size_t *no_tasks, size_t *cap, uint32_t entry, uint64_t offset,
+                            uint64_t length) {
+    if (*no_tasks == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 256;
+        extract_task_t *new_tasks = realloc(*tasks, new_cap * sizeof(extract_task_t));
+        if (new_tasks == NULL) {
+            return -1;
+        }
+        *tasks = new_tasks;
+        *cap = new_cap;
+    }
+    (*tasks)[(*no_tasks)++] = (extract_task_t) { entry, offset, length };
+    return 0;
+}
+
+static int entry_no_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Counts the entries under a directory, which are not extracted when it cannot be created. */
+static size_t extract_subtree_size(const tar_index_t *index, const tar_entry_t *dir) {
+    size_t size = dir->no_children;
+    for (uint32_t i = 0; i < dir->no_children; i++) {
+        const tar_entry_t *entry = &index->entries[index->children[dir->children + i]];
+        if (entry->typeflag == DIRTYPE) {
+            size += extract_subtree_size(index, entry);
+        }
+    }
+    return size;
+}
+
+/* Takes back the owner permissions given to directories while they were filled, deepest first so that a read-only
+ * parent does not stop its children; the umask applied at creation is kept. */
+static int extract_restore_dir_modes(const tar_index_t *index, int dir_fd, const uint32_t *dirs, size_t no_dirs) {
+    int errors = 0;
+    for (size_t i = no_dirs; i-- > 0;) {
+        const tar_entry_t *entry = &index->entries[dirs[i]];
+        if ((entry->mode & 0700) == 0700) {
+            continue;
+        }
+        char path[PATH_BUF];
+        struct stat st;
+        if (extract_path(index, entry, path) <= 0 || fstatat(dir_fd, path, &st, AT_SYMLINK_NOFOLLOW) < 0
+                || fchmodat(dir_fd, path, st.st_mode & 07777 & ~(0700 & ~entry->mode), 0) < 0) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/* Creates the hard and symbolic links, in archive order. */
+static int extract_links(const tar_index_t *index, int dir_fd, uint32_t *links, size_t no_links) {
+    int errors = 0;
+    qsort(links, no_links, sizeof(uint32_t), entry_no_cmp);
+
+    for (size_t i = 0; i < no_links; i++) {
+        const tar_entry_t *entry = &index->entries[links[i]];
+        const char *link = index->names + entry->link;
+        char path[PATH_BUF], target[PATH_BUF];
+        if (extract_path(index, entry, path) <= 0) {
+            errors++;
+            continue;
+        }
+        unlinkat(dir_fd, path, 0);
+
+        if (entry->typeflag == SYMTYPE) {
+            // created as stored, relative to the link
+            if (symlinkat(link, dir_fd, path) < 0) {
+                errors++;
+            }
+        } else if (path_normalize("", 0, link, strlen(link), target) <= 0
+                   || linkat(dir_fd, target, dir_fd, path, 0) < 0) {
+            // hard link targets are paths from the root of the archive
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/**
+ * Extracts an archive under a directory: directories first, then regular files with several threads, then links,
+ * then the modes of the directories.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param dest_dir The directory to extract into, which must exist.
+ * @param nthreads The number of threads writing files, zero or less for one per online processor.
+ *
+ * @return zero if every entry was extracted,
+ *         -1 if the destination could not be opened or memory could not be allocated,
+ *         a positive value, the number of entries that could not be extracted, otherwise; the entries under a
+ *         directory that could not be created count as not extracted.
+ */
+int tar_extract(const tar_archive_t *archive, const char *dest_dir, int nthreads) {
+    STATS_SPAN(TAR_FN_TAR_EXTRACT, HANDLE_STATS(archive), dest_dir);
+    const tar_index_t *index = archive->index;
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > EXTRACT_MAX_THREADS) {
+        nthreads = EXTRACT_MAX_THREADS;
+    }
+
+    extract_t extract = { archive, open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC), NULL, NULL, nthreads, 0 };
+    if (extract.dir_fd < 0) {
+        return -1;
+    }
+    uint32_t *queue = malloc(index->no_entries * sizeof(uint32_t));
+    uint32_t *links = malloc(index->no_entries * sizeof(uint32_t));
+    size_t no_tasks = 0, cap_tasks = 0, no_links = 0;
+    int ret = -1;
+    if (queue == NULL || links == NULL) {
+        goto out;
+    }
+
+    // directories, breadth first
+    size_t head = 0, tail = 0;
+    queue[tail++] = index->root;
+    while (head < tail) {
+        const tar_entry_t *dir = &index->entries[queue[head++]];
+        for (uint32_t i = 0; i < dir->no_children; i++) {
+            uint32_t child = index->children[dir->children + i];
+            const tar_entry_t *entry = &index->entries[child];
+            char path[PATH_BUF];
+            if (extract_path(index, entry, path) <= 0) {
+                extract.errors++;
+                continue;
+            }
+
+            if (entry->typeflag == DIRTYPE) {
+                // writable and searchable by its owner until its contents are extracted
+                if (mkdirat(extract.dir_fd, path, entry->mode | 0700) < 0 && errno != EEXIST) {
+                    extract.errors += 1 + extract_subtree_size(index, entry);
+                } else {
+                    queue[tail++] = child;
+                }
+            } else if (entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE) {
+                links[no_links++] = child;
+            } else if (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) {
+                if (entry->size <= EXTRACT_CHUNK) {
+                    if (extract_add_task(&extract.tasks, &no_tasks, &cap_tasks, child, 0, entry->size) < 0) {
+                        goto out;
+                    }
+                    continue;
+                }
+                // sized here so that chunks can be written in any order, writable by its owner until then
+                int fd = openat(extract.dir_fd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, entry->mode | 0600);
+                if (fd < 0 || ftruncate(fd, entry->size) < 0) {
+                    extract.errors++;
+                } else {
+                    for (uint64_t offset = 0; offset < entry->size; offset += EXTRACT_CHUNK) {
+                        uint64_t length = entry->size - offset < EXTRACT_CHUNK ? entry->size - offset : EXTRACT_CHUNK;
+                        if (extract_add_task(&extract.tasks, &no_tasks, &cap_tasks, child, offset, length) < 0) {
+                            close(fd);
+                            goto out;
+                        }
+                    }
+                }
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    // files, each worker starting with a contiguous run of tasks
+    extract.runs = malloc(nthreads * sizeof(extract_run_t));
+    if (extract.runs == NULL) {
+        goto out;
+    }
+    pthread_t threads[EXTRACT_MAX_THREADS];
+    extract_worker_t workers[EXTRACT_MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&extract.runs[i].lock, NULL);
+        extract.runs[i].head = no_tasks * i / nthreads;
+        extract.runs[i].tail = no_tasks * (i + 1) / nthreads;
+        workers[i] = (extract_worker_t) { &extract, i };
+    }
+    int started = 1;
+    while (started < nthreads && pthread_create(&threads[started], NULL, extract_worker, &workers[started]) == 0) {
+        started++;
+    }
+    extract_worker(&workers[0]); // the runs of threads that could not start get stolen
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&extract.runs[i].lock);
+    }
+    extract.errors += extract_restore_modes(&extract, no_tasks);
+
+    extract.errors += extract_links(index, extract.dir_fd, links, no_links);
+    // the queue holds the directories breadth first, so children come after their parent
+    extract.errors += extract_restore_dir_modes(index, extract.dir_fd, queue + 1, tail - 1);
+    ret = extract.errors;
+
+out:
+    close(extract.dir_fd);
+    free(queue);
+    free(links);
+    free(extract.tasks);
+    free(extract.runs);
+    return ret;
+}
+
+
+/*
+ * Archive writer
+ *
+ * Entries go through a bounded queue in the order they are added. Worker threads take them in any order to stat
+ * and open their source, encode their header and, for small files, read their contents; one writer thread takes
+ * them back in order and appends them to the archive. Headers and small files are gathered in a buffer flushed in
+ * large writes, larger bodies are copied by the kernel straight from their source.
+ */
+
+#define WRITER_QUEUE 256
+#define WRITER_BUFFER (1 << 20)
+#define WRITER_SMALL (64 * 1024)        // files read by the workers
+#define WRITER_MAX_THREADS 16
+#define WRITER_MAX_OCTAL_SIZE 077777777777ULL
+
+enum { WRITER_FILE, WRITER_DIR, WRITER_SYMLINK };
+enum { WRITER_QUEUED, WRITER_ENCODING, WRITER_READY };
+
+typedef struct {
+    int kind;
+    int state;
+    char *name;
+    char *source;       // file to copy, or target of a symbolic link
+    mode_t mode;
+    int failed;         // the entry is skipped
+    int fd;             // source of a large file, -1 otherwise
+    uint64_t size;
+    uint8_t *data;      // contents of a small file, padded
+    tar_header_t header;
+} writer_job_t;
+
+enum { COPY_RANGE, COPY_SENDFILE, COPY_BUFFER };
+
+struct tar_writer {
+    int fd;
+    writer_job_t jobs[WRITER_QUEUE];
+    uint64_t added;     // jobs are numbered in the order they were added
+    uint64_t encoded;   // next job for a worker
+    uint64_t written;   // next job for the writer
+    int closing;
+    int skipped;
+    int error;          // writing to the archive failed
+
+    pthread_mutex_t lock;
+    pthread_cond_t space;
+    pthread_cond_t work;
+    pthread_cond_t ready;
+    pthread_t workers[WRITER_MAX_THREADS];
+    int no_workers;
+    pthread_t writer;
+
+    uint8_t *buffer;
+    size_t buffer_len;
+    int copy;           // how bodies are copied, downgraded when the kernel refuses
+};
+
+static void put_octal(char *field, size_t size, uint64_t value) {
+    // size - 1 digits and a null
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%0*llo", (int)(size - 1), (unsigned long long)value);
+    memcpy(field, digits, size);
+}
+
+/* Sizes too large for the octal digits are written in base 256, as GNU tar does. */
+static void put_size(char *field, size_t size, uint64_t value) {
+    if (value <= WRITER_MAX_OCTAL_SIZE) {
+        put_octal(field, size, value);
+        return;
+    }
+    memset(field, 0, size);
+    field[0] = (char)0x80;
+    for (size_t i = size - 1; i > 0 && value > 0; i--, value >>= 8) {
+        field[i] = (char)(value & 0xff);
+    }
+}
+
+/* Splits a path between the prefix and name fields, returns -1 if it cannot fit. */
+static int put_name(tar_header_t *header, const char *name) {
+    size_t len = strlen(name);
+    if (len <= sizeof(header->name)) {
+        memcpy(header->name, name, len);
+        return 0;
+    }
+    // the prefix ends at a slash, which is not stored
+    for (size_t i = len - sizeof(header->name) - 1; i + 1 < len && i <= sizeof(header->prefix); i++) {
+        if (name[i] == '/' && i > 0) {
+            memcpy(header->prefix, name, i);
+            memcpy(header->name, name + i + 1, len - i - 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int writer_encode(writer_job_t *job) {
+    tar_header_t *header = &job->header;
+    struct stat st;
+    memset(header, 0, sizeof(tar_header_t));
+
+    if (job->kind == WRITER_FILE) {
+        job->fd = open(job->source, O_RDONLY | O_CLOEXEC);
+        if (job->fd < 0 || fstat(job->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            return -1;
+        }
+        job->size = st.st_size;
+        job->mode = st.st_mode;
+        header->typeflag = REGTYPE;
+    } else {
+        st.st_uid = getuid();
+        st.st_gid = getgid();
+        st.st_mtime = time(NULL);
+        job->size = 0;
+        header->typeflag = job->kind == WRITER_DIR ? DIRTYPE : SYMTYPE;
+        if (job->kind == WRITER_SYMLINK) {
+            size_t len = strlen(job->source);
+            if (len > sizeof(header->linkname)) {
+                return -1;
+            }
+            memcpy(header->linkname, job->source, len);
+        }
+    }
+
+    if (put_name(header, job->name) < 0) {
+        return -1;
+    }
+    put_octal(header->mode, sizeof(header->mode), job->mode & 07777);
+    put_octal(header->uid, sizeof(header->uid), st.st_uid <= 07777777 ? st.st_uid : 0);
+    put_octal(header->gid, sizeof(header->gid), st.st_gid <= 07777777 ? st.st_gid : 0);
+    put_size(header->size, sizeof(header->size), job->size);
+    put_octal(header->mtime, sizeof(header->mtime), st.st_mtime > 0 ? st.st_mtime : 0);
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    put_octal(header->devmajor, sizeof(header->devmajor), 0);
+    put_octal(header->devminor, sizeof(header->devminor), 0);
+
+    // six digits, a null and a space
+    unsigned int checksum = tar_header_checksum(header);
+    put_octal(header->chksum, 7, checksum);
+    header->chksum[7] = ' ';
+
+    if (job->kind == WRITER_FILE && job->size <= WRITER_SMALL) {
+        size_t padded = (job->size + 511) / 512 * 512;
+        job->data = calloc(1, padded ? padded : 1);
+        if (job->data == NULL) {
+            return -1;
+        }
+        size_t done = 0;
+        while (done < job->size) {
+            ssize_t num_bytes = pread(job->fd, job->data + done, job->size - done, done);
+            if (num_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (num_bytes <= 0) {
+                return -1; // the file shrank
+            }
+            done += num_bytes;
+        }
+        close(job->fd);
+        job->fd = -1;
+    }
+    return 0;
+}
+
+static void *writer_worker(void *arg) {
+    tar_writer_t *writer = arg;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->encoded == writer->added && !writer->closing) {
+            pthread_cond_wait(&writer->work, &writer->lock);
+        }
+        if (writer->encoded == writer->added) {
+            break;
+        }
+        writer_job_t *job = &writer->jobs[writer->encoded++ % WRITER_QUEUE];
+        job->state = WRITER_ENCODING;
+        pthread_mutex_unlock(&writer->lock);
+
+        job->failed = writer_encode(job) < 0;
+
+        pthread_mutex_lock(&writer->lock);
+        job->state = WRITER_READY;
+        pthread_cond_broadcast(&writer->ready);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+static int writer_flush(tar_writer_t *writer) {
+    if (write_all(writer->fd, writer->buffer, writer->buffer_len) < 0) {
+        return -1;
+    }
+    writer->buffer_len = 0;
+    return 0;
+}
+
+static int writer_put(tar_writer_t *writer, const void *data, size_t len) {
+    if (writer->buffer_len + len > WRITER_BUFFER && writer_flush(writer) < 0) {
+        return -1;
+    }
+    if (len > WRITER_BUFFER) {
+        return write_all(writer->fd, data, len);
+    }
+    memcpy(writer->buffer + writer->buffer_len, data, len);
+    writer->buffer_len += len;
+    return 0;
+}
+
+/* Copies the body of a large file, then pads it; a file that shrank meanwhile is padded with zeros. */
+static int writer_copy_body(tar_writer_t *writer, writer_job_t *job) {
+    if (writer_flush(writer) < 0) {
+        return -1;
+    }
+    off_t offset = 0;
+    uint64_t left = job->size;
+    while (left > 0) {
+        ssize_t num_bytes;
+        if (writer->copy == COPY_RANGE) {
+            num_bytes = copy_file_range(job->fd, &offset, writer->fd, NULL, left, 0);
+            if (num_bytes < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP
+                                  || errno == EBADF)) {
+                writer->copy = COPY_SENDFILE;
+                continue;
+            }
+        } else if (writer->copy == COPY_SENDFILE) {
+            num_bytes = sendfile(writer->fd, job->fd, &offset, left);
+            if (num_bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                writer->copy = COPY_BUFFER;
+                continue;
+            }
+        } else {
+            num_bytes = pread(job->fd, writer->buffer, left < WRITER_BUFFER ? left : WRITER_BUFFER, offset);
+            if (num_bytes > 0) {
+                if (write_all(writer->fd, writer->buffer, num_bytes) < 0) {
+                    return -1;
+                }
+                offset += num_bytes;
+            }
+        }
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes < 0) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            // the file shrank and its header is out already: keep the archive well-formed
+            writer->skipped++;
+            break;
+        }
+        left -= num_bytes;
+    }
+
+    static const uint8_t zeros[512];
+    while (left > 0) {
+        size_t chunk = left < sizeof(zeros) ? left : sizeof(zeros);
+        if (writer_put(writer, zeros, chunk) < 0) {
+            return -1;
+        }
+        left -= chunk;
+    }
+    size_t padding = (512 - job->size % 512) % 512;
+    return writer_put(writer, zeros, padding);
+}
+
+static void writer_free_job(writer_job_t *job) {
+    if (job->fd >= 0) {
+        close(job->fd);
+    }
+    free(job->name);
+    free(job->source);
+    free(job->data);
+}
+
+static void *writer_thread(void *arg) {
+    tar_writer_t *writer = arg;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        writer_job_t *job = &writer->jobs[writer->written % WRITER_QUEUE];
+        while (!(writer->written < writer->added && job->state == WRITER_READY)
+               && !(writer->closing && writer->written == writer->added)) {
+            pthread_cond_wait(&writer->ready, &writer->lock);
+        }
+        if (writer->written == writer->added) {
+            break;
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        if (job->failed) {
+            writer->skipped++;
+        } else if (!writer->error) {
+            int ret = writer_put(writer, &job->header, sizeof(tar_header_t));
+            if (ret == 0 && job->data != NULL) {
+                ret = writer_put(writer, job->data, (job->size + 511) / 512 * 512);
+            } else if (ret == 0 && job->fd >= 0) {
+                ret = writer_copy_body(writer, job);
+            }
+            writer->error = ret < 0;
+        }
+        writer_free_job(job);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->written++;
+        pthread_cond_signal(&writer->space);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    // end of archive: two null blocks
+    static const uint8_t end[2 * sizeof(tar_header_t)];
+    if (!writer->error && (writer_put(writer, end, sizeof(end)) < 0 || writer_flush(writer) < 0)) {
+        writer->error = 1;
+    }
+    return NULL;
+}
+
+/**
+ * Starts writing an archive.
+ *
+ * @param out_fd A file descriptor to write the archive to, at its current offset.
+ * @param nthreads The number of threads preparing entries, zero or less for one per online processor.
+ *
+ * @return a newly allocated writer to be finished with tar_writer_close(),
+ *         NULL if memory or threads could not be allocated.
+ */
+tar_writer_t *tar_writer_open(int out_fd, int nthreads) {
+    STATS_SPAN(TAR_FN_TAR_WRITER_OPEN, NULL, NULL);
+    tar_writer_t *writer = calloc(1, sizeof(tar_writer_t));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->fd = out_fd;
+    writer->buffer = malloc(WRITER_BUFFER);
+    if (writer->buffer == NULL) {
+        free(writer);
+        return NULL;
+    }
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > WRITER_MAX_THREADS) {
+        nthreads = WRITER_MAX_THREADS;
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->space, NULL);
+    pthread_cond_init(&writer->work, NULL);
+    pthread_cond_init(&writer->ready, NULL);
+    while (writer->no_workers < nthreads
+           && pthread_create(&writer->workers[writer->no_workers], NULL, writer_worker, writer) == 0) {
+        writer->no_workers++;
+    }
+    if (writer->no_workers == 0 || pthread_create(&writer->writer, NULL, writer_thread, writer) != 0) {
+        pthread_mutex_lock(&writer->lock);
+        writer->closing = 1;
+        pthread_cond_broadcast(&writer->work);
+        pthread_mutex_unlock(&writer->lock);
+        for (int i = 0; i < writer->no_workers; i++) {
+            pthread_join(writer->workers[i], NULL);
+        }
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->space);
+        pthread_cond_destroy(&writer->work);
+        pthread_cond_destroy(&writer->ready);
+        free(writer->buffer);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+static int writer_add(tar_writer_t *writer, int kind, const char *name, const char *source, mode_t mode) {
+    char *name_copy = strdup(name), *source_copy = source != NULL ? strdup(source) : NULL;
+    if (name_copy == NULL || (source != NULL && source_copy == NULL)) {
+        free(name_copy);
+        free(source_copy);
+        return -1;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->added - writer->written == WRITER_QUEUE) {
+        pthread_cond_wait(&writer->space, &writer->lock);
+    }
+    writer_job_t *job = &writer->jobs[writer->added % WRITER_QUEUE];
+    memset(job, 0, sizeof(writer_job_t));
+    job->kind = kind;
+    job->state = WRITER_QUEUED;
+    job->name = name_copy;
+    job->source = source_copy;
+    job->mode = mode;
+    job->fd = -1;
+    writer->added++;
+    pthread_cond_signal(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+    return 0;
+}
+
+/**
+ * Adds a regular file to the archive. Its contents, permissions, owner and modification time are read from a file
+ * on disk, by a worker thread, so errors on the source only show in the result of tar_writer_close().
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the entry in the archive.
+ * @param src_path The file to copy.
+ *
+ * @return zero if the file was queued, -1 if memory could not be allocated.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *name, const char *src_path) {
+    STATS_SPAN(TAR_FN_TAR_WRITER_ADD_FILE, NULL, name);
+    return writer_add(writer, WRITER_FILE, name, src_path, 0);
+}
+
+/**
+ * Adds a directory to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the directory in the archive, a trailing slash is added if missing.
+ * @param mode The permissions of the directory.
+ *
+ * @return zero if the directory was queued, -1 if memory could not be allocated.
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *name, mode_t mode) {
+    STATS_SPAN(TAR_FN_TAR_WRITER_ADD_DIR, NULL, name);
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/') {
+        return writer_add(writer, WRITER_DIR, name, NULL, mode);
+    }
+    char *dir_name = malloc(len + 2);
+    if (dir_name == NULL) {
+        return -1;
+    }
+    memcpy(dir_name, name, len);
+    memcpy(dir_name + len, "/", 2);
+    int ret = writer_add(writer, WRITER_DIR, dir_name, NULL, mode);
+    free(dir_name);
+    return ret;
+}
+
+/**
+ * Adds a symbolic link to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the link in the archive.
+ * @param target The target of the link, stored as is.
+ *
+ * @return zero if the link was queued, -1 if memory could not be allocated.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *name, const char *target) {
+    STATS_SPAN(TAR_FN_TAR_WRITER_ADD_SYMLINK, NULL, name);
+    return writer_add(writer, WRITER_SYMLINK, name, target, 0777);
+}
+
+/**
+ * Writes the entries still queued and the end of the archive, then releases the writer. The file descriptor is
+ * left open.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ *
+ * @return zero if every entry was added,
+ *         -1 if writing to the archive failed,
+ *         a positive value, the number of entries skipped because their source could not be read or their name or
+ *         link target does not fit in a header, otherwise.
+ */
+int tar_writer_close(tar_writer_t *writer) {
+    STATS_SPAN(TAR_FN_TAR_WRITER_CLOSE, NULL, NULL);
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = 1;
+    pthread_cond_broadcast(&writer->work);
+    pthread_cond_broadcast(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->writer, NULL);
+    for (int i = 0; i < writer->no_workers; i++) {
+        pthread_join(writer->workers[i], NULL);
+    }
+    int ret = writer->error ? -1 : writer->skipped;
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->space);
+    pthread_cond_destroy(&writer->work);
+    pthread_cond_destroy(&writer->ready);
+    free(writer->buffer);
+    free(writer);
+    return ret;
+}
+
+
+/*
+ * Overlays
+ *
+ * A stack of archives seen as one, the way container images stack their layers: the topmost layer holding a path
+ * wins, and a layer hides paths of the layers below it with whiteouts, empty entries named ".wh.<name>" next to the
+ * hidden entry, or ".wh..wh..opq" inside a directory to hide the whole contents of the directories below.
+ *
+ * Every layer keeps a Bloom filter of its paths, blocked so that a probe is a single 64-bit word, and the hash of
+ * a path is computed once per call, so a layer not holding a path is skipped without touching its index. Symbolic
+ * links are resolved within the layer holding them: a path going through a link of a layer, which the filter of
+ * its paths cannot know about, is also looked up in the layers whose filter of links holds one of its directories.
+ */
+
+#define BLOOM_BITS_PER_ENTRY 16
+#define BLOOM_PROBES 6
+#define OVERLAY_MAX_DEPTH 64
+#define WHITEOUT ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+typedef struct {
+    uint64_t *words;
+    size_t mask;            // number of words - 1, a power of two
+} bloom_t;
+
+typedef struct {
+    const tar_archive_t *archive;
+    bloom_t paths;
+    bloom_t links;          // paths of the symbolic links
+    int has_links;
+    int has_whiteouts;
+} overlay_layer_t;
+
+struct tar_overlay {
+    overlay_layer_t *layers;    // bottom first
+    size_t no_layers;
+};
+
+/* A path as looked up in every layer. */
+typedef struct {
+    const char *path;
+    size_t len;                         // trailing slashes excluded
+    uint64_t hash;
+    size_t no_dirs;                     // leading directories, the root excluded
+    uint64_t dir_hash[OVERLAY_MAX_DEPTH];
+} overlay_key_t;
+
+static uint64_t bloom_hash_update(uint64_t hash, const char *str, size_t len) {
+    // FNV-1a, which can be carried on over a longer path
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+#define BLOOM_HASH_INIT 14695981039346656037ull
+
+static uint64_t bloom_mix(uint64_t hash) {
+    // the last bytes of FNV-1a are poorly spread over the high bits
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* The bits a hash sets, all within one word: the low bits pick the word, the high ones the bits. */
+static uint64_t bloom_bits(uint64_t hash) {
+    uint64_t bits = 0;
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        bits |= 1ull << ((hash >> (64 - 6 * (i + 1))) & 63);
+    }
+    return bits;
+}
+
+static int bloom_init(bloom_t *bloom, size_t no_keys) {
+    size_t no_words = 1;
+    while (no_words * 64 < no_keys * BLOOM_BITS_PER_ENTRY) {
+        no_words *= 2;
+    }
+    bloom->words = calloc(no_words, sizeof(uint64_t));
+    bloom->mask = no_words - 1;
+    return bloom->words != NULL ? 0 : -1;
+}
+
+static void bloom_add(bloom_t *bloom, uint64_t hash) {
+    hash = bloom_mix(hash);
+    bloom->words[hash & bloom->mask] |= bloom_bits(hash);
+}
+
+static int bloom_may_hold(const bloom_t *bloom, uint64_t hash) {
+    hash = bloom_mix(hash);
+    uint64_t bits = bloom_bits(hash);
+    return (bloom->words[hash & bloom->mask] & bits) == bits;
+}
+
+static int is_whiteout(const char *name, size_t len) {
+    size_t base = len;
+    while (base > 0 && name[base - 1] != '/') {
+        base--;
+    }
+    return len - base >= sizeof(WHITEOUT) - 1 && memcmp(name + base, WHITEOUT, sizeof(WHITEOUT) - 1) == 0;
+}
+
+static int overlay_layer_init(overlay_layer_t *layer, const tar_archive_t *archive) {
+    const tar_index_t *index = archive->index;
+    size_t no_links = 0;
+    layer->archive = archive;
+    for (size_t i = 0; i < index->no_entries; i++) {
+        no_links += index->entries[i].typeflag == SYMTYPE;
+    }
+    layer->has_links = no_links > 0;
+    if (bloom_init(&layer->paths, index->no_entries) < 0 || bloom_init(&layer->links, no_links) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < index->no_entries; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        const char *name = index->names + entry->name;
+        uint64_t hash = bloom_hash_update(BLOOM_HASH_INIT, name, entry->name_len);
+        bloom_add(&layer->paths, hash);
+        if (entry->typeflag == SYMTYPE) {
+            bloom_add(&layer->links, hash);
+        }
+        layer->has_whiteouts |= is_whiteout(name, entry->name_len);
+    }
+    return 0;
+}
+
+static void overlay_key_init(overlay_key_t *key, const char *path) {
+    key->path = path;
+    key->len = path_key_len(path, strlen(path));
+    key->no_dirs = 0;
+
+    uint64_t hash = BLOOM_HASH_INIT;
+    for (size_t i = 0; i < key->len; i++) {
+        if (path[i] == '/' && i > 0 && key->no_dirs < OVERLAY_MAX_DEPTH) {
+            key->dir_hash[key->no_dirs++] = hash;
+        }
+        hash = bloom_hash_update(hash, path + i, 1);
+    }
+    key->hash = hash;
+}
+
+/* Whether a layer may hold the path, directly or through one of its symbolic links. */
+static int overlay_may_hold(const overlay_layer_t *layer, const overlay_key_t *key) {
+    if (bloom_may_hold(&layer->paths, key->hash)) {
+        return 1;
+    }
+    if (!layer->has_links) {
+        return 0;
+    }
+    for (size_t i = 0; i < key->no_dirs; i++) {
+        if (bloom_may_hold(&layer->links, key->dir_hash[i])) {
+            return 1;
+        }
+    }
+    return key->no_dirs == OVERLAY_MAX_DEPTH; // too deep to tell
+}
+
+/* Looks up an entry by its exact path in a layer, through the filter first. */
+static int overlay_layer_has(const overlay_layer_t *layer, const char *path, size_t len) {
+    uint64_t hash = bloom_hash_update(BLOOM_HASH_INIT, path, len);
+    return bloom_may_hold(&layer->paths, hash) && index_find(layer->archive->index, path, len) != INDEX_NO_SLOT;
+}
+
+/* Whether a layer hides the path, or one of its directories, from the layers below. */
+static int overlay_hides(const overlay_layer_t *layer, const overlay_key_t *key) {
+    if (!layer->has_whiteouts) {
+        return 0;
+    }
+    char whiteout[PATH_BUF];
+    size_t dir_len = 0;
+    for (size_t i = 0; i <= key->len; i++) {
+        if (i < key->len && key->path[i] != '/') {
+            continue;
+        }
+        // the component is [dir_len, i), its directory [0, dir_len)
+        size_t name_len = i - dir_len;
+        if (name_len > 0 && dir_len + sizeof(WHITEOUT_OPAQUE) + name_len <= sizeof(whiteout)) {
+            memcpy(whiteout, key->path, dir_len);
+            memcpy(whiteout + dir_len, WHITEOUT_OPAQUE, sizeof(WHITEOUT_OPAQUE) - 1);
+            if (overlay_layer_has(layer, whiteout, dir_len + sizeof(WHITEOUT_OPAQUE) - 1)) {
+                return 1;
+            }
+            memcpy(whiteout + dir_len, WHITEOUT, sizeof(WHITEOUT) - 1);
+            memcpy(whiteout + dir_len + sizeof(WHITEOUT) - 1, key->path + dir_len, name_len);
+            if (overlay_layer_has(layer, whiteout, dir_len + sizeof(WHITEOUT) - 1 + name_len)) {
+                return 1;
+            }
+        }
+        dir_len = i + 1;
+    }
+    return 0;
+}
+
+/* Whether a layer holds something other than a directory where the path has one, hiding what is below it. */
+static int overlay_shadows(const overlay_layer_t *layer, const overlay_key_t *key) {
+    const tar_index_t *index = layer->archive->index;
+    size_t d = 0;
+    for (size_t i = 1; i < key->len && d < key->no_dirs; i++) {
+        if (key->path[i] != '/') {
+            continue;
+        }
+        // dir_hash[d] is the hash of the path up to this slash
+        if (bloom_may_hold(&layer->paths, key->dir_hash[d++])) {
+            uint32_t e = index_find(index, key->path, i);
+            if (e != INDEX_NO_SLOT && index->entries[e].typeflag != DIRTYPE) {
+                return 1;
+            }
+        }
+    }
+    // a path ending with a slash names a directory, a file there hides the directories below it
+    if (key->path[key->len] == '/' && bloom_may_hold(&layer->paths, key->hash)) {
+        uint32_t e = index_find(index, key->path, key->len);
+        if (e != INDEX_NO_SLOT && index->entries[e].typeflag != DIRTYPE && index->entries[e].typeflag != SYMTYPE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Finds the layer a path is served from, and its entry there. Returns NULL if no visible layer holds it. */
+static const overlay_layer_t *overlay_lookup(const tar_overlay_t *overlay, const char *path,
+                                             const tar_entry_t **entry) {
+    overlay_key_t key;
+    overlay_key_init(&key, path);
+    if (is_whiteout(key.path, key.len)) {
+        return NULL; // whiteouts only hide other entries
+    }
+    for (size_t i = overlay->no_layers; i-- > 0;) {
+        const overlay_layer_t *layer = &overlay->layers[i];
+        if (overlay_may_hold(layer, &key)) {
+            *entry = index_lookup(layer->archive->index, path);
+            if (*entry != NULL) {
+                return layer;
+            }
+        }
+        if (overlay_hides(layer, &key) || overlay_shadows(layer, &key)) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Stacks archives into one overlay.
+ *
+ * @param layers Handles returned by tar_open(), the bottom layer first. They must stay open until tar_overlay_close()
+ *               is called.
+ * @param no_layers The number of layers.
+ *
+ * @return a newly allocated overlay to be released with tar_overlay_close(),
+ *         NULL if memory could not be allocated.
+ */
+tar_overlay_t *tar_overlay_open(const tar_archive_t *const *layers, size_t no_layers) {
+    STATS_SPAN(TAR_FN_TAR_OVERLAY_OPEN, NULL, NULL);
+    tar_overlay_t *overlay = calloc(1, sizeof(tar_overlay_t));
+    if (overlay == NULL) {
+        return NULL;
+    }
+    overlay->layers = calloc(no_layers + 1, sizeof(overlay_layer_t));
+    if (overlay->layers == NULL) {
+        free(overlay);
+        return NULL;
+    }
+    for (size_t i = 0; i < no_layers; i++) {
+        overlay->no_layers++;
+        if (overlay_layer_init(&overlay->layers[i], layers[i]) < 0) {
+            tar_overlay_close(overlay);
+            return NULL;
+        }
+    }
+    return overlay;
+}
+
+/**
+ * Releases an overlay opened by tar_overlay_open(). The layers are left open.
+ *
+ * @param overlay The overlay to release, may be NULL.
+ */
+void tar_overlay_close(tar_overlay_t *overlay) {
+    STATS_SPAN(TAR_FN_TAR_OVERLAY_CLOSE, NULL, NULL);
+    if (overlay == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < overlay->no_layers; i++) {
+        free(overlay->layers[i].paths.words);
+        free(overlay->layers[i].links.words);
+    }
+    free(overlay->layers);
+    free(overlay);
+}
+
+/**
+ * Overlay version of exists().
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay.
+ *
+ * @return zero if no visible entry at the given path exists in the layers,
+ *         any other value otherwise.
+ */
+int tar_overlay_exists(const tar_overlay_t *overlay, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_OVERLAY_EXISTS, NULL, path);
+    const tar_entry_t *entry;
+    return overlay_lookup(overlay, path, &entry) != NULL ? 3 : 0;
+}
+
+/**
+ * Overlay version of is_dir().
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay.
+ *
+ * @return zero if no visible entry at the given path exists in the layers or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_overlay_is_dir(const tar_overlay_t *overlay, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_OVERLAY_IS_DIR, NULL, path);
+    const tar_entry_t *entry;
+    return overlay_lookup(overlay, path, &entry) != NULL && entry->typeflag == DIRTYPE ? 3 : 0;
+}
+
+/**
+ * Overlay version of is_file().
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay.
+ *
+ * @return zero if no visible entry at the given path exists in the layers or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_overlay_is_file(const tar_overlay_t *overlay, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_OVERLAY_IS_FILE, NULL, path);
+    const tar_entry_t *entry;
+    return overlay_lookup(overlay, path, &entry) != NULL
+        && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) ? 3 : 0;
+}
+
+/**
+ * Overlay version of is_symlink().
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay.
+ *
+ * @return zero if no visible entry at the given path exists in the layers or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int tar_overlay_is_symlink(const tar_overlay_t *overlay, const char *path) {
+    STATS_SPAN(TAR_FN_TAR_OVERLAY_IS_SYMLINK, NULL, path);
+    const tar_entry_t *entry;
+    return overlay_lookup(overlay, path, &entry) != NULL && entry->typeflag == SYMTYPE ? 3 : 0;
+}
+
+/**
+ * Overlay version of read_file(). The file is read from the topmost layer holding it.
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay. If the entry is a symlink, it is resolved within its layer.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return the same value as tar_read_file() would on the layer holding the file,
+ *         -1 if no visible entry at the given path exists in the layers or the entry is not a file.
+ */
+ssize_t tar_overlay_read_file(const tar_overlay_t *overlay, const char *path, size_t offset, uint8_t *dest,
+                              size_t *len) {
+    STATS_SPAN(TAR_FN_TAR_OVERLAY_READ_FILE, NULL, path);
+    const tar_entry_t *entry;
+    const overlay_layer_t *layer = overlay_lookup(overlay, path, &entry);
+    if (layer == NULL) {
+        return -1;
+    }
+    return tar_read_file(layer->archive, path, offset, dest, len);
+}
+
+typedef struct {
+    const char *name;
+    size_t len;
+    size_t base;        // where the name of the child starts in its path, a whiteout prefix excluded
+    size_t base_len;
+    uint32_t layer;
+    char typeflag;
+    uint8_t whiteout;
+} overlay_child_t;
+
+static int overlay_same_name(const overlay_child_t *x, const overlay_child_t *y) {
+    return x->base_len == y->base_len && memcmp(x->name + x->base, y->name + y->base, x->base_len) == 0;
+}
+
+static int overlay_child_cmp(const void *a, const void *b) {
+    const overlay_child_t *x = a, *y = b;
+    size_t len = x->base_len < y->base_len ? x->base_len : y->base_len;
+    int cmp = memcmp(x->name + x->base, y->name + y->base, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (x->base_len != y->base_len) {
+        return x->base_len < y->base_len ? -1 : 1;
+    }
+    // the topmost layer first, then entries before whiteouts of the same layer
+    if (x->layer != y->layer) {
+        return x->layer > y->layer ? -1 : 1;
+    }
+    return x->whiteout - y->whiteout;
+}
+
+/**
+ * Overlay version of tar_list_arena(). The entries of the directory in every visible layer are merged, the
+ * topmost layer holding a name winning, and sorted by name. Whiteouts are not listed.
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay. If the entry is a symlink, it is resolved within its layer.
+ * @param out Set to an array of the entries listed, to be released with free(), or NULL if there are none.
+ *            The names stay valid until the layers are closed or refreshed.
+ *
+ * @return the number of entries listed,
+ *         -1 if no visible directory at the given path exists in the layers,
+ *         -2 if memory could not be allocated.
+ */
+ssize_t tar_overlay_list_arena(const tar_overlay_t *overlay, const char *path, tar_list_entry_t **out) {
+    STATS_SPAN(TAR_FN_TAR_OVERLAY_LIST_ARENA, NULL, path);
+    overlay_key_t key;
+    overlay_key_init(&key, path);
+    overlay_child_t *children = NULL;
+    size_t no_children = 0, cap_children = 0;
+    int found = 0;
+    *out = NULL;
+
+    for (size_t i = overlay->no_layers; i-- > 0;) {
+        const overlay_layer_t *layer = &overlay->layers[i];
+        const tar_index_t *index = layer->archive->index;
+        int hops = SYMLINK_MAX_HOPS;
+        uint32_t e = key.len == 0 || (key.len == 1 && path[0] == '/') ? index->root :
+                     overlay_may_hold(layer, &key) ? index_walk(index, path, key.len, 1, &hops) : INDEX_NO_SLOT;
+
+        if (e != INDEX_NO_SLOT && index->entries[e].typeflag != DIRTYPE) {
+            break; // a file hides the directories below
+        }
+        if (e != INDEX_NO_SLOT) {
+            const tar_entry_t *dir = &index->entries[e];
+            found = 1;
+            if (no_children + dir->no_children > cap_children) {
+                cap_children = (no_children + dir->no_children) * 2;
+                overlay_child_t *grown = realloc(children, cap_children * sizeof(overlay_child_t));
+                if (grown == NULL) {
+                    free(children);
+                    return -2;
+                }
+                children = grown;
+            }
+
+            int opaque = 0;
+            for (size_t c = 0; c < dir->no_children; c++) {
+                const tar_entry_t *child = &index->entries[index->children[dir->children + c]];
+                overlay_child_t *item = &children[no_children++];
+                item->name = index->names + child->name;
+                item->len = strlen(item->name);
+                item->base = child->name_len;
+                while (item->base > 0 && item->name[item->base - 1] != '/') {
+                    item->base--;
+                }
+                item->base_len = child->name_len - item->base;
+                item->layer = i;
+                item->typeflag = child->typeflag;
+                item->whiteout = is_whiteout(item->name, child->name_len);
+                if (item->whiteout) {
+                    opaque |= item->base_len == sizeof(WHITEOUT_OPAQUE) - 1
+                              && memcmp(item->name + item->base, WHITEOUT_OPAQUE, item->base_len) == 0;
+                    item->base += sizeof(WHITEOUT) - 1;
+                    item->base_len -= sizeof(WHITEOUT) - 1;
+                }
+            }
+            if (opaque) {
+                break;
+            }
+        }
+        if (overlay_hides(layer, &key) || overlay_shadows(layer, &key)) {
+            break;
+        }
+    }
+    if (!found) {
+        free(children);
+        return -1;
+    }
+
+    // the topmost of each name hides the others, and is only listed if it is not a whiteout
+    qsort(children, no_children, sizeof(overlay_child_t), overlay_child_cmp);
+    size_t no_entries = 0;
+    for (size_t c = 0; c < no_children;) {
+        size_t next = c + 1;
+        while (next < no_children && overlay_same_name(&children[c], &children[next])) {
+            next++;
+        }
+        if (!children[c].whiteout) {
+            children[no_entries++] = children[c];
+        }
+        c = next;
+    }
+
+    tar_list_entry_t *list = no_entries > 0 ? malloc(no_entries * sizeof(tar_list_entry_t)) : NULL;
+    if (no_entries > 0 && list == NULL) {
+        free(children);
+        return -2;
+    }
+    for (size_t c = 0; c < no_entries; c++) {
+        list[c] = (tar_list_entry_t) { children[c].name, children[c].len, children[c].typeflag };
+    }
+    free(children);
+    *out = list;
+    return no_entries;
+}
+
+
+/*
+ * Appended archives
+ *
+ * Appending to an archive, as tar -r does, writes new entries over its end-of-archive marker. The index remembers
+ * where that marker was, so a refresh only scans from there: the new entries are added to the hash table, shadowing
+ * earlier ones with the same path, and to the directories holding them, whose lists of children are moved to the
+ * end of the children array. The lists left behind are reclaimed once they take more room than the live ones.
+ * An index loaded from a sidecar is copied out of its mapping by the first refresh.
+ */
+
+typedef struct {
+    uint32_t parent;
+    uint32_t entry;
+} index_child_t;
+
+static int index_child_cmp(const void *a, const void *b) {
+    const index_child_t *x = a, *y = b;
+    if (x->parent != y->parent) {
+        return x->parent < y->parent ? -1 : 1;
+    }
+    return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+/* Copies an index loaded from a sidecar out of its mapping, so that it can grow. */
+static int index_unmap(tar_index_t *index) {
+    if (index->map == NULL) {
+        return 0;
+    }
+    tar_entry_t *entries = malloc(index->no_entries * sizeof(tar_entry_t));
+    char *names = malloc(index->names_len);
+    index_slot_t *slots = malloc(index->no_slots * sizeof(index_slot_t));
+    uint32_t *children = malloc((index->no_children ? index->no_children : 1) * sizeof(uint32_t));
+    if (entries == NULL || names == NULL || slots == NULL || children == NULL) {
+        free(entries);
+        free(names);
+        free(slots);
+        free(children);
+        return -1;
+    }
+    memcpy(entries, index->entries, index->no_entries * sizeof(tar_entry_t));
+    memcpy(names, index->names, index->names_len);
+    memcpy(slots, index->slots, index->no_slots * sizeof(index_slot_t));
+    memcpy(children, index->children, index->no_children * sizeof(uint32_t));
+    munmap(index->map, index->map_size);
+    index->map = NULL;
+
+    index->entries = entries;
+    index->cap_entries = index->no_entries;
+    index->names = names;
+    index->names_cap = index->names_len;
+    index->slots = slots;
+    index->children = children;
+
+    // sidecars do not keep the end of the archive, it follows the body of the last header
+    index->end = index->start;
+    for (size_t i = 0; i < index->no_entries; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        uint64_t end = entry->offset + sizeof(tar_header_t) + ((entry->size + 511) / 512) * 512;
+        if (!(entry->flags & ENTRY_IMPLICIT) && end > index->end) {
+            index->end = end;
+        }
+    }
+    return 0;
+}
+
+/* Lists the symbolic links of the index, from `first` on. The list exists once called, even if empty. */
+static int index_track_links(tar_index_t *index, size_t first) {
+    if (index->links == NULL) {
+        index->links = malloc(64 * sizeof(uint32_t));
+        if (index->links == NULL) {
+            return -1;
+        }
+        index->cap_links = 64;
+    }
+    for (size_t i = first; i < index->no_entries; i++) {
+        if (index->entries[i].typeflag != SYMTYPE) {
+            continue;
+        }
+        if (index->no_links == index->cap_links) {
+            uint32_t *links = realloc(index->links, index->cap_links * 2 * sizeof(uint32_t));
+            if (links == NULL) {
+                return -1;
+            }
+            index->links = links;
+            index->cap_links *= 2;
+        }
+        index->links[index->no_links++] = i;
+    }
+    return 0;
+}
+
+/* Packs the lists of children, dropping the ones left behind. */
+static int index_compact_children(tar_index_t *index) {
+    size_t no_children = index->no_children - index->dead_children;
+    uint32_t *children = malloc((no_children ? no_children : 1) * sizeof(uint32_t));
+    if (children == NULL) {
+        return -1;
+    }
+    uint32_t start = 0;
+    for (size_t i = 0; i < index->no_entries; i++) {
+        tar_entry_t *dir = &index->entries[i];
+        memcpy(children + start, index->children + dir->children, dir->no_children * sizeof(uint32_t));
+        dir->children = start;
+        start += dir->no_children;
+    }
+    free(index->children);
+    index->children = children;
+    index->no_children = no_children;
+    index->dead_children = 0;
+    return 0;
+}
+
+/*
+ * Adds the entries from `first` on to the directory tree, `shadowed` being the entries of the tree they replace.
+ * Only the directories receiving entries are touched.
+ */
+static int index_attach(tar_index_t *index, size_t first, const uint32_t *shadowed, size_t no_shadowed) {
+    // a replacing entry takes the place of the replaced one in its directory, and its children
+    for (size_t i = 0; i < no_shadowed; i++) {
+        tar_entry_t *old = &index->entries[shadowed[i]];
+        uint32_t e = index_find(index, index->names + old->name, old->name_len);
+        tar_entry_t *entry = &index->entries[e];
+        entry->parent = old->parent;
+        entry->children = old->children;
+        entry->no_children = old->no_children;
+        for (uint32_t c = 0; c < entry->no_children; c++) {
+            index->entries[index->children[entry->children + c]].parent = e;
+        }
+        if (shadowed[i] == index->root) {
+            index->root = e;
+        } else {
+            const tar_entry_t *dir = &index->entries[old->parent];
+            for (uint32_t c = 0; c < dir->no_children; c++) {
+                if (index->children[dir->children + c] == shadowed[i]) {
+                    index->children[dir->children + c] = e;
+                }
+            }
+        }
+        old->parent = INDEX_NO_SLOT;
+        old->no_children = 0;
+    }
+
+    // implicit directories are appended while looping, and get their own parent in turn
+    index_child_t *added = NULL;
+    size_t no_added = 0, cap_added = 0;
+    for (size_t i = first; i < index->no_entries; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        if (entry->parent != INDEX_NO_SLOT || i == index->root
+                || index_find(index, index->names + entry->name, entry->name_len) != i) {
+            continue; // already in place, or shadowed by a later entry
+        }
+        uint32_t parent = index_parent(index, i);
+        if (parent == INDEX_NO_SLOT) {
+            free(added);
+            return -1;
+        }
+        index->entries[i].parent = parent;
+        if (no_added == cap_added) {
+            cap_added = cap_added ? cap_added * 2 : 64;
+            index_child_t *grown = realloc(added, cap_added * sizeof(index_child_t));
+            if (grown == NULL) {
+                free(added);
+                return -1;
+            }
+            added = grown;
+        }
+        added[no_added++] = (index_child_t) { parent, i };
+    }
+    if (no_added == 0) {
+        return 0;
+    }
+    qsort(added, no_added, sizeof(index_child_t), index_child_cmp);
+
+    // each directory receiving entries gets a new list at the end of the array
+    size_t grow = 0, longest = 0;
+    for (size_t i = 0; i < no_added;) {
+        size_t j = i;
+        while (j < no_added && added[j].parent == added[i].parent) {
+            j++;
+        }
+        size_t len = index->entries[added[i].parent].no_children + (j - i);
+        grow += len;
+        longest = len > longest ? len : longest;
+        i = j;
+    }
+    uint32_t *children = realloc(index->children, (index->no_children + grow + 1) * sizeof(uint32_t));
+    uint32_t *tmp = malloc((longest + 1) * sizeof(uint32_t));
+    if (children != NULL) {
+        index->children = children;
+    }
+    if (children == NULL || tmp == NULL) {
+        free(added);
+        free(tmp);
+        return -1;
+    }
+    for (size_t i = 0; i < no_added;) {
+        uint32_t parent = added[i].parent;
+        tar_entry_t *dir = &index->entries[parent];
+        uint32_t *list = index->children + index->no_children;
+        memcpy(list, index->children + dir->children, dir->no_children * sizeof(uint32_t));
+        index->dead_children += dir->no_children;
+        size_t len = dir->no_children;
+        for (; i < no_added && added[i].parent == parent; i++) {
+            list[len++] = added[i].entry;
+        }
+        sort_by_name(index, list, tmp, len);
+        dir->children = index->no_children;
+        dir->no_children = len;
+        index->no_children += len;
+    }
+    free(added);
+    free(tmp);
+
+    if (index->dead_children > index->no_children / 2) {
+        return index_compact_children(index);
+    }
+    return 0;
+}
+
+/**
+ * Adds the entries appended to an archive since its handle was opened or last refreshed. Only the part of the
+ * archive following the end-of-archive marker seen last is read, and validated as check_archive() would.
+ * An entry still being written, whose body goes past the end of the file, is left to a later refresh.
+ * Later entries shadow earlier ones with the same path.
+ * Must not be called while other threads use the handle, nor while an overlay holds it.
+ *
+ * @param archive A handle returned by tar_open() or tar_open_indexed().
+ *
+ * @return the number of headers added, zero if the archive did not change,
+ *         -1, -2 or -3 as check_archive() would if an appended header is invalid, in which case none are added,
+ *         -4 if the archive could not be read or memory could not be allocated.
+ */
+int tar_index_refresh(tar_archive_t *archive) {
+    STATS_SPAN(TAR_FN_TAR_INDEX_REFRESH, HANDLE_STATS(archive), NULL);
+    struct stat st;
+    if (fstat(archive->fd, &st) < 0) {
+        return -4;
+    }
+    if (st.st_size == archive->size && st.st_mtim.tv_sec == archive->mtime.tv_sec
+            && st.st_mtim.tv_nsec == archive->mtime.tv_nsec) {
+        return 0;
+    }
+
+    tar_index_t *index = archive->index;
+    if (index_unmap(index) < 0 || (index->links == NULL && index_track_links(index, 0) < 0)) {
+        return -4;
+    }
+    // the marker and whatever followed it were overwritten
+    if (archive->cache != NULL) {
+        cache_drop(archive->cache, index->end, st.st_size);
+    }
+
+    scanner_t scanner;
+    const tar_header_t *header;
+    off_t stop = index->end;
+    int ret = 0;
+    scanner_init(&scanner, archive->fd, index->end);
+    while ((header = scanner_next_entry(&scanner)) != NULL) {
+        ret = check_header(header);
+        if (ret < 0 || scanner.next > st.st_size) {
+            break; // invalid, or still being written
+        }
+        stop = scanner.next;
+    }
+    if (scanner.next < 0) {
+        ret = -1;
+    }
+    if (ret < 0 || scanner.error) {
+        scanner_close(&scanner);
+        return ret < 0 ? ret : -4;
+    }
+
+    size_t first = index->no_entries;
+    uint32_t *shadowed = NULL;
+    size_t no_shadowed = 0, cap_shadowed = 0;
+    int added = 0;
+    scanner_rewind(&scanner);
+    while (scanner.next < stop && (header = scanner_next_entry(&scanner)) != NULL) {
+        char path[sizeof(header->prefix) + 1 + sizeof(header->name)];
+        uint32_t old = index_find(index, path, header_path(header, path));
+        if (old != INDEX_NO_SLOT && old < first) {
+            if (no_shadowed == cap_shadowed) {
+                cap_shadowed = cap_shadowed ? cap_shadowed * 2 : 16;
+                uint32_t *grown = realloc(shadowed, cap_shadowed * sizeof(uint32_t));
+                if (grown == NULL) {
+                    break;
+                }
+                shadowed = grown;
+            }
+            shadowed[no_shadowed++] = old;
+        }
+        if (index_add(index, header, scanner.current) < 0) {
+            no_shadowed -= old != INDEX_NO_SLOT && old < first;
+            break;
+        }
+        index->end = scanner.next;
+        added++;
+    }
+    int failed = scanner.error || index->end != (uint64_t)stop;
+    scanner_close(&scanner);
+
+    // what was added is kept even on failure, so that the tree and the links always match the table
+    if (index_attach(index, first, shadowed, no_shadowed) < 0) {
+        failed = 1;
+        if (index_finish(index) < 0) {
+            free(shadowed);
+            return -4;
+        }
+    }
+    free(shadowed);
+    if (index_track_links(index, first) < 0) {
+        index_resolve_links(index);
+        return -4;
+    }
+    for (size_t i = 0; i < index->no_links; i++) {
+        index->entries[index->links[i]].flags &= ~(ENTRY_RESOLVED | ENTRY_LOOP);
+    }
+    for (size_t i = 0; i < index->no_links; i++) {
+        link_resolve(index, index->links[i]);
+    }
+    if (failed) {
+        return -4;
+    }
+
+    archive->size = st.st_size;
+    archive->mtime = st.st_mtim;
+    return added;
+}
+
+
+/*
+ * Content digests
+ *
+ * Every regular file is hashed once by worker threads, each taking runs of consecutive files in turn and reading
+ * them with large pread() windows, the headers in between included, so that the archive is read sequentially.
+ * XXH64 keeps four independent lanes the CPU computes in parallel, and CRC32C uses the crc32 instruction of SSE 4.2
+ * when the CPU has it. The digests are kept next to the entries of the index.
+ */
+
+#define DIGEST_WINDOW (1 << 20)
+#define DIGEST_RUN (8 << 20)    // bytes of the archive a worker takes at once, unless a file is larger
+
+#define XXH_PRIME1 0x9e3779b185ebca87ull
+#define XXH_PRIME2 0xc2b2ae3d27d4eb4full
+#define XXH_PRIME3 0x165667b19e3779f9ull
+#define XXH_PRIME4 0x85ebca77c2b2ae63ull
+#define XXH_PRIME5 0x27d4eb2f165667c5ull
+
+typedef struct {
+    int algo;
+    uint32_t crc;
+    uint64_t lanes[4];
+    uint64_t total;
+    uint8_t tail[32];       // bytes not making a whole stripe yet
+    size_t tail_len;
+} digest_t;
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t lane) {
+    acc ^= xxh_round(0, lane);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static uint64_t xxh_load64(const uint8_t *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word)); // little-endian, like the rest of the SWAR code
+    return word;
+}
+
+static uint32_t xxh_load32(const uint8_t *p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static void xxh_stripes(uint64_t *lanes, const uint8_t *data, size_t no_stripes) {
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+    for (size_t i = 0; i < no_stripes; i++, data += 32) {
+        v1 = xxh_round(v1, xxh_load64(data));
+        v2 = xxh_round(v2, xxh_load64(data + 8));
+        v3 = xxh_round(v3, xxh_load64(data + 16));
+        v4 = xxh_round(v4, xxh_load64(data + 24));
+    }
+    lanes[0] = v1;
+    lanes[1] = v2;
+    lanes[2] = v3;
+    lanes[3] = v4;
+}
+
+static uint64_t xxh_final(const digest_t *d) {
+    uint64_t h;
+    if (d->total >= 32) {
+        h = xxh_rotl(d->lanes[0], 1) + xxh_rotl(d->lanes[1], 7) + xxh_rotl(d->lanes[2], 12)
+            + xxh_rotl(d->lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh_merge(h, d->lanes[i]);
+        }
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += d->total;
+
+    const uint8_t *p = d->tail, *end = d->tail + d->tail_len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_load64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= xxh_load32(p) * XXH_PRIME1;
+        h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME5;
+        h = xxh_rotl(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82f63b78u & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const uint8_t *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init_table);
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        crc64 = _mm_crc32_u64(crc64, xxh_load64(data));
+    }
+    crc = crc64;
+    for (; len > 0; data++, len--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+static uint32_t (*crc32c_kernel_get(void))(uint32_t, const uint8_t *, size_t) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") ? crc32c_sse42 : crc32c_scalar;
+}
+#else
+static uint32_t (*crc32c_kernel_get(void))(uint32_t, const uint8_t *, size_t) {
+    return crc32c_scalar;
+}
+#endif
+
+static void digest_init(digest_t *d, int algo) {
+    memset(d, 0, sizeof(digest_t));
+    d->algo = algo;
+    d->crc = 0xffffffffu;
+    d->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    d->lanes[1] = XXH_PRIME2;
+    d->lanes[3] = -XXH_PRIME1;
+}
+
+static void digest_update(digest_t *d, uint32_t (*crc32c)(uint32_t, const uint8_t *, size_t), const uint8_t *data,
+                          size_t len) {
+    if (d->algo == TAR_DIGEST_CRC32C) {
+        d->crc = crc32c(d->crc, data, len);
+        return;
+    }
+    d->total += len;
+    if (d->tail_len > 0) {
+        size_t fill = sizeof(d->tail) - d->tail_len < len ? sizeof(d->tail) - d->tail_len : len;
+        memcpy(d->tail + d->tail_len, data, fill);
+        d->tail_len += fill;
+        data += fill;
+        len -= fill;
+        if (d->tail_len < sizeof(d->tail)) {
+            return;
+        }
+        xxh_stripes(d->lanes, d->tail, 1);
+        d->tail_len = 0;
+    }
+    xxh_stripes(d->lanes, data, len / 32);
+    memcpy(d->tail, data + len / 32 * 32, len % 32);
+    d->tail_len = len % 32;
+}
+
+static uint64_t digest_final(const digest_t *d) {
+    return d->algo == TAR_DIGEST_CRC32C ? ~d->crc : xxh_final(d);
+}
+
+typedef struct {
+    const tar_archive_t *archive;
+    int algo;
+    uint32_t (*crc32c)(uint32_t, const uint8_t *, size_t);
+    uint64_t *digests;
+    const uint32_t *files;  // entries of the regular files, in archive order
+    const size_t *runs;     // first file of each run, and no_files
+    size_t no_runs;
+    size_t next_run;
+    int error;
+} digest_job_t;
 
-    while ((num_bytes = read(tar_fd, &header, sizeof(tar_header_t))) == sizeof(tar_header_t)) {
-        // check if header is null
-        if (is_null_block(&header)) {
-            tar_header_t next_header;
-            num_bytes = read(tar_fd, &next_header, sizeof(tar_header_t));
-            if (num_bytes == sizeof(tar_header_t) && is_null_block(&next_header)) {
-                break;
-            } else {
-                lseek(tar_fd, -sizeof(tar_header_t), SEEK_CUR);
-            }
-        }
+static int digest_run(digest_job_t *job, uint8_t *window, size_t first, size_t last) {
+    const tar_index_t *index = job->archive->index;
+    const tar_entry_t *tail = &index->entries[job->files[last - 1]];
+    uint64_t end = tail->offset + sizeof(tar_header_t) + tail->size;
+    uint64_t base = 0, len = 0;   // the window holds [base, base + len)
 
-        // valid magic 
-        if (strncmp(header.magic, TMAGIC, TMAGLEN) != 0) {
-            return -1;
+    for (size_t i = first; i < last; i++) {
+        const tar_entry_t *entry = &index->entries[job->files[i]];
+        uint64_t pos = entry->offset + sizeof(tar_header_t), left = entry->size;
+        digest_t d;
+        digest_init(&d, job->algo);
+        while (left > 0) {
+            if (pos < base || pos >= base + len) {
+                struct iovec iov = { window, end - pos < DIGEST_WINDOW ? end - pos : DIGEST_WINDOW };
+                ssize_t num_bytes = preadv_full(job->archive->fd, &iov, 1, pos);
+                if (num_bytes <= 0) {
+                    return -1; // an error, or an archive shorter than its index
+                }
+                base = pos;
+                len = num_bytes;
+            }
+            size_t take = left < base + len - pos ? left : base + len - pos;
+            digest_update(&d, job->crc32c, window + (pos - base), take);
+            pos += take;
+            left -= take;
         }
+        job->digests[job->files[i]] = digest_final(&d);
+    }
+    return 0;
+}
 
-        // valid version
-        if (strncmp(header.version, TVERSION, TVERSLEN) != 0) {
-            return -2;
-        }
+static void *digest_worker(void *arg) {
+    digest_job_t *job = arg;
 
-        // valid checksum value
-        char tmp_chksum[sizeof(header.chksum)];
-        memcpy(tmp_chksum, header.chksum, sizeof(header.chksum));
-        memset(header.chksum, ' ', sizeof(header.chksum));
-        int res_sum = 0;
-        uint8_t *header_bytes = (uint8_t *)&header;
-        for (size_t i = 0; i < sizeof(tar_header_t); i++) {
-            res_sum += header_bytes[i];
+    // the calling thread is a worker too
+    tar_stats_t *saved_stats = current_stats;
+    current_stats = HANDLE_STATS(job->archive);
+    uint8_t *window = malloc(DIGEST_WINDOW);
+    if (window == NULL) {
+        __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+    }
+    while (window != NULL && !__atomic_load_n(&job->error, __ATOMIC_RELAXED)) {
+        size_t run = __atomic_fetch_add(&job->next_run, 1, __ATOMIC_RELAXED);
+        if (run >= job->no_runs) {
+            break;
         }
-        int stored_checksum = TAR_INT(tmp_chksum);
-        if (res_sum != stored_checksum) {
-            return -3;
+        if (digest_run(job, window, job->runs[run], job->runs[run + 1]) < 0) {
+            __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
         }
-
-        valid_headers++;
-
-        // ignore file contents
-        size_t file_size = TAR_INT(header.size);
-        lseek(tar_fd, ((file_size + 511) / 512) * 512, SEEK_CUR);
     }
+    free(window);
+    current_stats = saved_stats;
+    return NULL;
+}
 
-    return valid_headers;
+/* Regular files reachable by their path, the ones shadowed by a later entry aside. */
+static int entry_is_digested(const tar_index_t *index, uint32_t e) {
+    const tar_entry_t *entry = &index->entries[e];
+    return (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) && !(entry->flags & ENTRY_IMPLICIT)
+           && index_find(index, index->names + entry->name, entry->name_len) == e;
 }
 
 /**
- * Checks whether an entry exists in the archive.
+ * Computes a digest of every regular file of the archive, each file being read once. The digests are kept with the
+ * index of the handle, replacing the ones computed before, and are queried with tar_digest() and
+ * tar_digest_duplicates(). Must not be called while other threads use the handle.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param archive A handle returned by tar_open().
+ * @param algo TAR_DIGEST_XXH64 or TAR_DIGEST_CRC32C.
+ * @param nthreads The number of threads reading and hashing files, or zero to use one per online CPU.
  *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
+ * @return the number of files digested,
+ *         -1 if the algorithm is unknown,
+ *         -2 if the archive could not be read or memory could not be allocated, in which case the digests computed
+ *         before are kept.
  */
-int exists(int tar_fd, char *path) {
-    tar_header_t header;
-    ssize_t num_bytes;
+int tar_digest_all(tar_archive_t *archive, int algo, int nthreads) {
+    STATS_SPAN(TAR_FN_TAR_DIGEST_ALL, HANDLE_STATS(archive), NULL);
+    if (algo != TAR_DIGEST_XXH64 && algo != TAR_DIGEST_CRC32C) {
+        return -1;
+    }
+    tar_index_t *index = archive->index;
+    uint64_t *digests = calloc(index->no_entries ? index->no_entries : 1, sizeof(uint64_t));
+    uint32_t *files = malloc((index->no_entries + 1) * sizeof(uint32_t));
+    size_t *runs = malloc((index->no_entries + 1) * sizeof(size_t));
+    if (digests == NULL || files == NULL || runs == NULL) {
+        free(digests);
+        free(files);
+        free(runs);
+        return -2;
+    }
 
-    while ((num_bytes = read(tar_fd, &header, sizeof(tar_header_t))) == sizeof(tar_header_t)) {
-        if (strncmp(header.name, path, sizeof(header.name)) == 0) {
-            return 3;
+    // files are cut into runs of about DIGEST_RUN bytes, entries being in archive order
+    size_t no_files = 0, no_runs = 0;
+    uint64_t run_start = 0;
+    for (size_t i = 0; i < index->no_entries; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        if (!entry_is_digested(index, i)) {
+            continue;
         }
-        // padding
-        lseek(tar_fd, 512 - num_bytes, SEEK_CUR);
+        if (no_runs == 0 || entry->offset + sizeof(tar_header_t) + entry->size - run_start > DIGEST_RUN) {
+            runs[no_runs++] = no_files;
+            run_start = entry->offset;
+        }
+        files[no_files++] = i;
     }
+    runs[no_runs] = no_files;
 
-    return 0;
+    digest_job_t job = {
+        .archive = archive,
+        .algo = algo,
+        .crc32c = crc32c_kernel_get(),
+        .digests = digests,
+        .files = files,
+        .runs = runs,
+        .no_runs = no_runs,
+    };
+    if (nthreads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? cpus : 1;
+    }
+    if ((size_t)nthreads > no_runs) {
+        nthreads = no_runs > 0 ? no_runs : 1;
+    }
+    pthread_t *threads = nthreads > 1 ? malloc((nthreads - 1) * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (threads != NULL && started < nthreads - 1
+            && pthread_create(&threads[started], NULL, digest_worker, &job) == 0) {
+        started++;
+    }
+    digest_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(files);
+    free(runs);
+
+    if (job.error) {
+        free(digests);
+        return -2;
+    }
+    free(index->digests);
+    index->digests = digests;
+    index->no_digests = index->no_entries;
+    index->digest_algo = algo;
+    return no_files;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a directory.
+ * Gives the digest of a file computed by tar_digest_all().
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param digest Set to the digest of the file, a CRC32C taking the low 32 bits.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
+ * @return zero if the digest was set,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the file was not digested, tar_digest_all() not having been called since it was added.
  */
-int is_dir(int tar_fd, char *path){
-    tar_header_t header;
-    ssize_t num_bytes;
-
-    while((num_bytes = read(tar_fd, &header, sizeof(tar_header_t))) == sizeof(tar_header_t)){
-        // path entry (compare)
-        if (strncmp(header.name, path, sizeof(header.name)) == 0 ){
-            // directory ? if yes -> not 0
-            if (header.typeflag == '5'){
-                return 3;
-            }
-            return 0;
-        }
-        //padding
-        lseek(tar_fd, 512 - num_bytes, SEEK_CUR);
+int tar_digest(const tar_archive_t *archive, const char *path, uint64_t *digest) {
+    STATS_SPAN(TAR_FN_TAR_DIGEST, HANDLE_STATS(archive), path);
+    const tar_index_t *index = archive->index;
+    const tar_entry_t *entry = index_follow(index, index_lookup(index, path));
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) {
+        return -1;
     }
+    size_t e = entry - index->entries;
+    if (e >= index->no_digests) {
+        return -2;
+    }
+    *digest = index->digests[e];
     return 0;
 }
 
+static int digest_entry_cmp(const void *a, const void *b) {
+    const tar_digest_entry_t *x = a, *y = b;
+    if (x->size != y->size) {
+        return x->size > y->size ? -1 : 1; // the largest duplicates first
+    }
+    if (x->digest != y->digest) {
+        return x->digest < y->digest ? -1 : 1;
+    }
+    size_t len = x->len < y->len ? x->len : y->len;
+    int cmp = memcmp(x->name, y->name, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->len < y->len ? -1 : x->len > y->len;
+}
+
 /**
- * Checks whether an entry exists in the archive and is a file.
+ * Lists the files with the same contents, as told by their size and digest computed by tar_digest_all().
+ * Empty files are left out.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param archive A handle returned by tar_open().
+ * @param out Set to an array of the files having at least one duplicate, to be released with free(), or NULL if
+ *            there are none. Files with the same contents are next to each other and share a group number, the
+ *            groups going from the largest files to the smallest. The names point into the index of the handle and
+ *            stay valid until tar_close() or tar_index_refresh() is called.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
+ * @return the number of files listed,
+ *         -1 if tar_digest_all() was not called,
+ *         -2 if memory could not be allocated.
  */
-int is_file(int tar_fd, char *path){
-    tar_header_t header;
-    ssize_t num_bytes;
+ssize_t tar_digest_duplicates(const tar_archive_t *archive, tar_digest_entry_t **out) {
+    STATS_SPAN(TAR_FN_TAR_DIGEST_DUPLICATES, HANDLE_STATS(archive), NULL);
+    const tar_index_t *index = archive->index;
+    *out = NULL;
+    if (index->digests == NULL) {
+        return -1;
+    }
+    size_t no_files = 0;
+    for (size_t i = 0; i < index->no_digests; i++) {
+        no_files += entry_is_digested(index, i) && index->entries[i].size > 0;
+    }
+    tar_digest_entry_t *files = malloc((no_files ? no_files : 1) * sizeof(tar_digest_entry_t));
+    if (files == NULL) {
+        return -2;
+    }
+    no_files = 0;
+    for (size_t i = 0; i < index->no_digests; i++) {
+        const tar_entry_t *entry = &index->entries[i];
+        if (entry_is_digested(index, i) && entry->size > 0) {
+            files[no_files++] = (tar_digest_entry_t) {
+                index->names + entry->name, entry->name_len, entry->size, index->digests[i], 0
+            };
+        }
+    }
+    qsort(files, no_files, sizeof(tar_digest_entry_t), digest_entry_cmp);
 
-    while((num_bytes = read(tar_fd, &header, sizeof(tar_header_t))) == sizeof(tar_header_t)){
-        // path entry (compare)
-        if (strncmp(header.name, path, sizeof(header.name)) == 0 ){
-            // same but for files
-            if (header.typeflag == '0'){
-                return 3;
+    // keep the groups of two files or more
+    size_t no_dups = 0, group = 0;
+    for (size_t i = 0; i < no_files;) {
+        size_t j = i + 1;
+        while (j < no_files && files[j].size == files[i].size && files[j].digest == files[i].digest) {
+            j++;
+        }
+        if (j - i > 1) {
+            for (; i < j; i++) {
+                files[no_dups] = files[i];
+                files[no_dups++].group = group;
             }
-            return 0;
+            group++;
         }
-        //padding
-        lseek(tar_fd, 512 - num_bytes, SEEK_CUR);
+        i = j;
     }
-    return 0;
+    if (no_dups == 0) {
+        free(files);
+        return 0;
+    }
+    *out = files;
+    return no_dups;
 }
 
-/**
- * Checks whether an entry exists in the archive and is a symlink.
+/*
+ * Queries
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
+ * A pattern is cut at its slashes into parts, each matched against one component of a path. The children of every
+ * directory are kept sorted by name, so the ones a part can match are found by binary search on its literal
+ * prefix, and only the directories some part may still match below are walked. A part of exactly "**" matches
+ * any number of components. The parts a directory is matched against are a bit set, as after "**" several of
+ * them may be.
+ *
+ * Queries match while being iterated, or up front on several threads: the walk is then cut into tasks in
+ * walking order, each task being a range of the children of a directory, whose matches are joined in order.
  */
-int is_symlink(int tar_fd, char *path){
-    tar_header_t header;
-    ssize_t num_bytes;
 
-    while((num_bytes = read(tar_fd, &header, sizeof(tar_header_t))) == sizeof(tar_header_t)){
-        // path entry (compare)
-        if (strncmp(header.name, path, sizeof(header.name)) == 0 ){
-            // same but for syst link
-            if (header.typeflag == '2'){
-                return 3;
+#define QUERY_MAX_PARTS 63
+#define QUERY_TASKS_PER_THREAD 16
+
+typedef struct {
+    const char *text;       // null-terminated
+    size_t literal;         // length of the prefix without special characters
+    int any_depth;          // the part is "**"
+} query_part_t;
+
+typedef struct {
+    uint32_t dir;
+    uint32_t next;          // position of the next child to visit among the children of dir
+    uint32_t end;
+    int deep;               // whether the children are walked in turn
+    uint64_t states;        // parts the children are matched against
+} query_frame_t;
+
+typedef struct {
+    query_frame_t *frames;
+    size_t depth;
+    size_t cap;
+} query_walk_t;
+
+struct tar_query {
+    const tar_archive_t *archive;
+    const tar_index_t *index;
+    char *pattern;
+    query_part_t parts[QUERY_MAX_PARTS];
+    size_t no_parts;
+    query_walk_t walk;      // when matching while iterating
+    uint32_t *matches;      // when matched up front
+    size_t no_matches;
+    size_t next_match;
+};
+
+/* Matches the bracket expression at *pat against c, moving *pat past it. Without its ']', it is a plain '['. */
+static int glob_class(const char **pat, unsigned char c) {
+    const char *p = *pat + 1;
+    int negate = *p == '!' || *p == '^';
+    p += negate;
+    const char *first = p;
+    int found = 0;
+    while (*p != '\0' && (*p != ']' || p == first)) {
+        unsigned char lo = *p == '\\' && p[1] != '\0' ? *++p : *p;
+        unsigned char hi = lo;
+        p++;
+        if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+            p++;
+            hi = *p == '\\' && p[1] != '\0' ? *++p : *p;
+            p++;
+        }
+        found |= lo <= c && c <= hi;
+    }
+    if (*p != ']') {
+        *pat += 1;
+        return c == '[';
+    }
+    *pat = p + 1;
+    return found != negate;
+}
+
+/* Shell-style matching of a name which is not null-terminated, backtracking to the last '*' only. */
+static int glob_match(const char *pat, const char *str, size_t len) {
+    const char *star = NULL;
+    size_t star_at = 0, i = 0;
+    for (;;) {
+        if (*pat == '*') {
+            while (*pat == '*') {
+                pat++;
+            }
+            star = pat;
+            star_at = i;
+            continue;
+        }
+        if (*pat != '\0' && i < len) {
+            const char *p = pat;
+            int ok;
+            if (*p == '?') {
+                ok = 1;
+                p++;
+            } else if (*p == '[') {
+                ok = glob_class(&p, str[i]);
+            } else {
+                p += *p == '\\' && p[1] != '\0';
+                ok = *p++ == str[i];
+            }
+            if (ok) {
+                pat = p;
+                i++;
+                continue;
             }
+        } else if (*pat == '\0' && i == len) {
+            return 1;
+        }
+        if (star == NULL || star_at >= len) {
             return 0;
         }
-        //padding
-        lseek(tar_fd, 512 - num_bytes, SEEK_CUR);
+        pat = star;
+        i = ++star_at;
+    }
+}
+
+/* Adds the parts following a "**", which may match no component at all. */
+static uint64_t query_closure(const tar_query_t *query, uint64_t states) {
+    for (size_t i = 0; i < query->no_parts; i++) {
+        if ((states >> i & 1) && query->parts[i].any_depth) {
+            states |= 1ull << (i + 1);
+        }
+    }
+    return states;
+}
+
+/* Returns the parts left to match below a component, bit no_parts being set if the whole pattern matched. */
+static uint64_t query_step(const tar_query_t *query, uint64_t states, const char *name, size_t len) {
+    uint64_t next = 0;
+    for (size_t i = 0; i < query->no_parts; i++) {
+        if (!(states >> i & 1)) {
+            continue;
+        }
+        if (query->parts[i].any_depth) {
+            next |= 1ull << i;
+        } else if (glob_match(query->parts[i].text, name, len)) {
+            next |= 1ull << (i + 1);
+        }
+    }
+    return query_closure(query, next);
+}
+
+/* Compares the name of an entry below a directory, cut to the length of a prefix, to that prefix. */
+static int query_name_cmp(const tar_index_t *index, uint32_t e, size_t skip, const char *prefix, size_t len) {
+    const tar_entry_t *entry = &index->entries[e];
+    size_t name_len = entry->name_len - skip;
+    int cmp = memcmp(index->names + entry->name + skip, prefix, name_len < len ? name_len : len);
+    return cmp != 0 ? cmp : -(name_len < len);
+}
+
+/* Offset of the last component of an entry in its name. */
+static size_t query_skip(const tar_index_t *index, const tar_entry_t *dir, const tar_entry_t *entry) {
+    size_t skip = dir->name_len;
+    while (skip < entry->name_len && index->names[entry->name + skip] == '/') {
+        skip++;
+    }
+    return skip;
+}
+
+/* Narrows the children of a directory to the ones starting with the literal prefix shared by the parts. */
+static query_frame_t query_frame(const tar_query_t *query, uint32_t e, uint64_t states) {
+    const tar_index_t *index = query->index;
+    const tar_entry_t *dir = &index->entries[e];
+    query_frame_t frame = { e, 0, dir->no_children, 1, states };
+    if (dir->no_children == 0) {
+        return frame;
+    }
+
+    const char *prefix = NULL;
+    size_t len = 0;
+    for (size_t i = 0; i < query->no_parts; i++) {
+        const query_part_t *part = &query->parts[i];
+        if (!(states >> i & 1)) {
+            continue;
+        }
+        if (part->any_depth) {
+            return frame;
+        }
+        if (prefix == NULL) {
+            prefix = part->text;
+            len = part->literal;
+        }
+        size_t common = 0;
+        while (common < len && common < part->literal && prefix[common] == part->text[common]) {
+            common++;
+        }
+        len = common;
+    }
+    if (len == 0) {
+        return frame;
+    }
+
+    const uint32_t *children = index->children + dir->children;
+    size_t skip = query_skip(index, dir, &index->entries[children[0]]);
+    uint32_t lo = 0, hi = dir->no_children;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (query_name_cmp(index, children[mid], skip, prefix, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    frame.next = lo;
+    hi = dir->no_children;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (query_name_cmp(index, children[mid], skip, prefix, len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    frame.end = lo;
+    return frame;
+}
+
+static int query_push(query_walk_t *walk, query_frame_t frame) {
+    if (walk->depth == walk->cap) {
+        size_t cap = walk->cap ? walk->cap * 2 : 16;
+        query_frame_t *frames = realloc(walk->frames, cap * sizeof(query_frame_t));
+        if (frames == NULL) {
+            return -1;
+        }
+        walk->frames = frames;
+        walk->cap = cap;
     }
+    walk->frames[walk->depth++] = frame;
     return 0;
 }
 
+/* Visits the next child of the deepest frame, returning whether it matched. */
+static uint64_t query_visit(const tar_query_t *query, query_frame_t *frame, uint32_t *e) {
+    const tar_index_t *index = query->index;
+    const tar_entry_t *dir = &index->entries[frame->dir];
+    *e = index->children[dir->children + frame->next++];
+    const tar_entry_t *entry = &index->entries[*e];
+    size_t skip = query_skip(index, dir, entry);
+    return query_step(query, frame->states, index->names + entry->name + skip, entry->name_len - skip);
+}
 
-/**
- * Lists the entries at a given path in the archive.
- * list() does not recurse into the directories listed at the given path.
- *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
- * @param no_entries An in-out argument.
- *                   The caller set it to the number of entries in `entries`.
- *                   The callee set it to the number of entries listed.
- *
- * @return zero if no directory at the given path exists in the archive,
- *         any other value otherwise.
- */
-int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
-    tar_header_t header;
-    ssize_t num_bytes;
-    size_t path_length = strlen(path);
-    size_t entry_count = 0;
+/* Whether the entries below one reached with the given states may match. */
+static int query_descends(const tar_query_t *query, uint32_t e, uint64_t states) {
+    return (states & ((1ull << query->no_parts) - 1)) != 0 && query->index->entries[e].no_children > 0;
+}
 
-    // while on header
-    while ((num_bytes = read(tar_fd, &header, sizeof(tar_header_t))) == sizeof(tar_header_t)) {
-        // check if header is null
-        if (is_null_block(&header)) {
-            break;
+/*
+ * Sets e to the next entry matched by a walk.
+ * @return 1 if an entry was matched, zero at the end of the walk, -1 if memory could not be allocated.
+ */
+static int query_walk_next(const tar_query_t *query, query_walk_t *walk, uint32_t *e) {
+    uint64_t matched = 1ull << query->no_parts;
+    while (walk->depth > 0) {
+        query_frame_t *frame = &walk->frames[walk->depth - 1];
+        if (frame->next == frame->end) {
+            walk->depth--;
+            continue;
+        }
+        int deep = frame->deep;
+        uint64_t states = query_visit(query, frame, e);
+        if (deep && query_descends(query, *e, states)
+                && query_push(walk, query_frame(query, *e, states)) < 0) {
+            return -1;
+        }
+        if (states & matched) {
+            return 1;
         }
+    }
+    return 0;
+}
 
-        size_t file_size = TAR_INT(header.size);
+typedef struct {
+    const tar_query_t *query;
+    query_frame_t *tasks;
+    size_t no_tasks;
+    size_t next_task;
+    uint32_t **matches;     // of each task
+    size_t *no_matches;
+    int error;
+} query_job_t;
 
-        // resolve symlink
-        if (header.typeflag == SYMTYPE) {
-            char resolved_path[100];
-            if (resolve_symlink(tar_fd, header.name, resolved_path) == 0) {
-                if (strncmp(resolved_path, path, path_length) == 0) {
-                    char *subpath = resolved_path + path_length;
-                    char *slash_pos = strchr(subpath, '/');
-                    if (slash_pos == NULL || (slash_pos == subpath + strlen(subpath) - 1)) {
-                        if (entry_count < *no_entries) {
-                            strncpy(entries[entry_count], resolved_path, 100);
-                            entries[entry_count][99] = '\0';
-                        }
-                        entry_count++;
-                    }
+static void *query_worker(void *arg) {
+    query_job_t *job = arg;
+    query_walk_t walk = { 0 };
+    while (!__atomic_load_n(&job->error, __ATOMIC_RELAXED)) {
+        size_t t = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED);
+        if (t >= job->no_tasks) {
+            break;
+        }
+        walk.depth = 0;
+        if (query_push(&walk, job->tasks[t]) < 0) {
+            __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        size_t cap = 0;
+        uint32_t e;
+        int ret;
+        while ((ret = query_walk_next(job->query, &walk, &e)) == 1) {
+            if (job->no_matches[t] == cap) {
+                cap = cap ? cap * 2 : 64;
+                uint32_t *matches = realloc(job->matches[t], cap * sizeof(uint32_t));
+                if (matches == NULL) {
+                    ret = -1;
+                    break;
                 }
-                continue;
+                job->matches[t] = matches;
             }
+            job->matches[t][job->no_matches[t]++] = e;
         }
+        if (ret < 0) {
+            __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(walk.frames);
+    return NULL;
+}
 
-        // entry begin with path ?
-        if (strncmp(header.name, path, path_length) == 0) {
-            char *subpath = header.name + path_length;
-
-            char *slash_pos = strchr(subpath, '/');
-            if (slash_pos == NULL || (slash_pos == subpath + strlen(subpath) - 1)) {
-                // add to table if ok
-                if (entry_count < *no_entries) {
-                    // tmp
-                    strncpy(entries[entry_count], header.name, 100);
-                    // null-terminator at the end of entry
-                    entries[entry_count][99] = '\0';
+/*
+ * Cuts the walk into at least target tasks when the tree allows, keeping the walking order: long ranges are split,
+ * and a range of one child is replaced by a shallow task matching the child and a task walking its children.
+ */
+static query_frame_t *query_split(const tar_query_t *query, size_t target, size_t *no_tasks) {
+    query_frame_t *tasks = malloc(sizeof(query_frame_t));
+    if (tasks == NULL) {
+        return NULL;
+    }
+    tasks[0] = query_frame(query, query->index->root, query_closure(query, 1));
+    size_t n = 1;
+    for (int split = 1; split && n < target;) {
+        split = 0;
+        query_frame_t *next = malloc((n + 2 * target) * sizeof(query_frame_t));
+        if (next == NULL) {
+            free(tasks);
+            return NULL;
+        }
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            query_frame_t task = tasks[i];
+            uint32_t len = task.end - task.next;
+            if (!task.deep || len == 0 || split || m + (n - i) >= target) {
+                next[m++] = task;
+                continue;
+            }
+            split = 1;
+            if (len > 1) {
+                size_t parts = len < target - m - (n - i - 1) ? len : target - m - (n - i - 1);
+                for (size_t p = 0; p < parts; p++) {
+                    next[m] = task;
+                    next[m].next = task.next + len * p / parts;
+                    next[m++].end = task.next + len * (p + 1) / parts;
                 }
-                entry_count++;
+                continue;
+            }
+            uint32_t e;
+            uint64_t states = query_visit(query, &task, &e);
+            next[m] = tasks[i];
+            next[m++].deep = 0;
+            if (query_descends(query, e, states)) {
+                next[m++] = query_frame(query, e, states);
             }
         }
-
-        // ignore file contents
-        lseek(tar_fd, ((file_size + 511) / 512) * 512, SEEK_CUR);
+        free(tasks);
+        tasks = next;
+        n = m;
     }
+    *no_tasks = n;
+    return tasks;
+}
 
-    if (num_bytes < 0) {
+/* Matches the whole query on several threads. */
+static int query_run(tar_query_t *query, int nthreads) {
+    query_job_t job = { .query = query };
+    job.tasks = query_split(query, (size_t)nthreads * QUERY_TASKS_PER_THREAD, &job.no_tasks);
+    job.matches = calloc(job.no_tasks ? job.no_tasks : 1, sizeof(uint32_t *));
+    job.no_matches = calloc(job.no_tasks ? job.no_tasks : 1, sizeof(size_t));
+    if (job.tasks == NULL || job.matches == NULL || job.no_matches == NULL) {
+        free(job.tasks);
+        free(job.matches);
+        free(job.no_matches);
         return -1;
     }
 
-    *no_entries = entry_count;
+    if ((size_t)nthreads > job.no_tasks) {
+        nthreads = job.no_tasks > 0 ? job.no_tasks : 1;
+    }
+    pthread_t *threads = nthreads > 1 ? malloc((nthreads - 1) * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (threads != NULL && started < nthreads - 1
+            && pthread_create(&threads[started], NULL, query_worker, &job) == 0) {
+        started++;
+    }
+    query_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
 
-    // return 0 if not found
-    if (entry_count > 0) {
-        return 3;
-    } else {
-        return 0;
+    size_t no_matches = 0;
+    for (size_t t = 0; t < job.no_tasks; t++) {
+        no_matches += job.no_matches[t];
     }
+    query->matches = job.error ? NULL : malloc((no_matches ? no_matches : 1) * sizeof(uint32_t));
+    for (size_t t = 0; t < job.no_tasks; t++) {
+        if (query->matches != NULL && job.no_matches[t] > 0) {
+            memcpy(query->matches + query->no_matches, job.matches[t], job.no_matches[t] * sizeof(uint32_t));
+            query->no_matches += job.no_matches[t];
+        }
+        free(job.matches[t]);
+    }
+    free(job.tasks);
+    free(job.matches);
+    free(job.no_matches);
+    return query->matches == NULL ? -1 : 0;
 }
 
 /**
- * Reads a file at a given path in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
- * @param dest A destination buffer to read the given file into.
- * @param len An in-out argument.
- *            The caller set it to the size of dest.
- *            The callee set it to the number of bytes written to dest.
+ * Starts a query for the entries of an archive whose path matches a shell-style pattern. Each component of the
+ * pattern matches one component of the path: '*' matches any characters, '?' any single one, and '[...]' one of a
+ * class such as [a-z] or [!0-9]. A backslash escapes the character following it. A component of "**" matches any
+ * number of components, so "**" following a directory walks it and everything below it. Symbolic links are not
+ * followed.
  *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
- *         zero if the file was read in its entirety into the destination buffer,
- *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
- *         the end of the file.
+ * @param archive A handle returned by tar_open().
+ * @param pattern The pattern, of at most 63 components.
+ * @param nthreads 1 to match entries while they are iterated, or the number of threads matching them all up front,
+ *                 zero to use one per online CPU, which pays off on archives of millions of entries.
  *
+ * @return a query to iterate with tar_query_next() and release with tar_query_close(),
+ *         NULL if the pattern has too many components or memory could not be allocated.
  */
-ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
-    tar_header_t header;
-    ssize_t num_bytes;
-
-    // while on header tar
-    while ((num_bytes = read(tar_fd, &header, sizeof(tar_header_t))) == sizeof(tar_header_t)) {
-        // size of file
-        size_t file_size = TAR_INT(header.size);
-
-        if (strncmp(header.name, path, sizeof(header.name)) != 0) {
-            size_t file_size = TAR_INT(header.size);
-            lseek(tar_fd, ((file_size + 511) / 512) * 512, SEEK_CUR);
-            continue;
-        }
+tar_query_t *tar_query_open(const tar_archive_t *archive, const char *pattern, int nthreads) {
+    STATS_SPAN(TAR_FN_TAR_QUERY_OPEN, HANDLE_STATS(archive), pattern);
+    tar_query_t *query = calloc(1, sizeof(tar_query_t));
+    if (query == NULL || (query->pattern = strdup(pattern)) == NULL) {
+        free(query);
+        return NULL;
+    }
+    query->archive = archive;
+    query->index = archive->index;
 
-        // symbolic link ?
-        if (header.typeflag == SYMTYPE) {
-            char link_target[sizeof(header.linkname) + 1];
-            strncpy(link_target, header.linkname, sizeof(link_target) - 1);
-            link_target[sizeof(link_target) - 1] = '\0';
-            return read_file(tar_fd, link_target, offset, dest, len);
+    // empty and "." components are left out, as in paths
+    for (char *part = query->pattern; *part != '\0';) {
+        char *end = part;
+        while (*end != '\0' && *end != '/') {
+            end += *end == '\\' && end[1] != '\0' ? 2 : 1;
         }
-
-        // regular file ?
-        if (header.typeflag != REGTYPE && header.typeflag != AREGTYPE) {
-            return -1;
+        char *next = *end == '\0' ? end : end + 1;
+        *end = '\0';
+        if (*part != '\0' && strcmp(part, ".") != 0) {
+            if (query->no_parts == QUERY_MAX_PARTS) {
+                tar_query_close(query);
+                return NULL;
+            }
+            query_part_t *p = &query->parts[query->no_parts++];
+            p->text = part;
+            p->literal = strcspn(part, "*?[\\");
+            p->any_depth = strcmp(part, "**") == 0;
         }
+        part = next;
+    }
 
-        // offset ok ?
-        if (offset >= file_size) {
-            return -2;
+    if (nthreads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? cpus : 1;
+    }
+    if (nthreads > 1) {
+        if (query_run(query, nthreads) < 0) {
+            tar_query_close(query);
+            return NULL;
         }
+        return query;
+    }
+    if (query_push(&query->walk, query_frame(query, query->index->root, query_closure(query, 1))) < 0) {
+        tar_query_close(query);
+        return NULL;
+    }
+    return query;
+}
 
-        size_t bytes_lenght;
-        if (file_size - offset < *len) {
-            bytes_lenght = file_size - offset;
-        } else {
-            bytes_lenght = *len;
+/**
+ * Gives the next entry matched by a query. Entries come in walking order: each directory is followed by the
+ * entries below it, and the entries of a directory are sorted by name.
+ *
+ * @param query A query returned by tar_query_open().
+ * @param entry Set to the entry matched. The name points into the index of the handle and stays valid until
+ *              tar_close() or tar_index_refresh() is called.
+ *
+ * @return 1 if an entry was set,
+ *         zero if all entries were given,
+ *         -1 if memory could not be allocated.
+ */
+int tar_query_next(tar_query_t *query, tar_list_entry_t *entry) {
+    STATS_SPAN(TAR_FN_TAR_QUERY_NEXT, HANDLE_STATS(query->archive), NULL);
+    uint32_t e;
+    if (query->matches != NULL) {
+        if (query->next_match == query->no_matches) {
+            return 0;
         }
-
-        lseek(tar_fd, offset, SEEK_CUR);
-
-        // r data
-        ssize_t bytes_r = read(tar_fd, dest, bytes_lenght);
-        if (bytes_r < 0) {
-            return -1;
+        e = query->matches[query->next_match++];
+    } else {
+        int ret = query_walk_next(query, &query->walk, &e);
+        if (ret <= 0) {
+            return ret;
         }
+    }
+    const tar_entry_t *match = &query->index->entries[e];
+    entry->name = query->index->names + match->name;
+    entry->len = strlen(entry->name);
+    entry->typeflag = match->typeflag;
+    return 1;
+}
 
-        *len = bytes_r;
-
-        // data remaining
-        size_t bytes_left = file_size - offset - bytes_r;
-        if (bytes_left > 0) {
-            return bytes_left;
-        } else {
-            return 0;
-        }
+/**
+ * Releases a query. The handle it was started on must not be closed or refreshed before.
+ *
+ * @param query A query returned by tar_query_open(), or NULL.
+ */
+void tar_query_close(tar_query_t *query) {
+    STATS_SPAN(TAR_FN_TAR_QUERY_CLOSE, NULL, NULL);
+    if (query == NULL) {
+        return;
     }
-    return -1;
-}
\ No newline at end of file
+    free(query->walk.frames);
+    free(query->matches);
+    free(query->pattern);
+    free(query);
+}
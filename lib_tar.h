@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef struct posix_header
 {                              /* byte offset */
@@ -42,6 +44,49 @@ typedef struct posix_header
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
 
+/* Kernels used by check_archive() to validate headers, see tar_simd_level(). */
+#define TAR_SIMD_SCALAR 0
+#define TAR_SIMD_SSE2   1
+#define TAR_SIMD_AVX2   2
+
+/**
+ * Selects the kernels used to validate headers and detect null blocks.
+ * By default, the best kernels supported by the CPU are used.
+ *
+ * @param level One of the TAR_SIMD_* values, or a negative value for the best one supported by the CPU.
+ *              A level the CPU does not support is lowered to the best supported one.
+ *
+ * @return the level now in use.
+ */
+int tar_simd_level(int level);
+
+/**
+ * Checks whether a block only contains zero bytes.
+ *
+ * @param header A 512-byte block of the archive.
+ *
+ * @return one if the block is null, zero otherwise.
+ */
+int is_null_block(const tar_header_t *header);
+
+/**
+ * Computes the checksum of a header, as stored in its chksum field.
+ *
+ * @param header A header of the archive.
+ *
+ * @return the unsigned sum of all the bytes of the header, the chksum field being counted as spaces.
+ */
+unsigned int tar_header_checksum(const tar_header_t *header);
+
+/**
+ * Sets the size of the read-ahead window used by the functions below when scanning an archive.
+ * Headers and small file contents are served from this window, so the number of system calls made by a scan
+ * depends on the size of the archive rather than on its number of entries.
+ *
+ * @param size The size of the window in bytes, rounded up to a multiple of 512, or zero to restore the default of 1 MiB.
+ */
+void tar_set_scan_window(size_t size);
+
 /**
  * Checks whether the archive is valid.
  *
@@ -59,6 +104,20 @@ typedef struct posix_header
  */
 int check_archive(int tar_fd);
 
+/**
+ * Checks whether the archive is valid, verifying headers on several threads.
+ *
+ * A first pass locates the headers from their size fields, then the headers are verified in chunks by
+ * `nthreads` threads reading them with pread(). When several headers are invalid, the first one in the archive
+ * determines the result.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nthreads The number of threads verifying headers, or zero to use one per online CPU.
+ *
+ * @return the same value as check_archive() would.
+ */
+int check_archive_parallel(int tar_fd, int nthreads);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -148,4 +207,1074 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * An in-memory index of the entries of an archive, built in a single pass over its headers.
+ * Once built, lookups are answered from an open-addressing hash table without any I/O.
+ */
+typedef struct tar_index tar_index_t;
+
+/**
+ * Builds an index of all the entries of an archive.
+ *
+ * Paths are indexed with their trailing slashes removed, so "dir" and "dir/" designate the same entry; a lookup
+ * ending with a slash only finds a directory, or a symbolic link to one.
+ * When an archive contains the same path several times, the last occurrence wins.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *
+ * @return a newly allocated index to be released with tar_index_free(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_index_t *tar_index_build(int tar_fd);
+
+/**
+ * Releases an index built by tar_index_build().
+ *
+ * @param index The index to release, may be NULL.
+ */
+void tar_index_free(tar_index_t *index);
+
+/**
+ * Index-backed version of exists().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_index_exists(const tar_index_t *index, const char *path);
+
+/**
+ * Index-backed version of is_dir().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_index_is_dir(const tar_index_t *index, const char *path);
+
+/**
+ * Index-backed version of is_file().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_index_is_file(const tar_index_t *index, const char *path);
+
+/**
+ * Index-backed version of is_symlink().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int tar_index_is_symlink(const tar_index_t *index, const char *path);
+
+/**
+ * Index-backed version of list().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ *             An empty path lists the top-level entries.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_index_list(const tar_index_t *index, const char *path, char **entries, size_t *no_entries);
+
+/**
+ * An entry listed by tar_list_arena(). The name is the full path of the entry, as stored in the archive.
+ */
+typedef struct {
+    const char *name;       // null-terminated, owned by the index
+    size_t len;
+    char typeflag;
+} tar_list_entry_t;
+
+/**
+ * Index-backed version of tar_list_arena().
+ *
+ * @param index An index built by tar_index_build().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param out Set to an array of the entries listed, to be released with free(), or NULL if there are none.
+ *            The names stay valid until the index is freed.
+ *
+ * @return the number of entries listed,
+ *         -1 if no directory at the given path exists in the archive,
+ *         -2 if memory could not be allocated.
+ */
+ssize_t tar_index_list_arena(const tar_index_t *index, const char *path, tar_list_entry_t **out);
+
+/**
+ * Writes an index to a sidecar file, so that later processes can load it instead of indexing the archive again.
+ * The sidecar records the size, modification time, first and last headers of the archive to detect when it
+ * becomes stale.
+ *
+ * @param index An index of the archive.
+ * @param tar_fd A file descriptor of the archive the index was built from.
+ * @param idx_path The path of the sidecar file, typically the path of the archive followed by ".idx".
+ *                 An existing file is replaced atomically.
+ *
+ * @return zero if the sidecar was written, -1 otherwise.
+ */
+int tar_index_save(const tar_index_t *index, int tar_fd, const char *idx_path);
+
+/**
+ * Loads an index from a sidecar file, provided it matches the archive.
+ * The sidecar is mapped in memory and used as is, without being parsed.
+ *
+ * @param tar_fd A file descriptor pointing to the start of the archive the sidecar was written for.
+ * @param idx_path The path of the sidecar file.
+ *
+ * @return an index to be released with tar_index_free(),
+ *         NULL if the sidecar is missing, invalid or stale.
+ */
+tar_index_t *tar_index_load(int tar_fd, const char *idx_path);
+
+/**
+ * Loads an index from a sidecar file, or builds it and writes the sidecar if it is missing or stale.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file. Its offset is not moved.
+ * @param idx_path The path of the sidecar file.
+ *
+ * @return an index to be released with tar_index_free(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ *         Failing to write the sidecar is not an error.
+ */
+tar_index_t *tar_index_open(int tar_fd, const char *idx_path);
+
+/**
+ * A read-only memory mapping of an archive, together with the index of its entries.
+ */
+typedef struct tar_mmap tar_mmap_t;
+
+/**
+ * Maps an archive in memory and indexes its entries.
+ * The headers are read in place from the mapping.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file, opened for reading.
+ *
+ * @return a newly allocated handle to be released with tar_close_mmap(),
+ *         NULL if the archive could not be mapped or memory could not be allocated.
+ */
+tar_mmap_t *tar_open_mmap(int tar_fd);
+
+/**
+ * Unmaps an archive mapped by tar_open_mmap().
+ *
+ * @param archive The handle to release, may be NULL.
+ */
+void tar_close_mmap(tar_mmap_t *archive);
+
+/**
+ * Gives access to the index of a mapped archive, to be used with the tar_index_* functions.
+ *
+ * @param archive A handle returned by tar_open_mmap().
+ *
+ * @return the index of the archive, owned by the handle.
+ */
+const tar_index_t *tar_mmap_index(const tar_mmap_t *archive);
+
+/**
+ * Reads a file at a given path in a mapped archive without copying it.
+ *
+ * @param archive A handle returned by tar_open_mmap().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param data Set to the address, inside the mapping, of the byte at the given offset in the file.
+ *             It stays valid until tar_close_mmap() is called.
+ * @param len An in-out argument.
+ *            The caller set it to the maximum number of bytes wanted.
+ *            The callee set it to the number of bytes available at `data`.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the slice reaches the end of the file,
+ *         a positive value if it does not, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t tar_mmap_read_file(const tar_mmap_t *archive, const char *path, size_t offset, const uint8_t **data, size_t *len);
+
+/**
+ * A handle on an archive that can be queried by several threads at once.
+ * Unlike the functions above, the functions below never use or move the file offset of the archive: the archive
+ * is indexed once when opened, then file contents are read with pread().
+ */
+typedef struct tar_archive tar_archive_t;
+
+/**
+ * Opens an archive for concurrent queries.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until tar_close() is called.
+ *
+ * @return a newly allocated handle to be released with tar_close(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_archive_t *tar_open(int tar_fd);
+
+/**
+ * Releases a handle opened by tar_open(). The file descriptor is left open.
+ *
+ * @param archive The handle to release, may be NULL.
+ */
+void tar_close(tar_archive_t *archive);
+
+/**
+ * Reentrant version of exists().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_exists(const tar_archive_t *archive, const char *path);
+
+/**
+ * Reentrant version of is_dir().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_is_dir(const tar_archive_t *archive, const char *path);
+
+/**
+ * Reentrant version of is_file().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_is_file(const tar_archive_t *archive, const char *path);
+
+/**
+ * Reentrant version of is_symlink().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int tar_is_symlink(const tar_archive_t *archive, const char *path);
+
+/**
+ * Reentrant version of list().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ *             An empty path lists the top-level entries.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_list(const tar_archive_t *archive, const char *path, char **entries, size_t *no_entries);
+
+/**
+ * Lists the entries at a given path in the archive without copying their names nor bounding their number.
+ * The array is allocated to the exact number of entries, and each name points into the index of the handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param out Set to an array of the entries listed, to be released with free(), or NULL if there are none.
+ *            The names stay valid until tar_close() or tar_index_refresh() is called.
+ *
+ * @return the number of entries listed,
+ *         -1 if no directory at the given path exists in the archive,
+ *         -2 if memory could not be allocated.
+ */
+ssize_t tar_list_arena(const tar_archive_t *archive, const char *path, tar_list_entry_t **out);
+
+/**
+ * Reentrant version of read_file().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t tar_read_file(const tar_archive_t *archive, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Copies a file at a given path in the archive to another file descriptor without going through a user space
+ * buffer, with copy_file_range() if the destination is a regular file and sendfile() otherwise, such as a socket.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param len An in-out argument.
+ *            The caller set it to the maximum number of bytes to copy.
+ *            The callee set it to the number of bytes written to out_fd.
+ * @param out_fd A file descriptor to write to, at its current offset. If it is non-blocking and full, the copy
+ *               stops early and can be resumed from offset + len.
+ *
+ * @return -1 if no entry at the given path exists in the archive, the entry is not a file or writing failed,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was copied in its entirety,
+ *         a positive value if the file was partially copied, representing the remaining bytes left to be copied to
+ *         reach the end of the file.
+ */
+ssize_t tar_read_file_to_fd(const tar_archive_t *archive, const char *path, size_t offset, size_t *len, int out_fd);
+
+/**
+ * A file to read with tar_read_files_batch().
+ */
+typedef struct {
+    const char *path;   // path to an entry in the archive, symlinks are resolved
+    size_t offset;      // offset in the file from which to start reading from
+    uint8_t *dest;      // destination buffer
+    size_t len;         // in-out: the size of dest, then the number of bytes written to it
+    ssize_t status;     // out: what tar_read_file() would have returned
+} tar_read_req_t;
+
+/**
+ * Reads several files of an archive at once. The files are read in the order they appear in the archive rather
+ * than in the order of the requests, and files close to each other are read with a single system call.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param requests The files to read. The status of each request is set to
+ *                 -1 if no entry at its path exists in the archive, the entry is not a file or it could not be read,
+ *                 -2 if its offset is outside the file total length,
+ *                 zero if the file was read in its entirety into its destination buffer,
+ *                 a positive value if the file was partially read, representing the remaining bytes left to be read
+ *                 to reach the end of the file.
+ * @param no_requests The number of requests.
+ *
+ * @return zero if every request was attempted,
+ *         -1 if memory could not be allocated, in which case no request was attempted.
+ */
+int tar_read_files_batch(const tar_archive_t *archive, tar_read_req_t *requests, size_t no_requests);
+
+/**
+ * Opens an archive for concurrent queries, using a sidecar index file to skip indexing the archive.
+ * See tar_index_open().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until tar_close() is called.
+ * @param idx_path The path of the sidecar file, written if missing or stale.
+ *
+ * @return a newly allocated handle to be released with tar_close(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_archive_t *tar_open_indexed(int tar_fd, const char *idx_path);
+
+/**
+ * A pull-style iterator over the entries of an archive, for file descriptors that may not be seekable such as pipes
+ * and sockets. The archive is read once from start to end; skipped file contents are read and discarded unless the
+ * file descriptor is seekable. The fields are private.
+ */
+typedef struct {
+    int fd;
+    int seekable;
+    int done;
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    uint64_t offset;        // bytes of the archive consumed
+    uint64_t body_left;     // bytes of the current file contents not read yet
+    uint64_t padding_left;  // padding behind them
+} tar_iter_t;
+
+/**
+ * An entry returned by tar_iter_next().
+ */
+typedef struct {
+    char name[101];         // path of the entry, null-terminated
+    char linkname[101];     // target of a link, null-terminated
+    char typeflag;
+    uint64_t size;          // size of the file contents
+    uint64_t offset;        // offset of the header from the start of the iteration
+} tar_iter_entry_t;
+
+/**
+ * Starts iterating over an archive.
+ *
+ * @param it The iterator to initialize.
+ * @param tar_fd A file descriptor pointing to the start of a tar archive, seekable or not.
+ *
+ * @return zero on success, -1 if memory could not be allocated.
+ */
+int tar_iter_init(tar_iter_t *it, int tar_fd);
+
+/**
+ * Moves to the next entry of the archive, skipping what was not read of the contents of the previous one.
+ * Headers are validated as check_archive() does.
+ *
+ * @param it An iterator initialized by tar_iter_init().
+ * @param entry Filled with the next entry.
+ *
+ * @return 1 if an entry was read,
+ *         zero at the end of the archive,
+ *         -1, -2 or -3 if the next header has an invalid magic value, version value or checksum value, like check_archive(),
+ *         -4 if the archive could not be read or ends in the middle of an entry.
+ */
+int tar_iter_next(tar_iter_t *it, tar_iter_entry_t *entry);
+
+/**
+ * Reads the contents of the current entry, sequentially.
+ *
+ * @param it An iterator positioned on an entry by tar_iter_next().
+ * @param dest A destination buffer.
+ * @param len The size of dest.
+ *
+ * @return the number of bytes written to dest, zero once the contents have been read entirely,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_iter_read_body(tar_iter_t *it, void *dest, size_t len);
+
+/**
+ * Releases the resources of an iterator. The file descriptor is left open.
+ *
+ * @param it An iterator initialized by tar_iter_init().
+ */
+void tar_iter_close(tar_iter_t *it);
+
+/**
+ * A gzip-compressed archive opened for random access.
+ * Reads inflate the archive from the closest of the checkpoints recorded every MiB of archive when it was opened.
+ */
+typedef struct tar_gz tar_gz_t;
+
+/**
+ * Opens a gzip-compressed archive for random access, decompressing it once to index its entries and record
+ * checkpoints.
+ *
+ * @param gz_fd A file descriptor of a gzip-compressed tar archive. It must stay open until tar_gz_close() is called.
+ *
+ * @return a newly allocated handle to be released with tar_gz_close(),
+ *         NULL if the archive could not be decompressed or memory could not be allocated.
+ */
+tar_gz_t *tar_gz_open(int gz_fd);
+
+/**
+ * Opens a gzip-compressed archive for random access from its sidecar file, or decompresses it once and writes the
+ * sidecar if it is missing, stale or corrupt. See tar_index_open().
+ *
+ * @param gz_fd A file descriptor of a gzip-compressed tar archive. It must stay open until tar_gz_close() is called.
+ * @param idx_path The path of the sidecar file.
+ *
+ * @return a newly allocated handle to be released with tar_gz_close(),
+ *         NULL if the archive could not be decompressed or memory could not be allocated.
+ */
+tar_gz_t *tar_gz_open_indexed(int gz_fd, const char *idx_path);
+
+/**
+ * Writes the index and checkpoints of a compressed archive to a sidecar file.
+ *
+ * @param gz A handle returned by tar_gz_open().
+ * @param idx_path The path of the sidecar file, replaced atomically if it exists.
+ *
+ * @return zero if the sidecar was written, -1 otherwise.
+ */
+int tar_gz_save(const tar_gz_t *gz, const char *idx_path);
+
+/**
+ * Releases a handle opened by tar_gz_open() or tar_gz_open_indexed(). The file descriptor is left open.
+ *
+ * @param gz The handle to release, may be NULL.
+ */
+void tar_gz_close(tar_gz_t *gz);
+
+/**
+ * Gives access to the index of a compressed archive, to be used with the tar_index_* functions.
+ *
+ * @param gz A handle returned by tar_gz_open() or tar_gz_open_indexed().
+ *
+ * @return the index of the archive, owned by the handle.
+ */
+const tar_index_t *tar_gz_index(const tar_gz_t *gz);
+
+/**
+ * Reads a file at a given path in a compressed archive, inflating from the closest checkpoint.
+ * Several threads may read from the same handle.
+ *
+ * @param gz A handle returned by tar_gz_open() or tar_gz_open_indexed().
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t tar_gz_read_file(const tar_gz_t *gz, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * An engine reading files of an archive asynchronously, through io_uring when the kernel supports it and a pool of
+ * threads calling pread() otherwise. An engine belongs to one thread.
+ */
+typedef struct tar_aio tar_aio_t;
+
+/**
+ * Called from tar_aio_poll() once a request has completed, with its status and length set as for
+ * tar_read_files_batch().
+ */
+typedef void (*tar_aio_cb)(tar_read_req_t *request, void *data);
+
+#define TAR_AIO_URING 1
+#define TAR_AIO_THREADS 2
+
+/**
+ * Creates an engine to read files of an archive asynchronously.
+ *
+ * @param archive A handle returned by tar_open(), which must outlive the engine.
+ * @param queue_depth The maximum number of requests in flight.
+ * @param flags TAR_AIO_THREADS to use the thread pool even if io_uring is available.
+ *
+ * @return a newly allocated engine to be released with tar_aio_close(),
+ *         NULL if memory or threads could not be allocated.
+ */
+tar_aio_t *tar_aio_open(const tar_archive_t *archive, unsigned queue_depth, int flags);
+
+/**
+ * Tells which backend an engine uses.
+ *
+ * @param aio An engine returned by tar_aio_open().
+ *
+ * @return TAR_AIO_URING or TAR_AIO_THREADS.
+ */
+int tar_aio_backend(const tar_aio_t *aio);
+
+/**
+ * Registers buffers with the kernel, so that reads into them skip mapping the pages of the destination each time.
+ * Requests whose destination lies within a registered buffer use it.
+ *
+ * @param aio An engine returned by tar_aio_open(), with no request in flight.
+ * @param buffers The buffers to register, replacing those registered before. No buffers unregisters them.
+ * @param no_buffers The number of buffers.
+ *
+ * @return zero if the buffers were registered or if the engine does not use io_uring, where it makes no difference,
+ *         -1 otherwise.
+ */
+int tar_aio_register(tar_aio_t *aio, const struct iovec *buffers, unsigned no_buffers);
+
+/**
+ * Submits a read. Paths are resolved right away, the body is read in the background.
+ *
+ * @param aio An engine returned by tar_aio_open().
+ * @param request The file to read, see tar_read_req_t. It must stay valid until its callback has run.
+ * @param callback Called from tar_aio_poll() once the request has completed, may be NULL.
+ * @param data Passed to the callback.
+ *
+ * @return zero if the request was submitted,
+ *         -1 if the queue is full, tar_aio_poll() must be called first.
+ */
+int tar_aio_submit(tar_aio_t *aio, tar_read_req_t *request, tar_aio_cb callback, void *data);
+
+/**
+ * Runs the callbacks of the completed requests. With io_uring, submitted requests are only sent to the kernel by
+ * this call, so that they are sent together.
+ *
+ * @param aio An engine returned by tar_aio_open().
+ * @param wait Non-zero to wait for at least one completion if none is ready and requests are in flight.
+ *
+ * @return the number of requests completed, -1 if io_uring failed.
+ */
+int tar_aio_poll(tar_aio_t *aio, int wait);
+
+/**
+ * Waits for the requests in flight, running their callbacks, then releases an engine.
+ *
+ * @param aio The engine to release, may be NULL.
+ */
+void tar_aio_close(tar_aio_t *aio);
+
+/**
+ * Extracts an archive under a directory: directories first, then regular files with several threads, large ones
+ * split in chunks, then hard and symbolic links. Paths cannot leave the destination, ".." components stop at it.
+ * Permission bits are restored, subject to the umask, those of directories last so that read-only ones can be
+ * filled; owners and times are not.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param dest_dir The directory to extract into, which must exist.
+ * @param nthreads The number of threads writing files, zero or less for one per online processor.
+ *
+ * @return zero if every entry was extracted,
+ *         -1 if the destination could not be opened or memory could not be allocated,
+ *         a positive value, the number of entries that could not be extracted, otherwise; the entries under a
+ *         directory that could not be created count as not extracted.
+ */
+int tar_extract(const tar_archive_t *archive, const char *dest_dir, int nthreads);
+
+/**
+ * A writer producing a ustar archive. Entries are prepared by worker threads and written in the order they were
+ * added by another thread, so adding entries returns without waiting for the disk unless too many are queued.
+ * A writer belongs to one thread.
+ */
+typedef struct tar_writer tar_writer_t;
+
+/**
+ * Starts writing an archive.
+ *
+ * @param out_fd A file descriptor to write the archive to, at its current offset.
+ * @param nthreads The number of threads preparing entries, zero or less for one per online processor.
+ *
+ * @return a newly allocated writer to be finished with tar_writer_close(),
+ *         NULL if memory or threads could not be allocated.
+ */
+tar_writer_t *tar_writer_open(int out_fd, int nthreads);
+
+/**
+ * Adds a regular file to the archive. Its contents, permissions, owner and modification time are read from a file
+ * on disk, by a worker thread, so errors on the source only show in the result of tar_writer_close().
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the entry in the archive. Paths longer than 100 characters are split in the prefix field.
+ * @param src_path The file to copy.
+ *
+ * @return zero if the file was queued, -1 if memory could not be allocated.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *name, const char *src_path);
+
+/**
+ * Adds a directory to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the directory in the archive, a trailing slash is added if missing.
+ * @param mode The permissions of the directory.
+ *
+ * @return zero if the directory was queued, -1 if memory could not be allocated.
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *name, mode_t mode);
+
+/**
+ * Adds a symbolic link to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the link in the archive.
+ * @param target The target of the link, stored as is.
+ *
+ * @return zero if the link was queued, -1 if memory could not be allocated.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *name, const char *target);
+
+/**
+ * Writes the entries still queued and the end of the archive, then releases the writer. The file descriptor is
+ * left open.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ *
+ * @return zero if every entry was added,
+ *         -1 if writing to the archive failed,
+ *         a positive value, the number of entries skipped because their source could not be read or their name or
+ *         link target does not fit in a header, otherwise.
+ */
+int tar_writer_close(tar_writer_t *writer);
+
+/*
+ * Public functions timed in tar_stats_t. The ones which only read or set a value in memory are not: the tar_stats_*
+ * functions, tar_cache_stats(), tar_gz_index(), tar_mmap_index(), tar_aio_backend(), tar_simd_level(),
+ * tar_set_scan_window(), is_null_block() and tar_header_checksum() cost less than timing them would.
+ */
+#define TAR_FN_CHECK_ARCHIVE          0
+#define TAR_FN_EXISTS                 1
+#define TAR_FN_IS_DIR                 2
+#define TAR_FN_IS_FILE                3
+#define TAR_FN_IS_SYMLINK             4
+#define TAR_FN_LIST                   5
+#define TAR_FN_READ_FILE              6
+#define TAR_FN_TAR_OPEN               7
+#define TAR_FN_TAR_EXISTS             8
+#define TAR_FN_TAR_IS_DIR             9
+#define TAR_FN_TAR_IS_FILE            10
+#define TAR_FN_TAR_IS_SYMLINK         11
+#define TAR_FN_TAR_LIST               12
+#define TAR_FN_TAR_READ_FILE          13
+#define TAR_FN_TAR_READ_FILE_TO_FD    14
+#define TAR_FN_TAR_READ_FILES_BATCH   15
+#define TAR_FN_TAR_EXTRACT            16
+#define TAR_FN_TAR_LIST_ARENA         17
+#define TAR_FN_TAR_INDEX_REFRESH      18
+#define TAR_FN_TAR_DIGEST_ALL         19
+#define TAR_FN_TAR_QUERY_OPEN         20
+#define TAR_FN_CHECK_ARCHIVE_PARALLEL 21
+#define TAR_FN_TAR_INDEX_BUILD        22
+#define TAR_FN_TAR_INDEX_FREE         23
+#define TAR_FN_TAR_INDEX_EXISTS       24
+#define TAR_FN_TAR_INDEX_IS_DIR       25
+#define TAR_FN_TAR_INDEX_IS_FILE      26
+#define TAR_FN_TAR_INDEX_IS_SYMLINK   27
+#define TAR_FN_TAR_INDEX_LIST         28
+#define TAR_FN_TAR_INDEX_LIST_ARENA   29
+#define TAR_FN_TAR_OPEN_MMAP          30
+#define TAR_FN_TAR_CLOSE_MMAP         31
+#define TAR_FN_TAR_MMAP_READ_FILE     32
+#define TAR_FN_TAR_CLOSE              33
+#define TAR_FN_TAR_CACHE_ENABLE       34
+#define TAR_FN_TAR_INDEX_SAVE         35
+#define TAR_FN_TAR_INDEX_LOAD         36
+#define TAR_FN_TAR_INDEX_OPEN         37
+#define TAR_FN_TAR_OPEN_INDEXED       38
+#define TAR_FN_TAR_ITER_INIT          39
+#define TAR_FN_TAR_ITER_NEXT          40
+#define TAR_FN_TAR_ITER_READ_BODY     41
+#define TAR_FN_TAR_ITER_CLOSE         42
+#define TAR_FN_TAR_GZ_OPEN            43
+#define TAR_FN_TAR_GZ_SAVE            44
+#define TAR_FN_TAR_GZ_OPEN_INDEXED    45
+#define TAR_FN_TAR_GZ_CLOSE           46
+#define TAR_FN_TAR_GZ_READ_FILE       47
+#define TAR_FN_TAR_AIO_OPEN           48
+#define TAR_FN_TAR_AIO_REGISTER       49
+#define TAR_FN_TAR_AIO_SUBMIT         50
+#define TAR_FN_TAR_AIO_POLL           51
+#define TAR_FN_TAR_AIO_CLOSE          52
+#define TAR_FN_TAR_WRITER_OPEN        53
+#define TAR_FN_TAR_WRITER_ADD_FILE    54
+#define TAR_FN_TAR_WRITER_ADD_DIR     55
+#define TAR_FN_TAR_WRITER_ADD_SYMLINK 56
+#define TAR_FN_TAR_WRITER_CLOSE       57
+#define TAR_FN_TAR_OVERLAY_OPEN       58
+#define TAR_FN_TAR_OVERLAY_CLOSE      59
+#define TAR_FN_TAR_OVERLAY_EXISTS     60
+#define TAR_FN_TAR_OVERLAY_IS_DIR     61
+#define TAR_FN_TAR_OVERLAY_IS_FILE    62
+#define TAR_FN_TAR_OVERLAY_IS_SYMLINK 63
+#define TAR_FN_TAR_OVERLAY_READ_FILE  64
+#define TAR_FN_TAR_OVERLAY_LIST_ARENA 65
+#define TAR_FN_TAR_DIGEST             66
+#define TAR_FN_TAR_DIGEST_DUPLICATES  67
+#define TAR_FN_TAR_QUERY_NEXT         68
+#define TAR_FN_TAR_QUERY_CLOSE        69
+#define TAR_FN_COUNT                  70
+
+/**
+ * Counters of the work done by the library, for the whole process or for one handle opened by tar_open().
+ * They are only updated once enabled with tar_stats_enable(), or with TAR_STATS=1 in the environment.
+ * Setting TAR_TRACE=1 in the environment also logs every call to a public function to stderr, and TAR_TRACE=<path>
+ * to the given file.
+ */
+typedef struct {
+    uint64_t headers;       // headers read from an archive
+    uint64_t read_calls;
+    uint64_t pread_calls;   // pread() and preadv()
+    uint64_t lseek_calls;
+    uint64_t bytes_read;    // by the calls above
+    uint64_t index_hits;    // paths found in an index
+    uint64_t index_misses;
+    uint64_t symlinks;      // symbolic links followed
+    uint64_t calls[TAR_FN_COUNT];           // indexed by the TAR_FN_* values
+    uint64_t nanoseconds[TAR_FN_COUNT];     // wall time spent in each function
+} tar_stats_t;
+
+/**
+ * Turns the counters on or off for the whole process. Tracing, when requested through TAR_TRACE, stops with them.
+ *
+ * @param enable Zero to stop counting, any other value to start.
+ *
+ * @return the previous state, a non-zero value if the counters were on.
+ */
+int tar_stats_enable(int enable);
+
+/**
+ * Copies the counters of a handle, or of the whole process.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the counters of every call in the process.
+ * @param out The structure to fill.
+ */
+void tar_stats_get(const tar_archive_t *archive, tar_stats_t *out);
+
+/**
+ * Sets the counters of a handle, or of the whole process, back to zero.
+ *
+ * @param archive A handle returned by tar_open(), or NULL for the process-wide counters.
+ */
+void tar_stats_reset(tar_archive_t *archive);
+
+/**
+ * Names a function counted in tar_stats_t.
+ *
+ * @param fn One of the TAR_FN_* values.
+ *
+ * @return the name of the function, or NULL if `fn` is out of range.
+ */
+const char *tar_stats_function_name(int fn);
+
+/**
+ * Counters of the block cache of a handle, see tar_cache_enable().
+ */
+typedef struct {
+    uint64_t hits;          // blocks found in the cache
+    uint64_t misses;        // blocks read from the archive
+    uint64_t evictions;
+    size_t capacity;        // bytes the cache may hold
+    size_t used;            // bytes it holds
+} tar_cache_stats_t;
+
+/**
+ * Enables, resizes or disables the block cache of a handle. Once enabled, tar_read_file(), tar_read_file_to_fd()
+ * and tar_read_files_batch() serve reads of up to 256 KiB from blocks of the archive kept in memory, evicted
+ * in CLOCK order. Must not be called while other threads use the handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param budget The memory the cached blocks may take, in bytes, or zero to disable the cache.
+ *
+ * @return zero on success, -1 if memory could not be allocated, in which case the cache is left disabled.
+ */
+int tar_cache_enable(tar_archive_t *archive, size_t budget);
+
+/**
+ * Copies the counters of the block cache of a handle, which are kept whether tar_stats_enable() was called or not.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param out The structure to fill, zeroed if the cache is disabled.
+ */
+void tar_cache_stats(const tar_archive_t *archive, tar_cache_stats_t *out);
+
+/**
+ * A stack of archives seen as one, the topmost layer holding a path winning. A layer hides entries of the layers
+ * below it with whiteouts: an entry named ".wh.<name>" hides <name> in the same directory, and an entry named
+ * ".wh..wh..opq" hides the contents of its directory. Symbolic links are resolved within their layer.
+ */
+typedef struct tar_overlay tar_overlay_t;
+
+/**
+ * Stacks archives into one overlay.
+ *
+ * @param layers Handles returned by tar_open(), the bottom layer first. They must stay open until tar_overlay_close()
+ *               is called.
+ * @param no_layers The number of layers.
+ *
+ * @return a newly allocated overlay to be released with tar_overlay_close(),
+ *         NULL if memory could not be allocated.
+ */
+tar_overlay_t *tar_overlay_open(const tar_archive_t *const *layers, size_t no_layers);
+
+/**
+ * Releases an overlay opened by tar_overlay_open(). The layers are left open.
+ *
+ * @param overlay The overlay to release, may be NULL.
+ */
+void tar_overlay_close(tar_overlay_t *overlay);
+
+/**
+ * Overlay version of exists().
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay.
+ *
+ * @return zero if no visible entry at the given path exists in the layers,
+ *         any other value otherwise.
+ */
+int tar_overlay_exists(const tar_overlay_t *overlay, const char *path);
+
+/**
+ * Overlay version of is_dir().
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay.
+ *
+ * @return zero if no visible entry at the given path exists in the layers or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_overlay_is_dir(const tar_overlay_t *overlay, const char *path);
+
+/**
+ * Overlay version of is_file().
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay.
+ *
+ * @return zero if no visible entry at the given path exists in the layers or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_overlay_is_file(const tar_overlay_t *overlay, const char *path);
+
+/**
+ * Overlay version of is_symlink().
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay.
+ *
+ * @return zero if no visible entry at the given path exists in the layers or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int tar_overlay_is_symlink(const tar_overlay_t *overlay, const char *path);
+
+/**
+ * Overlay version of read_file(). The file is read from the topmost layer holding it.
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay. If the entry is a symlink, it is resolved within its layer.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return the same value as tar_read_file() would on the layer holding the file,
+ *         -1 if no visible entry at the given path exists in the layers or the entry is not a file.
+ */
+ssize_t tar_overlay_read_file(const tar_overlay_t *overlay, const char *path, size_t offset, uint8_t *dest,
+                              size_t *len);
+
+/**
+ * Overlay version of tar_list_arena(). The entries of the directory in every visible layer are merged, the
+ * topmost layer holding a name winning, and sorted by name. Whiteouts are not listed.
+ *
+ * @param overlay An overlay returned by tar_overlay_open().
+ * @param path A path to an entry in the overlay. If the entry is a symlink, it is resolved within its layer.
+ * @param out Set to an array of the entries listed, to be released with free(), or NULL if there are none.
+ *            The names stay valid until the layers are closed or refreshed.
+ *
+ * @return the number of entries listed,
+ *         -1 if no visible directory at the given path exists in the layers,
+ *         -2 if memory could not be allocated.
+ */
+ssize_t tar_overlay_list_arena(const tar_overlay_t *overlay, const char *path, tar_list_entry_t **out);
+
+/**
+ * Adds the entries appended to an archive since its handle was opened or last refreshed. Only the part of the
+ * archive following the end-of-archive marker seen last is read, and validated as check_archive() would.
+ * An entry still being written, whose body goes past the end of the file, is left to a later refresh.
+ * Later entries shadow earlier ones with the same path.
+ * Must not be called while other threads use the handle, nor while an overlay holds it.
+ *
+ * @param archive A handle returned by tar_open() or tar_open_indexed().
+ *
+ * @return the number of headers added, zero if the archive did not change,
+ *         -1, -2 or -3 as check_archive() would if an appended header is invalid, in which case none are added,
+ *         -4 if the archive could not be read or memory could not be allocated.
+ */
+int tar_index_refresh(tar_archive_t *archive);
+
+/* Algorithms of tar_digest_all(). */
+#define TAR_DIGEST_XXH64  0
+#define TAR_DIGEST_CRC32C 1
+
+/**
+ * A file listed by tar_digest_duplicates(). The name is not null-terminated.
+ */
+typedef struct {
+    const char *name;
+    size_t len;
+    uint64_t size;
+    uint64_t digest;
+    size_t group;       // files of the same group have the same contents
+} tar_digest_entry_t;
+
+/**
+ * Computes a digest of every regular file of the archive, each file being read once. The digests are kept with the
+ * index of the handle, replacing the ones computed before, and are queried with tar_digest() and
+ * tar_digest_duplicates(). Must not be called while other threads use the handle.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param algo TAR_DIGEST_XXH64 or TAR_DIGEST_CRC32C.
+ * @param nthreads The number of threads reading and hashing files, or zero to use one per online CPU.
+ *
+ * @return the number of files digested,
+ *         -1 if the algorithm is unknown,
+ *         -2 if the archive could not be read or memory could not be allocated, in which case the digests computed
+ *         before are kept.
+ */
+int tar_digest_all(tar_archive_t *archive, int algo, int nthreads);
+
+/**
+ * Gives the digest of a file computed by tar_digest_all().
+ *
+ * @param archive A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param digest Set to the digest of the file, a CRC32C taking the low 32 bits.
+ *
+ * @return zero if the digest was set,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the file was not digested, tar_digest_all() not having been called since it was added.
+ */
+int tar_digest(const tar_archive_t *archive, const char *path, uint64_t *digest);
+
+/**
+ * Lists the files with the same contents, as told by their size and digest computed by tar_digest_all().
+ * Empty files are left out.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param out Set to an array of the files having at least one duplicate, to be released with free(), or NULL if
+ *            there are none. Files with the same contents are next to each other and share a group number, the
+ *            groups going from the largest files to the smallest. The names point into the index of the handle and
+ *            stay valid until tar_close() or tar_index_refresh() is called.
+ *
+ * @return the number of files listed,
+ *         -1 if tar_digest_all() was not called,
+ *         -2 if memory could not be allocated.
+ */
+ssize_t tar_digest_duplicates(const tar_archive_t *archive, tar_digest_entry_t **out);
+
+
+/* A query started by tar_query_open(). */
+typedef struct tar_query tar_query_t;
+
+/**
+ * Starts a query for the entries of an archive whose path matches a shell-style pattern. Each component of the
+ * pattern matches one component of the path: '*' matches any characters, '?' any single one, and '[...]' one of a
+ * class such as [a-z] or [!0-9]. A backslash escapes the character following it. A component of "**" matches any
+ * number of components, so "**" following a directory walks it and everything below it. Symbolic links are not
+ * followed.
+ *
+ * @param archive A handle returned by tar_open().
+ * @param pattern The pattern, of at most 63 components.
+ * @param nthreads 1 to match entries while they are iterated, or the number of threads matching them all up front,
+ *                 zero to use one per online CPU, which pays off on archives of millions of entries.
+ *
+ * @return a query to iterate with tar_query_next() and release with tar_query_close(),
+ *         NULL if the pattern has too many components or memory could not be allocated.
+ */
+tar_query_t *tar_query_open(const tar_archive_t *archive, const char *pattern, int nthreads);
+
+/**
+ * Gives the next entry matched by a query. Entries come in walking order: each directory is followed by the
+ * entries below it, and the entries of a directory are sorted by name.
+ *
+ * @param query A query returned by tar_query_open().
+ * @param entry Set to the entry matched. The name points into the index of the handle and stays valid until
+ *              tar_close() or tar_index_refresh() is called.
+ *
+ * @return 1 if an entry was set,
+ *         zero if all entries were given,
+ *         -1 if memory could not be allocated.
+ */
+int tar_query_next(tar_query_t *query, tar_list_entry_t *entry);
+
+/**
+ * Releases a query. The handle it was started on must not be closed or refreshed before.
+ *
+ * @param query A query returned by tar_query_open(), or NULL.
+ */
+void tar_query_close(tar_query_t *query);
+
 #endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // nftw()
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -5,6 +6,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <ftw.h>
 
 #include "lib_tar.h"
 
@@ -33,6 +37,12 @@ void test_check_archive(int fd) {
     lseek(fd, 0, SEEK_SET);
 }
 
+void test_check_archive_parallel(int fd, int nthreads) {
+    int ret = check_archive_parallel(fd, nthreads);
+    printf("check_archive_parallel(%d) returned %d\n", nthreads, ret);
+    lseek(fd, 0, SEEK_SET);
+}
+
 void test_exists(int fd, const char *path) {
     int ret = exists(fd, (char *)path);
     printf("exists('%s') returned %d\n", path, ret);
@@ -83,6 +93,1136 @@ void test_read_file(int fd, const char *path, size_t offset) {
     lseek(fd, 0, SEEK_SET);
 }
 
+void test_checksum_kernels(int fd) {
+    tar_header_t blocks[1024];
+    size_t no_blocks = 0;
+
+    // headers of the archive, random blocks and blocks with a single non-null byte
+    ssize_t num_bytes = read(fd, blocks, 16 * sizeof(tar_header_t));
+    no_blocks = num_bytes > 0 ? num_bytes / sizeof(tar_header_t) : 0;
+    srand(42);
+    for (size_t i = 0; i < 256; i++, no_blocks++) {
+        uint8_t *bytes = (uint8_t *)&blocks[no_blocks];
+        for (size_t j = 0; j < sizeof(tar_header_t); j++) {
+            bytes[j] = rand();
+        }
+    }
+    for (size_t i = 0; i < sizeof(tar_header_t); i++, no_blocks++) {
+        memset(&blocks[no_blocks], 0, sizeof(tar_header_t));
+        ((uint8_t *)&blocks[no_blocks])[i] = 1 + i % 255;
+    }
+    memset(&blocks[no_blocks++], 0, sizeof(tar_header_t));
+
+    int best = tar_simd_level(-1);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < no_blocks; i++) {
+        tar_simd_level(TAR_SIMD_SCALAR);
+        unsigned int sum = tar_header_checksum(&blocks[i]);
+        int null = is_null_block(&blocks[i]);
+        for (int level = TAR_SIMD_SCALAR + 1; level <= best; level++) {
+            tar_simd_level(level);
+            if (tar_header_checksum(&blocks[i]) != sum || is_null_block(&blocks[i]) != null) {
+                mismatches++;
+            }
+        }
+    }
+    tar_simd_level(-1);
+
+    printf("checksum kernels up to level %d: %zu blocks, %zu mismatches\n", best, no_blocks, mismatches);
+    lseek(fd, 0, SEEK_SET);
+}
+
+void test_index(int fd, const char *path) {
+    tar_index_t *index = tar_index_build(fd);
+    if (index == NULL) {
+        printf("tar_index_build failed\n");
+        lseek(fd, 0, SEEK_SET);
+        return;
+    }
+
+    printf("tar_index_exists('%s') returned %d\n", path, tar_index_exists(index, path));
+    printf("tar_index_is_dir('%s') returned %d\n", path, tar_index_is_dir(index, path));
+    printf("tar_index_is_file('%s') returned %d\n", path, tar_index_is_file(index, path));
+    printf("tar_index_is_symlink('%s') returned %d\n", path, tar_index_is_symlink(index, path));
+
+    tar_index_free(index);
+    lseek(fd, 0, SEEK_SET);
+}
+
+void test_tar_list(int fd, const char *path) {
+    tar_archive_t *archive = tar_open(fd);
+    if (archive == NULL) {
+        printf("tar_open failed\n");
+        return;
+    }
+
+    char *entries[10];
+    for (int i = 0; i < 10; i++) {
+        entries[i] = malloc(100);
+    }
+    size_t no_entries = 10;
+    int ret = tar_list(archive, path, entries, &no_entries);
+
+    printf("tar_list('%s') returned %d\n", path, ret);
+    printf("Number of entries: %zu\n", no_entries);
+    for (size_t i = 0; i < 10; i++) {
+        if (i < no_entries) {
+            printf("Entry %zu: %s\n", i, entries[i]);
+        }
+        free(entries[i]);
+    }
+    tar_close(archive);
+}
+
+void test_tar_list_arena(int fd, const char *path) {
+    tar_archive_t *archive = tar_open(fd);
+    if (archive == NULL) {
+        printf("tar_open failed\n");
+        return;
+    }
+
+    tar_list_entry_t *entries;
+    ssize_t ret = tar_list_arena(archive, path, &entries);
+    printf("tar_list_arena('%s') returned %zd\n", path, ret);
+    for (ssize_t i = 0; i < ret; i++) {
+        printf("Entry %zd: %.*s (%c)\n", i, (int)entries[i].len, entries[i].name, entries[i].typeflag);
+    }
+    free(entries);
+    tar_close(archive);
+}
+
+void test_tar_read_file(int fd, const char *path, size_t offset) {
+    tar_archive_t *archive = tar_open(fd);
+    if (archive == NULL) {
+        printf("tar_open failed\n");
+        return;
+    }
+
+    uint8_t buffer[512];
+    size_t len = sizeof(buffer);
+    ssize_t ret = tar_read_file(archive, path, offset, buffer, &len);
+
+    printf("tar_read_file('%s', %zu) returned %zd\n", path, offset, ret);
+    tar_close(archive);
+}
+
+void test_read_files_batch(int fd) {
+    tar_archive_t *archive = tar_open(fd);
+    if (archive == NULL) {
+        printf("tar_open failed\n");
+        return;
+    }
+
+    // out of order, duplicated, through links, missing, not a file, past the end and truncated
+    const char *paths[] = { "lib_tar.h", "file.txt", "chain", "lib_tar.c", "nope", "test_dir", "file.txt", "lib_tar.h" };
+    size_t offsets[] = { 10, 0, 0, 0, 0, 0, 1 << 30, 0 };
+    size_t sizes[] = { 512, 512, 512, 8192, 512, 512, 512, 16 };
+    tar_read_req_t requests[8];
+    uint8_t buffers[8][8192];
+    for (int i = 0; i < 8; i++) {
+        requests[i] = (tar_read_req_t) { paths[i], offsets[i], buffers[i], sizes[i], 0 };
+    }
+    printf("tar_read_files_batch returned %d\n", tar_read_files_batch(archive, requests, 8));
+
+    for (int i = 0; i < 8; i++) {
+        uint8_t expected[8192];
+        size_t len = sizes[i];
+        ssize_t ret = tar_read_file(archive, paths[i], offsets[i], expected, &len);
+        int same = ret == requests[i].status && (ret < 0 || (len == requests[i].len && !memcmp(expected, buffers[i], len)));
+        printf("batch '%s' at %zu: %zd, %s tar_read_file\n", paths[i], offsets[i], requests[i].status,
+               same ? "matches" : "differs from");
+    }
+    tar_close(archive);
+}
+
+typedef struct {
+    const tar_archive_t *archive;
+    int completed;
+    int mismatches;
+} aio_check_t;
+
+void aio_check(tar_read_req_t *request, void *data) {
+    aio_check_t *check = data;
+    uint8_t expected[8192];
+    size_t len = sizeof(expected);
+    ssize_t ret = tar_read_file(check->archive, request->path, request->offset, expected, &len);
+    if (ret != request->status || (ret >= 0 && (len != request->len || memcmp(expected, request->dest, len)))) {
+        check->mismatches++;
+    }
+    check->completed++;
+}
+
+void test_aio(int fd, int flags, unsigned queue_depth) {
+    tar_archive_t *archive = tar_open(fd);
+    tar_aio_t *aio = archive != NULL ? tar_aio_open(archive, queue_depth, flags) : NULL;
+    if (aio == NULL) {
+        printf("tar_aio_open failed\n");
+        tar_close(archive);
+        return;
+    }
+
+    // more requests than the queue holds, so that slots are reused
+    const char *paths[] = { "lib_tar.h", "chain", "nope", "lib_tar.c", "test_dir", "file.txt", "test_dir/up/a" };
+    tar_read_req_t requests[21];
+    static uint8_t buffers[21][8192];
+    struct iovec registered = { buffers, sizeof(buffers) };
+    tar_aio_register(aio, &registered, 1);
+
+    aio_check_t check = { archive, 0, 0 };
+    int submitted = 0;
+    while (submitted < 21) {
+        requests[submitted] = (tar_read_req_t) { paths[submitted % 7], submitted, buffers[submitted], 8192, 0 };
+        if (tar_aio_submit(aio, &requests[submitted], aio_check, &check) < 0) {
+            tar_aio_poll(aio, 1);
+        } else {
+            submitted++;
+        }
+    }
+    int backend = tar_aio_backend(aio);
+    tar_aio_close(aio);
+    printf("tar_aio (%s, depth %u): %d completed, %d differ from tar_read_file\n",
+           backend == TAR_AIO_URING ? "io_uring" : "threads", queue_depth, check.completed, check.mismatches);
+    tar_close(archive);
+}
+
+typedef struct {
+    int pipe_fd;
+    uint8_t *buffer;
+    size_t cap;
+    ssize_t num_bytes;
+} pipe_drain_t;
+
+void *drain_pipe(void *arg) {
+    pipe_drain_t *drain = arg;
+    ssize_t num_bytes;
+
+    // a pipe holds less than a file sent from an unaligned offset may need
+    drain->num_bytes = 0;
+    while ((num_bytes = read(drain->pipe_fd, drain->buffer + drain->num_bytes, drain->cap - drain->num_bytes)) > 0) {
+        drain->num_bytes += num_bytes;
+    }
+    if (num_bytes < 0) {
+        drain->num_bytes = -1;
+    }
+    close(drain->pipe_fd);
+    return NULL;
+}
+
+void test_read_file_to_fd(int fd, const char *path, size_t offset) {
+    tar_archive_t *archive = tar_open(fd);
+    if (archive == NULL) {
+        printf("tar_open failed\n");
+        return;
+    }
+    uint8_t expected[65536], buffer[65536];
+    size_t expected_len = sizeof(expected);
+    ssize_t expected_ret = tar_read_file(archive, path, offset, expected, &expected_len);
+
+    // to a file, then to a pipe
+    for (int i = 0; i < 2; i++) {
+        int fds[2];
+        FILE *file = NULL;
+        if (i == 0) {
+            file = tmpfile();
+            fds[0] = fds[1] = fileno(file);
+        } else if (pipe(fds) < 0) {
+            break;
+        }
+
+        pthread_t thread;
+        pipe_drain_t drain = { fds[0], buffer, sizeof(buffer), -1 };
+        if (i == 1 && pthread_create(&thread, NULL, drain_pipe, &drain) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+        size_t len = sizeof(buffer);
+        ssize_t ret = tar_read_file_to_fd(archive, path, offset, &len, fds[1]);
+        ssize_t num_bytes;
+        if (i == 0) {
+            num_bytes = pread(fds[0], buffer, sizeof(buffer), 0);
+            fclose(file);
+        } else {
+            close(fds[1]);
+            pthread_join(thread, NULL);
+            num_bytes = drain.num_bytes;
+        }
+        int same = ret == expected_ret && (ret < 0 || (len == expected_len && num_bytes == len && !memcmp(buffer, expected, len)));
+        printf("tar_read_file_to_fd('%s', %zu) to a %s returned %zd, %s tar_read_file\n", path, offset,
+               i == 0 ? "file" : "pipe", ret, same ? "matches" : "differs from");
+    }
+    tar_close(archive);
+}
+
+void test_stats(int fd, const char *path) {
+    int was_enabled = tar_stats_enable(1);
+    tar_stats_reset(NULL);
+
+    // scanning functions count headers and system calls
+    int ret = exists(fd, (char *)path);
+    lseek(fd, 0, SEEK_SET);
+    tar_stats_t stats;
+    tar_stats_get(NULL, &stats);
+    printf("exists('%s') returned %d: %llu call, %llu headers, %llu lseek, %s pread\n", path, ret,
+           (unsigned long long)stats.calls[TAR_FN_EXISTS], (unsigned long long)stats.headers,
+           (unsigned long long)stats.lseek_calls, stats.pread_calls > 0 && stats.bytes_read > 0 ? "some" : "no");
+
+    // handles count their own lookups only
+    tar_archive_t *archive = tar_open(fd);
+    if (archive == NULL) {
+        printf("tar_open failed\n");
+        tar_stats_enable(was_enabled);
+        return;
+    }
+    tar_stats_reset(archive);
+    uint8_t buffer[512];
+    size_t len = sizeof(buffer);
+    tar_read_file(archive, path, 0, buffer, &len);
+    tar_exists(archive, "nope");
+    tar_stats_get(archive, &stats);
+    printf("handle: %llu calls, %llu hits, %llu misses, %s symlinks, %llu pread for %zu bytes\n",
+           (unsigned long long)(stats.calls[TAR_FN_TAR_READ_FILE] + stats.calls[TAR_FN_TAR_EXISTS]),
+           (unsigned long long)stats.index_hits, (unsigned long long)stats.index_misses,
+           stats.symlinks > 0 ? "some" : "no", (unsigned long long)stats.pread_calls, len);
+    tar_stats_get(NULL, &stats);
+    printf("process: %llu %s, %llu headers\n", (unsigned long long)stats.calls[TAR_FN_TAR_OPEN],
+           tar_stats_function_name(TAR_FN_TAR_OPEN),
+           (unsigned long long)stats.headers);
+    tar_close(archive);
+
+    // a handle opened from a sidecar counts its opening, like one from tar_open()
+    char idx_path[] = "/tmp/lib_tar_stats_XXXXXX";
+    int idx_fd = mkstemp(idx_path);
+    if (idx_fd >= 0) {
+        close(idx_fd);
+        unlink(idx_path);
+    }
+    lseek(fd, 0, SEEK_SET);
+    archive = tar_open_indexed(fd, idx_path);
+    if (archive != NULL) {
+        tar_stats_get(archive, &stats);
+        printf("indexed handle: %llu %s\n", (unsigned long long)stats.calls[TAR_FN_TAR_OPEN_INDEXED],
+               tar_stats_function_name(TAR_FN_TAR_OPEN_INDEXED));
+    }
+    tar_close(archive);
+    unlink(idx_path);
+    lseek(fd, 0, SEEK_SET);
+    tar_stats_enable(was_enabled);
+}
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+void test_extract(int fd, int nthreads, const char *path) {
+    char dest[] = "/tmp/lib_tar_extract_XXXXXX";
+    tar_archive_t *archive = tar_open(fd);
+    if (archive == NULL || mkdtemp(dest) == NULL) {
+        printf("tar_open or mkdtemp failed\n");
+        tar_close(archive);
+        return;
+    }
+    printf("tar_extract(%d threads) returned %d\n", nthreads, tar_extract(archive, dest, nthreads));
+
+    // the extracted file, through links if any, holds what tar_read_file() reads
+    char extracted[4096];
+    snprintf(extracted, sizeof(extracted), "%s/%s", dest, path);
+    uint8_t expected[65536], buffer[65536];
+    size_t len = sizeof(expected);
+    ssize_t ret = tar_read_file(archive, path, 0, expected, &len);
+    int file_fd = open(extracted, O_RDONLY);
+    ssize_t num_bytes = file_fd >= 0 ? read(file_fd, buffer, sizeof(buffer)) : -1;
+    struct stat st;
+    lstat(extracted, &st);
+    printf("extracted '%s' is a %s, %s tar_read_file\n", path, S_ISLNK(st.st_mode) ? "symlink" : S_ISDIR(st.st_mode) ? "directory" : "file",
+           (ret < 0 && num_bytes < 0) || (ret == 0 && num_bytes == len && !memcmp(buffer, expected, len)) ? "matches" : "differs from");
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+
+    nftw(dest, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    tar_close(archive);
+}
+
+void test_extract_read_only(void) {
+    // a read-only file large enough to be extracted in chunks
+    static uint8_t contents[(9 << 20) + 100], buffer[sizeof(contents)];
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = i % 251;
+    }
+    char src_path[] = "/tmp/lib_tar_read_only_XXXXXX", dest[] = "/tmp/lib_tar_extract_XXXXXX";
+    int src_fd = mkstemp(src_path);
+    ssize_t num_bytes = src_fd >= 0 ? write(src_fd, contents, sizeof(contents)) : -1;
+    close(src_fd);
+    chmod(src_path, 0444);
+    FILE *file = tmpfile();
+    tar_writer_t *writer = tar_writer_open(fileno(file), 1);
+    if (num_bytes != sizeof(contents) || writer == NULL || mkdtemp(dest) == NULL) {
+        printf("could not write the read-only archive\n");
+        tar_writer_close(writer);
+        unlink(src_path);
+        fclose(file);
+        return;
+    }
+    tar_writer_add_file(writer, "ro", src_path);
+    tar_writer_add_dir(writer, "ro_dir", 0555);
+    tar_writer_add_file(writer, "ro_dir/ro", src_path);
+    tar_writer_close(writer);
+    unlink(src_path);
+
+    lseek(fileno(file), 0, SEEK_SET);
+    tar_archive_t *archive = tar_open(fileno(file));
+    printf("tar_extract of a read-only file returned %d, ", archive ? tar_extract(archive, dest, 2) : -1);
+    char extracted[4096];
+    snprintf(extracted, sizeof(extracted), "%s/ro", dest);
+    struct stat st;
+    int fd = open(extracted, O_RDONLY);
+    num_bytes = fd >= 0 ? read(fd, buffer, sizeof(buffer)) : -1;
+    printf("mode %03o, contents %s\n", fstat(fd, &st) == 0 ? st.st_mode & 0777 : 0,
+           num_bytes == sizeof(contents) && memcmp(buffer, contents, sizeof(contents)) == 0 ? "match" : "differ");
+    if (fd >= 0) {
+        close(fd);
+    }
+    // the directory is read-only once its file is in it
+    snprintf(extracted, sizeof(extracted), "%s/ro_dir", dest);
+    printf("read-only directory mode %03o, ", stat(extracted, &st) == 0 ? st.st_mode & 0777 : 0);
+    snprintf(extracted, sizeof(extracted), "%s/ro_dir/ro", dest);
+    printf("its file %s\n", stat(extracted, &st) == 0 && st.st_size == sizeof(contents) ? "is extracted" : "is missing");
+    snprintf(extracted, sizeof(extracted), "%s/ro_dir", dest);
+    chmod(extracted, 0755);
+    nftw(dest, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    tar_close(archive);
+    fclose(file);
+}
+
+void test_writer(const char *src_path, int nthreads) {
+    FILE *file = tmpfile();
+    int out_fd = fileno(file);
+    tar_writer_t *writer = tar_writer_open(out_fd, nthreads);
+    if (writer == NULL) {
+        printf("tar_writer_open failed\n");
+        fclose(file);
+        return;
+    }
+
+    // the long path goes to the prefix field, the missing file is skipped
+    char long_name[160];
+    memset(long_name, 'p', 120);
+    strcpy(long_name + 120, "/copy");
+    tar_writer_add_dir(writer, "w", 0755);
+    tar_writer_add_file(writer, "w/copy", src_path);
+    tar_writer_add_symlink(writer, "w/link", "copy");
+    tar_writer_add_file(writer, "w/missing", "/nonexistent");
+    tar_writer_add_file(writer, long_name, src_path);
+    printf("tar_writer_close returned %d\n", tar_writer_close(writer));
+
+    lseek(out_fd, 0, SEEK_SET);
+    printf("check_archive on the written archive returned %d\n", check_archive(out_fd));
+    lseek(out_fd, 0, SEEK_SET);
+    tar_archive_t *archive = tar_open(out_fd);
+    if (archive != NULL) {
+        uint8_t expected[65536], buffer[65536];
+        int src_fd = open(src_path, O_RDONLY);
+        ssize_t num_bytes = read(src_fd, expected, sizeof(expected));
+        close(src_fd);
+        size_t len = sizeof(buffer);
+        ssize_t ret = tar_read_file(archive, "w/link", 0, buffer, &len);
+        printf("tar_read_file('w/link') returned %zd, %s the source\n", ret,
+               ret >= 0 && len == num_bytes && !memcmp(buffer, expected, len) ? "matches" : "differs from");
+        printf("tar_is_dir('w') returned %d\n", tar_is_dir(archive, "w"));
+        printf("tar_is_file on the prefixed path returned %d\n", tar_is_file(archive, long_name));
+        tar_close(archive);
+    }
+    fclose(file);
+}
+
+void test_base256_size(void) {
+    // a one-file archive whose size field is rewritten in base 256, as GNU tar does from 8 GiB
+    const char contents[] = "stored with a base-256 size";
+    char src_path[] = "/tmp/lib_tar_base256_XXXXXX";
+    int src_fd = mkstemp(src_path);
+    FILE *file = tmpfile();
+    int out_fd = fileno(file);
+    tar_writer_t *writer = tar_writer_open(out_fd, 1);
+    if (src_fd < 0 || writer == NULL || write(src_fd, contents, sizeof(contents)) != sizeof(contents)) {
+        printf("could not write the base-256 archive\n");
+        tar_writer_close(writer);
+        fclose(file);
+        return;
+    }
+    tar_writer_add_file(writer, "big", src_path);
+    tar_writer_close(writer);
+    close(src_fd);
+    unlink(src_path);
+
+    tar_header_t header;
+    pread(out_fd, &header, sizeof(header), 0);
+    memset(header.size, 0, sizeof(header.size));
+    header.size[0] = (char)0x80;
+    header.size[sizeof(header.size) - 1] = sizeof(contents);
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tar_header_checksum(&header));
+    pwrite(out_fd, &header, sizeof(header), 0);
+
+    lseek(out_fd, 0, SEEK_SET);
+    printf("check_archive on the base-256 archive returned %d\n", check_archive(out_fd));
+    lseek(out_fd, 0, SEEK_SET);
+    tar_archive_t *archive = tar_open(out_fd);
+    if (archive != NULL) {
+        uint8_t buffer[64];
+        size_t len = sizeof(buffer);
+        ssize_t ret = tar_read_file(archive, "big", 0, buffer, &len);
+        printf("tar_read_file('big') returned %zd, %s\n", ret,
+               ret == 0 && len == sizeof(contents) && !memcmp(buffer, contents, len) ? "matches" : "differs");
+        tar_close(archive);
+    }
+
+    // a size whose padded end wraps around is rejected rather than scanned forever
+    const uint8_t wrapping[] = { 0x80, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0 };
+    memcpy(header.size, wrapping, sizeof(header.size));
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tar_header_checksum(&header));
+    pwrite(out_fd, &header, sizeof(header), 0);
+    lseek(out_fd, 0, SEEK_SET);
+    printf("check_archive with a wrapping size returned %d, ", check_archive(out_fd));
+    lseek(out_fd, 0, SEEK_SET);
+    printf("check_archive_parallel %d, ", check_archive_parallel(out_fd, 2));
+    lseek(out_fd, 0, SEEK_SET);
+    printf("exists %d, ", exists(out_fd, "big"));
+    lseek(out_fd, 0, SEEK_SET);
+    archive = tar_open(out_fd);
+    printf("tar_open %s\n", archive == NULL ? "failed" : "succeeded");
+    tar_close(archive);
+    fclose(file);
+}
+
+void test_cache(void) {
+    // an archive larger than the cache, made of copies of one file
+    static uint8_t expected[20000], buffer[65536];
+    for (size_t i = 0; i < sizeof(expected); i++) {
+        expected[i] = i * 7;
+    }
+    char src_path[] = "/tmp/lib_tar_cache_XXXXXX";
+    int src_fd = mkstemp(src_path);
+    ssize_t num_bytes = src_fd >= 0 ? write(src_fd, expected, sizeof(expected)) : -1;
+    close(src_fd);
+    FILE *file = tmpfile();
+    int out_fd = fileno(file);
+    tar_writer_t *writer = tar_writer_open(out_fd, 2);
+    if (writer == NULL) {
+        printf("tar_writer_open failed\n");
+        fclose(file);
+        return;
+    }
+    char name[32];
+    for (int i = 0; i < 64; i++) {
+        snprintf(name, sizeof(name), "copy%d", i);
+        tar_writer_add_file(writer, name, src_path);
+    }
+    tar_writer_close(writer);
+    unlink(src_path);
+
+    lseek(out_fd, 0, SEEK_SET);
+    tar_archive_t *archive = tar_open(out_fd);
+    if (archive == NULL || tar_cache_enable(archive, 256 * 1024) < 0) {
+        printf("tar_open or tar_cache_enable failed\n");
+        tar_close(archive);
+        fclose(file);
+        return;
+    }
+
+    // every path reads through the cache, twice, and returns what a plain pread() would
+    int differ = 0;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 64; i++) {
+            snprintf(name, sizeof(name), "copy%d", i);
+            size_t len = sizeof(buffer);
+            ssize_t ret = tar_read_file(archive, name, 0, buffer, &len);
+            differ += ret != 0 || len != num_bytes || memcmp(buffer, expected, len) != 0;
+        }
+    }
+    tar_read_req_t requests[2] = {
+        { "copy1", 100, buffer, sizeof(buffer), 0 },
+        { "copy2", 0, buffer + num_bytes, 10, 0 },
+    };
+    tar_read_files_batch(archive, requests, 2);
+    differ += requests[0].len != num_bytes - 100 || memcmp(buffer, expected + 100, requests[0].len) != 0;
+    differ += requests[1].status != num_bytes - 10 || memcmp(buffer + num_bytes, expected, 10) != 0;
+    FILE *copy = tmpfile();
+    size_t len = sizeof(buffer);
+    tar_read_file_to_fd(archive, "copy3", 0, &len, fileno(copy));
+    differ += len != num_bytes || pread(fileno(copy), buffer, sizeof(buffer), 0) != num_bytes
+              || memcmp(buffer, expected, len) != 0;
+    fclose(copy);
+
+    tar_cache_stats_t stats;
+    tar_cache_stats(archive, &stats);
+    printf("block cache of %zu KiB: %d reads differ, %s hits, %s misses, %s evictions\n", stats.capacity / 1024,
+           differ, stats.hits > 0 ? "some" : "no", stats.misses > 0 ? "some" : "no",
+           stats.evictions > 0 ? "some" : "no");
+    tar_close(archive);
+    fclose(file);
+}
+
+tar_archive_t *overlay_layer(FILE *file, const char *src_path, const char *const *files, const char *const *dirs) {
+    tar_writer_t *writer = tar_writer_open(fileno(file), 1);
+    if (writer == NULL) {
+        return NULL;
+    }
+    for (; *dirs != NULL; dirs++) {
+        tar_writer_add_dir(writer, *dirs, 0755);
+    }
+    for (; *files != NULL; files++) {
+        tar_writer_add_file(writer, *files, src_path);
+    }
+    tar_writer_close(writer);
+    lseek(fileno(file), 0, SEEK_SET);
+    return tar_open(fileno(file));
+}
+
+void test_overlay(const char *src_path) {
+    // the top layer deletes a/x and b, replaces the file c by a directory, makes d opaque, and the directory g a file
+    const char *base_files[] = { "a/x", "a/y", "b/z", "c", "d/old", "g/z", NULL };
+    const char *base_dirs[] = { "a", "b", "d", "g", NULL };
+    const char *top_files[] = { "a/.wh.x", "a/w", ".wh.b", "d/.wh..wh..opq", "d/new", "g", NULL };
+    const char *top_dirs[] = { "c", "e", NULL };
+    FILE *base_file = tmpfile(), *top_file = tmpfile();
+    const tar_archive_t *layers[2] = {
+        overlay_layer(base_file, src_path, base_files, base_dirs),
+        overlay_layer(top_file, src_path, top_files, top_dirs),
+    };
+    tar_overlay_t *overlay = layers[0] && layers[1] ? tar_overlay_open(layers, 2) : NULL;
+    if (overlay == NULL) {
+        printf("tar_overlay_open failed\n");
+    } else {
+        const char *paths[] = { "a/x", "a/y", "a/w", "b", "b/z", "c", "d/old", "d/new", "e", "a/.wh.x", "g/z" };
+        for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+            printf("tar_overlay_exists('%s') returned %d\n", paths[i], tar_overlay_exists(overlay, paths[i]));
+        }
+        printf("tar_overlay_is_dir('c') returned %d\n", tar_overlay_is_dir(overlay, "c"));
+        uint8_t buffer[16], expected[16];
+        size_t len = sizeof(buffer), expected_len = sizeof(expected);
+        ssize_t ret = tar_overlay_read_file(overlay, "a/y", 0, buffer, &len);
+        int same = ret == tar_read_file(layers[0], "a/y", 0, expected, &expected_len) && len == expected_len
+                   && !memcmp(buffer, expected, len);
+        printf("tar_overlay_read_file('a/y') %s the bottom layer\n", same ? "matches" : "differs from");
+        len = sizeof(buffer);
+        printf("tar_overlay_read_file('c') returned %zd\n", tar_overlay_read_file(overlay, "c", 0, buffer, &len));
+        len = sizeof(buffer);
+        printf("tar_overlay_is_file('g/z') returned %d, tar_overlay_read_file('g/z') %zd\n",
+               tar_overlay_is_file(overlay, "g/z"), tar_overlay_read_file(overlay, "g/z", 0, buffer, &len));
+
+        const char *dirs[] = { "", "a", "d/", "b", "g" };
+        for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+            tar_list_entry_t *entries;
+            ssize_t ret = tar_overlay_list_arena(overlay, dirs[i], &entries);
+            printf("tar_overlay_list_arena('%s') returned %zd:", dirs[i], ret);
+            for (ssize_t e = 0; e < ret; e++) {
+                printf(" %.*s", (int)entries[e].len, entries[e].name);
+            }
+            printf("\n");
+            free(entries);
+        }
+    }
+    tar_overlay_close(overlay);
+    tar_close((tar_archive_t *)layers[0]);
+    tar_close((tar_archive_t *)layers[1]);
+    fclose(base_file);
+    fclose(top_file);
+}
+
+void test_sidecar(int fd, const char *idx_path, const char *path) {
+    unlink(idx_path);
+
+    // the first open writes the sidecar, the second one maps it
+    for (int i = 0; i < 2; i++) {
+        tar_index_t *index = i == 0 ? tar_index_open(fd, idx_path) : tar_index_load(fd, idx_path);
+        if (index == NULL) {
+            printf("%s failed\n", i == 0 ? "tar_index_open" : "tar_index_load");
+            break;
+        }
+        printf("%s: tar_index_is_file('%s') returned %d\n", i == 0 ? "built" : "loaded",
+               path, tar_index_is_file(index, path));
+        tar_index_free(index);
+    }
+
+    tar_archive_t *archive = tar_open_indexed(fd, idx_path);
+    if (archive != NULL) {
+        uint8_t buffer[512];
+        size_t len = sizeof(buffer);
+        printf("tar_open_indexed: tar_read_file('%s', 0) returned %zd\n", path, tar_read_file(archive, path, 0, buffer, &len));
+        tar_close(archive);
+    }
+    unlink(idx_path);
+}
+
+void test_gz(int fd, const char *gz_path, const char *idx_path, const char *path, size_t offset) {
+    // compress a copy of the archive
+    gzFile out = gzopen(gz_path, "wb");
+    if (out == NULL) {
+        printf("gzopen failed\n");
+        return;
+    }
+    uint8_t chunk[65536];
+    ssize_t num_bytes;
+    lseek(fd, 0, SEEK_SET);
+    while ((num_bytes = read(fd, chunk, sizeof(chunk))) > 0) {
+        gzwrite(out, chunk, num_bytes);
+    }
+    gzclose(out);
+    lseek(fd, 0, SEEK_SET);
+
+    int gz_fd = open(gz_path, O_RDONLY);
+    unlink(idx_path);
+
+    // the first open builds the index and writes the sidecar, the second one maps it, the third one finds the last
+    // checkpoint corrupted and rebuilds the sidecar
+    const char *opens[] = { "built", "loaded", "corrupted" };
+    const size_t checkpoint_size = 8 + 8 + 4 + 4 + 32768, bits_at = 16;
+    for (int i = 0; i < 3; i++) {
+        struct stat st;
+        uint32_t bits = 9;
+        int idx_fd = open(idx_path, O_RDWR);
+        if (i == 2 && (idx_fd < 0 || fstat(idx_fd, &st) < 0
+                       || pwrite(idx_fd, &bits, sizeof(bits), st.st_size - checkpoint_size + bits_at) != sizeof(bits))) {
+            perror("corrupting the sidecar");
+        }
+        tar_gz_t *gz = tar_gz_open_indexed(gz_fd, idx_path);
+        if (gz == NULL) {
+            printf("tar_gz_open_indexed failed\n");
+            break;
+        }
+        uint8_t expected[1024], buffer[1024];
+        size_t expected_len = sizeof(expected), len = sizeof(buffer);
+        ssize_t expected_ret = read_file(fd, (char *) path, offset, expected, &expected_len);
+        ssize_t ret = tar_gz_read_file(gz, path, offset, buffer, &len);
+        printf("%s: tar_gz_read_file('%s', %zu) returned %zd, %s read_file\n", opens[i], path, offset,
+               ret, ret == expected_ret && (ret < 0 || (len == expected_len && !memcmp(buffer, expected, len))) ? "matches" : "differs from");
+        printf("tar_index_is_dir('test_dir') returned %d\n", tar_index_is_dir(tar_gz_index(gz), "test_dir"));
+        tar_gz_close(gz);
+        lseek(fd, 0, SEEK_SET);
+        if (i == 2) {
+            // the sidecar is replaced by a rename, read the new file
+            int new_fd = open(idx_path, O_RDONLY);
+            bits = 9;
+            if (new_fd >= 0 && fstat(new_fd, &st) == 0) {
+                pread(new_fd, &bits, sizeof(bits), st.st_size - checkpoint_size + bits_at);
+            }
+            if (new_fd >= 0) {
+                close(new_fd);
+            }
+            printf("the corrupted sidecar was %s\n", bits <= 7 ? "rewritten" : "kept");
+        }
+        if (idx_fd >= 0) {
+            close(idx_fd);
+        }
+    }
+
+    close(gz_fd);
+    unlink(idx_path);
+    unlink(gz_path);
+}
+
+void test_iter(int fd, const char *label) {
+    tar_iter_t it;
+    tar_iter_entry_t entry;
+    uint8_t buffer[4096];
+    size_t no_entries = 0, body_bytes = 0;
+    int ret;
+
+    if (tar_iter_init(&it, fd) < 0) {
+        printf("tar_iter_init failed\n");
+        return;
+    }
+    while ((ret = tar_iter_next(&it, &entry)) > 0) {
+        no_entries++;
+        // read every other body, skip the others
+        if (no_entries % 2 == 0) {
+            ssize_t num_bytes;
+            while ((num_bytes = tar_iter_read_body(&it, buffer, sizeof(buffer))) > 0) {
+                body_bytes += num_bytes;
+            }
+        }
+    }
+    tar_iter_close(&it);
+
+    printf("tar_iter on %s returned %d: %zu entries, %zu bytes read\n", label, ret, no_entries, body_bytes);
+}
+
+typedef struct {
+    int tar_fd;
+    int pipe_fd;
+} pipe_feed_t;
+
+void *feed_pipe(void *arg) {
+    pipe_feed_t *feed = arg;
+    uint8_t buffer[1000];
+    ssize_t num_bytes;
+    off_t offset = 0;
+
+    // odd-sized writes, so headers straddle reads
+    while ((num_bytes = pread(feed->tar_fd, buffer, sizeof(buffer), offset)) > 0) {
+        if (write(feed->pipe_fd, buffer, num_bytes) != num_bytes) {
+            break;
+        }
+        offset += num_bytes;
+    }
+    close(feed->pipe_fd);
+    return NULL;
+}
+
+void test_iter_pipe(int fd) {
+    int fds[2];
+    pthread_t thread;
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return;
+    }
+    pipe_feed_t feed = { fd, fds[1] };
+    pthread_create(&thread, NULL, feed_pipe, &feed);
+    test_iter(fds[0], "a pipe");
+    // drain what the iterator left behind the end of the archive
+    uint8_t buffer[4096];
+    while (read(fds[0], buffer, sizeof(buffer)) > 0) {
+    }
+    pthread_join(thread, NULL);
+    close(fds[0]);
+}
+
+void test_read_file_mmap(int fd, const char *path, size_t offset) {
+    tar_mmap_t *archive = tar_open_mmap(fd);
+    if (archive == NULL) {
+        printf("tar_open_mmap failed\n");
+        lseek(fd, 0, SEEK_SET);
+        return;
+    }
+
+    const uint8_t *data = NULL;
+    size_t len = 512;
+    ssize_t ret = tar_mmap_read_file(archive, path, offset, &data, &len);
+
+    printf("tar_mmap_read_file('%s', %zu) returned %zd\n", path, offset, ret);
+    if (ret >= 0) {
+        printf("Length: %zu\n", len);
+    }
+    tar_close_mmap(archive);
+    lseek(fd, 0, SEEK_SET);
+}
+
+#define STRESS_MAX_PATHS 128
+#define STRESS_QUERIES 6
+#define STRESS_ROUNDS 20000
+
+typedef struct {
+    tar_archive_t *archive;
+    char paths[STRESS_MAX_PATHS][100];
+    size_t no_paths;
+    unsigned long expected[STRESS_MAX_PATHS][STRESS_QUERIES];
+    size_t mismatches;
+    pthread_mutex_t lock;
+} stress_t;
+
+unsigned long hash_bytes(unsigned long hash, const void *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = hash * 31 + ((const uint8_t *)bytes)[i];
+    }
+    return hash;
+}
+
+/* Runs one query and sums up everything it returned */
+unsigned long stress_query(const tar_archive_t *archive, const char *path, int query) {
+    switch (query) {
+    case 0:
+        return tar_exists(archive, path);
+    case 1:
+        return tar_is_dir(archive, path);
+    case 2:
+        return tar_is_file(archive, path);
+    case 3:
+        return tar_is_symlink(archive, path);
+    case 4: {
+        char buffers[16][100];
+        char *entries[16];
+        for (int i = 0; i < 16; i++) {
+            entries[i] = buffers[i];
+        }
+        size_t no_entries = 16;
+        unsigned long hash = tar_list(archive, path, entries, &no_entries);
+        hash = hash_bytes(hash, &no_entries, sizeof(no_entries));
+        for (size_t i = 0; i < no_entries && i < 16; i++) {
+            hash = hash_bytes(hash, entries[i], strlen(entries[i]));
+        }
+        return hash;
+    }
+    default: {
+        uint8_t buffer[64];
+        size_t len = sizeof(buffer);
+        ssize_t ret = tar_read_file(archive, path, 3, buffer, &len);
+        unsigned long hash = hash_bytes(ret, &len, sizeof(len));
+        return ret >= 0 ? hash_bytes(hash, buffer, len) : hash;
+    }
+    }
+}
+
+void *stress_worker(void *arg) {
+    stress_t *stress = arg;
+    unsigned int seed = (unsigned int)(uintptr_t)pthread_self();
+    size_t mismatches = 0;
+
+    for (int i = 0; i < STRESS_ROUNDS; i++) {
+        size_t path = rand_r(&seed) % stress->no_paths;
+        int query = rand_r(&seed) % STRESS_QUERIES;
+        if (stress_query(stress->archive, stress->paths[path], query) != stress->expected[path][query]) {
+            mismatches++;
+        }
+    }
+
+    pthread_mutex_lock(&stress->lock);
+    stress->mismatches += mismatches;
+    pthread_mutex_unlock(&stress->lock);
+    return NULL;
+}
+
+void test_concurrent_queries(int fd, int nthreads, size_t cache_budget) {
+    stress_t *stress = calloc(1, sizeof(stress_t));
+    stress->archive = tar_open(fd);
+    if (stress->archive == NULL || tar_cache_enable(stress->archive, cache_budget) < 0) {
+        printf("tar_open failed\n");
+        tar_close(stress->archive);
+        free(stress);
+        return;
+    }
+    pthread_mutex_init(&stress->lock, NULL);
+
+    // top-level entries, their children and a few missing paths
+    char *entries[STRESS_MAX_PATHS];
+    size_t no_entries = STRESS_MAX_PATHS / 2;
+    for (size_t i = 0; i < STRESS_MAX_PATHS; i++) {
+        entries[i] = stress->paths[i];
+    }
+    tar_list(stress->archive, "", entries, &no_entries);
+    stress->no_paths = no_entries < STRESS_MAX_PATHS / 2 ? no_entries : STRESS_MAX_PATHS / 2;
+    for (size_t i = 0, top = stress->no_paths; i < top && stress->no_paths < STRESS_MAX_PATHS - 2; i++) {
+        no_entries = STRESS_MAX_PATHS - 2 - stress->no_paths;
+        tar_list(stress->archive, stress->paths[i], entries + stress->no_paths, &no_entries);
+        stress->no_paths += no_entries < STRESS_MAX_PATHS - 2 - stress->no_paths ? no_entries : STRESS_MAX_PATHS - 2 - stress->no_paths;
+    }
+    strcpy(stress->paths[stress->no_paths++], "missing");
+    strcpy(stress->paths[stress->no_paths++], "missing/dir/");
+
+    // single-threaded answers
+    for (size_t i = 0; i < stress->no_paths; i++) {
+        for (int query = 0; query < STRESS_QUERIES; query++) {
+            stress->expected[i][query] = stress_query(stress->archive, stress->paths[i], query);
+        }
+    }
+
+    pthread_t threads[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, stress_worker, stress);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%d threads, %zu KiB of cache: %d queries on %zu paths, %zu mismatches\n", nthreads, cache_budget / 1024,
+           nthreads * STRESS_ROUNDS, stress->no_paths, stress->mismatches);
+    pthread_mutex_destroy(&stress->lock);
+    tar_close(stress->archive);
+    free(stress);
+}
+
+off_t refresh_append(int fd, off_t at, const char *src_path, const char *const *files, const char *link,
+                     const char *target) {
+    lseek(fd, at, SEEK_SET);
+    tar_writer_t *writer = tar_writer_open(fd, 1);
+    if (writer == NULL) {
+        return at;
+    }
+    for (; *files != NULL; files++) {
+        tar_writer_add_file(writer, *files, src_path);
+    }
+    if (link != NULL) {
+        tar_writer_add_symlink(writer, link, target);
+    }
+    tar_writer_close(writer);
+    // the end-of-archive marker the next entries are written over, as tar -r does
+    return lseek(fd, 0, SEEK_END) - 2 * sizeof(tar_header_t);
+}
+
+void test_refresh(const char *src_path) {
+    static const char content[] = "appended later";
+    char new_path[] = "/tmp/lib_tar_refresh_XXXXXX";
+    int new_fd = mkstemp(new_path);
+    ssize_t num_bytes = new_fd >= 0 ? write(new_fd, content, sizeof(content)) : -1;
+    close(new_fd);
+
+    FILE *file = tmpfile();
+    int fd = fileno(file);
+    const char *files[] = { "logs/a", NULL };
+    const char *dirs[] = { "logs", NULL };
+    tar_archive_t *archive = overlay_layer(file, src_path, files, dirs);
+    if (archive == NULL || tar_cache_enable(archive, 256 * 1024) < 0) {
+        printf("tar_open failed\n");
+        tar_close(archive);
+        fclose(file);
+        unlink(new_path);
+        return;
+    }
+    uint8_t buffer[64];
+    size_t len = sizeof(buffer);
+    tar_read_file(archive, "logs/a", 0, buffer, &len);
+    printf("tar_index_refresh() returned %d before appending\n", tar_index_refresh(archive));
+
+    // logs/a is replaced, and latest leads to a file in directories the archive did not have
+    const char *appended[] = { "logs/a", "new/deep/b", NULL };
+    off_t end = refresh_append(fd, lseek(fd, 0, SEEK_END) - 2 * sizeof(tar_header_t), new_path, appended, "latest",
+                               "new/deep/b");
+    printf("tar_index_refresh() returned %d after appending 3 entries\n", tar_index_refresh(archive));
+    len = sizeof(buffer);
+    ssize_t ret = tar_read_file(archive, "logs/a", 0, buffer, &len);
+    printf("tar_read_file('logs/a') %s the appended file\n",
+           ret == 0 && len == num_bytes && memcmp(buffer, content, len) == 0 ? "returned" : "did not return");
+    len = sizeof(buffer);
+    ret = tar_read_file(archive, "latest", 0, buffer, &len);
+    printf("tar_read_file('latest') %s the appended file\n",
+           ret == 0 && len == num_bytes && memcmp(buffer, content, len) == 0 ? "returned" : "did not return");
+    const char *list_dirs[] = { "", "logs", "new/deep" };
+    for (size_t i = 0; i < sizeof(list_dirs) / sizeof(list_dirs[0]); i++) {
+        tar_list_entry_t *entries;
+        ssize_t no_entries = tar_list_arena(archive, list_dirs[i], &entries);
+        printf("tar_list_arena('%s') returned %zd:", list_dirs[i], no_entries);
+        for (ssize_t e = 0; e < no_entries; e++) {
+            printf(" %.*s", (int)entries[e].len, entries[e].name);
+        }
+        printf("\n");
+        free(entries);
+    }
+
+    // an entry whose body is not fully written yet is left for later
+    const char *partial[] = { "logs/c", NULL };
+    refresh_append(fd, end, new_path, partial, NULL, NULL);
+    if (ftruncate(fd, end + sizeof(tar_header_t) + 4) < 0) {
+        perror("ftruncate");
+    }
+    printf("tar_index_refresh() returned %d with a partial entry, ", tar_index_refresh(archive));
+    printf("tar_exists('logs/c') returned %d\n", tar_exists(archive, "logs/c"));
+    end = refresh_append(fd, end, new_path, partial, NULL, NULL);
+    printf("tar_index_refresh() returned %d once it is complete, ", tar_index_refresh(archive));
+    printf("tar_exists('logs/c') returned %d\n", tar_exists(archive, "logs/c"));
+
+    // an invalid appended header is reported and leaves the index as it was
+    memset(buffer, 'x', sizeof(buffer));
+    if (pwrite(fd, buffer, sizeof(buffer), end) != sizeof(buffer)) {
+        perror("pwrite");
+    }
+    printf("tar_index_refresh() returned %d after appending garbage\n", tar_index_refresh(archive));
+
+    tar_close(archive);
+    fclose(file);
+    unlink(new_path);
+}
+
+void test_digest(void) {
+    // files of known digests, copies of them, and empty files which are never duplicates
+    const char *contents[] = { "abc", "Nobody inspects the spammish repetition", "123456789", "" };
+    const char *names[][2] = { { "abc", "copy/abc" }, { "spam", "copy/spam" }, { "digits", NULL }, { "e1", "e2" } };
+    char src_paths[4][32];
+    FILE *file = tmpfile();
+    tar_writer_t *writer = tar_writer_open(fileno(file), 2);
+    for (int i = 0; i < 4; i++) {
+        strcpy(src_paths[i], "/tmp/lib_tar_digest_XXXXXX");
+        int src_fd = mkstemp(src_paths[i]);
+        if (src_fd < 0 || write(src_fd, contents[i], strlen(contents[i])) != (ssize_t)strlen(contents[i])) {
+            perror("mkstemp");
+        }
+        close(src_fd);
+        for (int j = 0; j < 2 && writer != NULL && names[i][j] != NULL; j++) {
+            tar_writer_add_file(writer, names[i][j], src_paths[i]);
+        }
+    }
+    if (writer != NULL) {
+        tar_writer_close(writer);
+    }
+    for (int i = 0; i < 4; i++) {
+        unlink(src_paths[i]);
+    }
+
+    lseek(fileno(file), 0, SEEK_SET);
+    tar_archive_t *archive = tar_open(fileno(file));
+    if (archive == NULL) {
+        printf("tar_open failed\n");
+        fclose(file);
+        return;
+    }
+    uint64_t digest = 0;
+    printf("tar_digest('abc') before digesting returned %d\n", tar_digest(archive, "abc", &digest));
+    printf("tar_digest_all(XXH64) returned %d\n", tar_digest_all(archive, TAR_DIGEST_XXH64, 2));
+    const char *paths[] = { "abc", "spam", "copy/spam", "copy" };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        digest = 0;
+        int ret = tar_digest(archive, paths[i], &digest);
+        printf("tar_digest('%s') returned %d: %016llx\n", paths[i], ret, (unsigned long long)digest);
+    }
+    printf("tar_digest_all(CRC32C) returned %d, ", tar_digest_all(archive, TAR_DIGEST_CRC32C, 1));
+    tar_digest(archive, "digits", &digest);
+    printf("tar_digest('digits'): %08llx\n", (unsigned long long)digest);
+
+    tar_digest_entry_t *dups;
+    ssize_t no_dups = tar_digest_duplicates(archive, &dups);
+    printf("tar_digest_duplicates() returned %zd:", no_dups);
+    for (ssize_t i = 0; i < no_dups; i++) {
+        printf(" %zu:%.*s", dups[i].group, (int)dups[i].len, dups[i].name);
+    }
+    printf("\n");
+    free(dups);
+    tar_close(archive);
+    fclose(file);
+}
+
+void test_query(void) {
+    const char *names[] = { "src/a.c", "src/b.h", "src/lib/c.c", "src/lib/deep/d.c", "doc/readme", "src-old/x.c" };
+    char src_path[] = "/tmp/lib_tar_query_XXXXXX";
+    int src_fd = mkstemp(src_path);
+    if (src_fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    close(src_fd);
+    FILE *file = tmpfile();
+    tar_writer_t *writer = tar_writer_open(fileno(file), 2);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]) && writer != NULL; i++) {
+        tar_writer_add_file(writer, names[i], src_path);
+    }
+    if (writer != NULL) {
+        tar_writer_close(writer);
+    }
+    unlink(src_path);
+
+    lseek(fileno(file), 0, SEEK_SET);
+    tar_archive_t *archive = tar_open(fileno(file));
+    if (archive == NULL) {
+        printf("tar_open failed\n");
+        fclose(file);
+        return;
+    }
+    const char *patterns[] = { "src/**", "**/*.c", "src/[a-b].?", "src*/[!b]*", "/doc//./readme", "nothing/*" };
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        char found[2][256] = { "", "" };
+        for (int threaded = 0; threaded < 2; threaded++) {
+            tar_query_t *query = tar_query_open(archive, patterns[i], threaded ? 4 : 1);
+            tar_list_entry_t entry;
+            while (query != NULL && tar_query_next(query, &entry) == 1) {
+                size_t len = strlen(found[threaded]);
+                snprintf(found[threaded] + len, sizeof(found[threaded]) - len, " %.*s", (int)entry.len, entry.name);
+            }
+            tar_query_close(query);
+        }
+        printf("tar_query('%s') returned%s, %s on 4 threads\n", patterns[i], found[0],
+               strcmp(found[0], found[1]) == 0 ? "the same" : "different");
+    }
+    tar_close(archive);
+    fclose(file);
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         printf("Usage: %s tar_file\n", argv[0]);
@@ -97,6 +1237,8 @@ int main(int argc, char **argv) {
 
     // Test check_archive
     test_check_archive(fd);
+    test_check_archive_parallel(fd, 1);
+    test_check_archive_parallel(fd, 4);
 
     // Test exists
     test_exists(fd, "lib_tar.h");
@@ -116,11 +1258,119 @@ int main(int argc, char **argv) {
 
     // Test list
     test_list(fd, "test_dir");
+    test_list(fd, "lien_dir");
 
     // Test read_file
     test_read_file(fd, "lib_tar.h", 0);
     test_read_file(fd, "lib_tar.h", 10);
 
+    // Test vectorized kernels against the scalar ones
+    test_checksum_kernels(fd);
+
+    // Test with the smallest scan window
+    tar_set_scan_window(512);
+    test_check_archive(fd);
+    test_list(fd, "test_dir/");
+    test_read_file(fd, "lib_tar.h", 10);
+    tar_set_scan_window(0);
+
+    // Test index
+    test_index(fd, "lib_tar.c");
+    test_index(fd, "test_dir");
+    test_index(fd, "lien_symb.c");
+    test_index(fd, "file.txt");
+    // a trailing slash only names a directory, through a link if it leads to one
+    test_index(fd, "file.txt/");
+    test_index(fd, "test_dir/");
+    test_index(fd, "lien_dir/");
+    test_tar_read_file(fd, "file.txt/", 0);
+
+    // Test directory tree
+    test_tar_list(fd, "");
+    test_tar_list(fd, "test_dir/");
+    test_tar_list(fd, "lien_dir");
+    test_tar_list(fd, "impl");
+    test_tar_list(fd, "impl/deep/");
+    test_tar_list(fd, "file.txt");
+    test_tar_list_arena(fd, "test_dir/");
+    test_tar_list_arena(fd, "lien_dir");
+    test_tar_list_arena(fd, "file.txt");
+
+    // Test symlink resolution
+    test_tar_read_file(fd, "chain", 0);
+    test_tar_read_file(fd, "test_dir/rel", 0);
+    test_tar_read_file(fd, "test_dir/up/a", 0);
+    test_tar_read_file(fd, "lien_dir/sub/b", 1);
+    test_tar_read_file(fd, "loop_a", 0);
+    test_tar_list(fd, "test_dir/up/sub");
+    test_index(fd, "lien_dir/a");
+    test_read_files_batch(fd);
+
+    // Test copies to another file descriptor
+    test_read_file_to_fd(fd, "chain", 0);
+    test_read_file_to_fd(fd, "lib_tar.h", 100);
+    test_read_file_to_fd(fd, "lib_tar.c", 0);
+    test_read_file_to_fd(fd, "test_dir", 0);
+
+    // Test statistics
+    test_stats(fd, "chain");
+    test_stats(fd, "lib_tar.h");
+
+    // Test extraction
+    test_extract(fd, 4, "lib_tar.c");
+    test_extract(fd, 1, "chain");
+    test_extract(fd, 0, "impl/deep/f");
+    test_extract_read_only();
+
+    // Test archive writer
+    test_writer(argv[1], 4);
+    test_base256_size();
+
+    // Test overlays
+    test_overlay(argv[1]);
+
+    // Test block cache
+    test_cache();
+
+    // Test refreshing the index of an appended archive
+    test_refresh(argv[1]);
+
+    // Test content digests
+    test_digest();
+
+    // Test glob queries
+    test_query();
+
+    // Test asynchronous reads
+    test_aio(fd, 0, 4);
+    test_aio(fd, TAR_AIO_THREADS, 4);
+
+    // Test sidecar index
+    char idx_path[4096];
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", argv[1]);
+    test_sidecar(fd, idx_path, "lien_dir/a");
+
+    // Test gzip-compressed archive
+    char gz_path[4096];
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", argv[1]);
+    test_gz(fd, gz_path, idx_path, "lib_tar.c", 0);
+    test_gz(fd, gz_path, idx_path, "chain", 100);
+
+    // Test streaming iterator
+    test_iter(fd, "the archive");
+    lseek(fd, 0, SEEK_SET);
+    test_iter_pipe(fd);
+
+    // Test mmap
+    test_read_file_mmap(fd, "lib_tar.h", 0);
+    test_read_file_mmap(fd, "lib_tar.h", 10);
+    test_read_file_mmap(fd, "lien_symb.c", 0);
+    test_read_file_mmap(fd, "test_dir", 0);
+
+    // Test concurrent queries on one handle
+    test_concurrent_queries(fd, 8, 0);
+    test_concurrent_queries(fd, 8, 64 * 1024);
+
     close(fd);
     return 0;
 }
\ No newline at end of file